@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
 #include <string.h>
 
 #include "up-device.h"
@@ -450,7 +451,8 @@ up_device_refresh_sync (UpDevice *device, GCancellable *cancellable, GError **er
 /**
  * up_device_get_history_sync:
  * @device: a #UpDevice instance.
- * @type: The type of history, known values are "rate" and "charge".
+ * @type: The type of history, known values are "rate", "charge", "time-full",
+ *   "time-empty", "voltage", "temperature" and "energy".
  * @timespec: the amount of time to look back into time.
  * @resolution: the resolution of data.
  * @cancellable: a #GCancellable or %NULL
@@ -530,6 +532,56 @@ out:
 	return array;
 }
 
+/**
+ * up_device_get_history_fd:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate", "charge", "time-full",
+ *   "time-empty", "voltage", "temperature" and "energy".
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets all the device history of @type as a file descriptor, which avoids
+ * sending large amounts of history over the message bus. The format is
+ * described for the GetHistoryFd method of the D-Bus interface.
+ *
+ * Return value: a file descriptor positioned at the start of the data,
+ *               which the caller must close; -1 if @error is set
+ *
+ * Since: 1.90.10
+ **/
+gint
+up_device_get_history_fd (UpDevice *device, const gchar *type, GCancellable *cancellable, GError **error)
+{
+	g_autoptr(GUnixFDList) fd_list = NULL;
+	GError *error_local = NULL;
+	gint handle;
+	gint fd;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), -1);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, -1);
+
+	if (!up_exported_device_call_get_history_fd_sync (device->priv->proxy_device,
+							  type,
+							  NULL,
+							  &handle,
+							  &fd_list,
+							  cancellable,
+							  &error_local)) {
+		g_set_error (error, 1, 0, "GetHistoryFd(%s) on %s failed: %s", type,
+			     up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		return -1;
+	}
+
+	fd = g_unix_fd_list_get (fd_list, handle, &error_local);
+	if (fd < 0) {
+		g_set_error (error, 1, 0, "GetHistoryFd(%s) on %s returned no data: %s", type,
+			     up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+	}
+	return fd;
+}
+
 /**
  * up_device_get_statistics_sync:
  * @device: a #UpDevice instance.
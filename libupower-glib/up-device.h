@@ -83,6 +83,10 @@ GPtrArray	*up_device_get_history_sync		(UpDevice		*device,
 							 guint			 resolution,
 							 GCancellable		*cancellable,
 							 GError			**error);
+gint		 up_device_get_history_fd		(UpDevice		*device,
+							 const gchar		*type,
+							 GCancellable		*cancellable,
+							 GError			**error);
 GPtrArray	*up_device_get_statistics_sync		(UpDevice		*device,
 							 const gchar		*type,
 							 GCancellable		*cancellable,
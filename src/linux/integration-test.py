@@ -2974,7 +2974,7 @@ class Tests(dbusmock.DBusTestCase):
 
         # This saves the old history, and then opens a new one
         self.daemon_log.check_line_re(
-            "saved .*/history-time-empty-Fake_Battery-80-001.dat", timeout=1
+            "saved .*/history-Fake_Battery-80-001.bin", timeout=1
         )
         self.daemon_log.check_line("using id: Fake_Battery-90-002", timeout=1)
 
@@ -2987,7 +2987,7 @@ class Tests(dbusmock.DBusTestCase):
 
         # This saves the old history, and does *not* open a new one
         self.daemon_log.check_line_re(
-            "saved .*/history-time-empty-Fake_Battery-90-002.dat", timeout=1
+            "saved .*/history-Fake_Battery-90-002.bin", timeout=1
         )
         self.daemon_log.check_no_line("using id:", wait=1.0)
 
@@ -376,6 +376,8 @@ up_device_hid_refresh (UpDevice *device, UpRefreshReason reason)
 	/* it's okay if there's nothing as we are non-blocking */
 	if (rd == -1) {
 		g_debug ("no data");
+		if (errno != EAGAIN)
+			up_device_refresh_failed (device);
 		ret = FALSE;
 		goto out;
 	}
@@ -383,6 +385,7 @@ up_device_hid_refresh (UpDevice *device, UpRefreshReason reason)
 	/* did we read enough data? */
 	if (rd < (int) sizeof (ev[0])) {
 		g_warning ("incomplete read (%i<%i)", rd, (int) sizeof (ev[0]));
+		up_device_refresh_failed (device);
 		goto out;
 	}
 
@@ -42,12 +42,11 @@
 struct UpDeviceIdevicePrivate
 {
 	idevice_t		 dev;
+	char			*uuid;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpDeviceIdevice, up_device_idevice, UP_TYPE_DEVICE)
 
-static gboolean		 up_device_idevice_refresh		(UpDevice *device, UpRefreshReason reason);
-
 static const char *
 lockdownd_error_to_string (lockdownd_error_t lerr)
 {
@@ -202,39 +201,47 @@ up_device_idevice_coldplug (UpDevice *device)
 
 	g_object_set (idevice, "poll-timeout", 5, NULL);
 
-	g_free (uuid);
+	/* for the refreshes, which can't look at the properties */
+	g_free (idevice->priv->uuid);
+	idevice->priv->uuid = uuid;
 
 	return TRUE;
 }
 
+/* what a refresh got from the device, see up_device_idevice_refresh_collect() */
+typedef struct {
+	idevice_t		 dev;	/* opened by the refresh, or NULL */
+	char			*name;
+	gboolean		 has_battery;
+	guint64			 percentage;
+	guint8			 charging;
+} UpDeviceIdeviceData;
+
 /**
- * up_device_idevice_refresh:
+ * up_device_idevice_refresh_collect:
  *
- * Return %TRUE on success, %FALSE if we failed to refresh or no data
+ * Asks the device over lockdownd, which can take a while. This runs on
+ * a worker thread, and is the only user of priv->dev while it does.
+ *
+ * Return value: the data, or %NULL if we could not talk to the device
  **/
-static gboolean
-up_device_idevice_refresh (UpDevice *device, UpRefreshReason reason)
+static gpointer
+up_device_idevice_refresh_collect (UpDevice *device, UpRefreshReason reason)
 {
 	UpDeviceIdevice *idevice = UP_DEVICE_IDEVICE (device);
 	idevice_t dev = idevice->priv->dev;
 	lockdownd_client_t client = NULL;
 	lockdownd_error_t lerr;
-	char *name = NULL;
+	UpDeviceIdeviceData *data = NULL;
 	plist_t dict, node;
-	guint64 percentage;
-	guint8 charging, has_battery;
-	UpDeviceState state;
-	gboolean retval = FALSE;
+	guint8 has_battery;
 
 	/* No device yet, try to open it */
 	if (!dev) {
-		g_autofree char *uuid = NULL;
-
-		g_object_get (G_OBJECT (idevice), "serial", &uuid, NULL);
-		g_assert (uuid);
+		g_assert (idevice->priv->uuid);
 
 		/* Connect to the device */
-		if (idevice_new (&dev, uuid) != IDEVICE_E_SUCCESS)
+		if (idevice_new (&dev, idevice->priv->uuid) != IDEVICE_E_SUCCESS)
 			goto out;
 	}
 
@@ -244,14 +251,11 @@ up_device_idevice_refresh (UpDevice *device, UpRefreshReason reason)
 		goto out;
 	}
 
-	if (lockdownd_get_device_name (client, &name) == LOCKDOWN_E_SUCCESS) {
-		/* Prefer the user-chosen name for the device when available */
-		g_object_set (device,
-			      "vendor", NULL,
-			      "model", name,
-			      NULL);
-		free (name);
-	}
+	data = g_new0 (UpDeviceIdeviceData, 1);
+
+	/* Prefer the user-chosen name for the device when available */
+	if (lockdownd_get_device_name (client, &data->name) != LOCKDOWN_E_SUCCESS)
+		data->name = NULL;
 
 	if (lockdownd_get_value (client, "com.apple.mobile.battery", NULL, &dict) != LOCKDOWN_E_SUCCESS)
 		goto out;
@@ -271,10 +275,7 @@ up_device_idevice_refresh (UpDevice *device, UpRefreshReason reason)
 		plist_free (dict);
 		goto out;
 	}
-	plist_get_uint_val (node, &percentage);
-
-	g_object_set (device, "percentage", (double) percentage, NULL);
-	g_debug ("percentage=%"G_GUINT64_FORMAT, percentage);
+	plist_get_uint_val (node, &data->percentage);
 
 	/* get charging status */
 	node = plist_dict_get_item (dict, "BatteryIsCharging");
@@ -282,13 +283,60 @@ up_device_idevice_refresh (UpDevice *device, UpRefreshReason reason)
 		plist_free(dict);
 		goto out;
 	}
-	plist_get_bool_val (node, &charging);
+	plist_get_bool_val (node, &data->charging);
+	plist_free (dict);
+
+	data->has_battery = TRUE;
+	if (!idevice->priv->dev)
+		data->dev = dev;
+
+out:
+	/* Free device if we created it and it is not handed over. */
+	if (dev && !idevice->priv->dev && (data == NULL || data->dev == NULL))
+		idevice_free (dev);
+	lockdownd_client_free (client);
+
+	return data;
+}
+
+/**
+ * up_device_idevice_refresh_apply:
+ *
+ * Return %TRUE on success, %FALSE if we failed to refresh or no data
+ **/
+static gboolean
+up_device_idevice_refresh_apply (UpDevice *device, UpRefreshReason reason, gpointer user_data)
+{
+	UpDeviceIdevice *idevice = UP_DEVICE_IDEVICE (device);
+	UpDeviceIdeviceData *data = user_data;
+	UpDeviceState state;
+	gboolean retval = FALSE;
+
+	/* locked, unpaired or gone; back off until it answers */
+	if (data == NULL) {
+		up_device_refresh_failed (device);
+		return FALSE;
+	}
 
-	if (percentage == 100)
+	if (data->name != NULL) {
+		g_object_set (device,
+			      "vendor", NULL,
+			      "model", data->name,
+			      NULL);
+		free (data->name);
+	}
+
+	if (!data->has_battery)
+		goto out;
+
+	g_object_set (device, "percentage", (double) data->percentage, NULL);
+	g_debug ("percentage=%"G_GUINT64_FORMAT, data->percentage);
+
+	if (data->percentage == 100)
 		state = UP_DEVICE_STATE_FULLY_CHARGED;
-	else if (percentage == 0)
+	else if (data->percentage == 0)
 		state = UP_DEVICE_STATE_EMPTY;
-	else if (charging)
+	else if (data->charging)
 		state = UP_DEVICE_STATE_CHARGING;
 	else
 		state = UP_DEVICE_STATE_DISCHARGING; /* upower doesn't have a "not charging" state */
@@ -298,29 +346,39 @@ up_device_idevice_refresh (UpDevice *device, UpRefreshReason reason)
 		      NULL);
 	g_debug ("state=%s", up_device_state_to_string (state));
 
-	plist_free (dict);
-
 	/* reset time */
 	g_object_set (device, "update-time", (guint64) g_get_real_time () / G_USEC_PER_SEC, NULL);
 
 	retval = TRUE;
 
-	if (!idevice->priv->dev) {
+	if (data->dev) {
 		/* Device is working, mark as present and poll less frequently */
 		g_object_set (G_OBJECT (idevice), "is-present", TRUE, NULL);
 		g_object_set (idevice, "poll-timeout", UP_DAEMON_SHORT_TIMEOUT, NULL);
-		idevice->priv->dev = dev;
+		idevice->priv->dev = data->dev;
 	}
 
 out:
-	/* Free device if we created it and it was not stored. */
-	if (dev && !idevice->priv->dev)
-		idevice_free (dev);
-	lockdownd_client_free (client);
-
+	g_free (data);
 	return retval;
 }
 
+/**
+ * up_device_idevice_refresh_free:
+ **/
+static void
+up_device_idevice_refresh_free (UpDevice *device, gpointer user_data)
+{
+	UpDeviceIdeviceData *data = user_data;
+
+	if (data == NULL)
+		return;
+	free (data->name);
+	if (data->dev)
+		idevice_free (data->dev);
+	g_free (data);
+}
+
 /**
  * up_device_idevice_init:
  **/
@@ -346,6 +404,7 @@ up_device_idevice_finalize (GObject *object)
 
 	if (idevice->priv->dev != NULL)
 		idevice_free (idevice->priv->dev);
+	g_free (idevice->priv->uuid);
 
 	G_OBJECT_CLASS (up_device_idevice_parent_class)->finalize (object);
 }
@@ -361,5 +420,7 @@ up_device_idevice_class_init (UpDeviceIdeviceClass *klass)
 
 	object_class->finalize = up_device_idevice_finalize;
 	device_class->coldplug = up_device_idevice_coldplug;
-	device_class->refresh = up_device_idevice_refresh;
+	device_class->refresh_collect = up_device_idevice_refresh_collect;
+	device_class->refresh_apply = up_device_idevice_refresh_apply;
+	device_class->refresh_free = up_device_idevice_refresh_free;
 }
@@ -70,8 +70,6 @@ struct UpDeviceWupPrivate
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpDeviceWup, up_device_wup, UP_TYPE_DEVICE)
 
-static gboolean		 up_device_wup_refresh	 	(UpDevice *device, UpRefreshReason reason);
-
 /**
  * up_device_wup_set_speed:
  **/
@@ -360,21 +358,31 @@ out:
 }
 
 /**
- * up_device_wup_refresh:
+ * up_device_wup_refresh_collect:
+ *
+ * Reads from the serial port, which can take a while, on a worker thread.
+ **/
+static gpointer
+up_device_wup_refresh_collect (UpDevice *device, UpRefreshReason reason)
+{
+	return up_device_wup_read_command (UP_DEVICE_WUP (device));
+}
+
+/**
+ * up_device_wup_refresh_apply:
  *
  * Return %TRUE on success, %FALSE if we failed to refresh or no data
  **/
 static gboolean
-up_device_wup_refresh (UpDevice *device, UpRefreshReason reason)
+up_device_wup_refresh_apply (UpDevice *device, UpRefreshReason reason, gpointer user_data)
 {
 	gboolean ret = FALSE;
-	gchar *data = NULL;
+	gchar *data = user_data;
 	UpDeviceWup *wup = UP_DEVICE_WUP (device);
 
-	/* get data */
-	data = up_device_wup_read_command (wup);
 	if (data == NULL) {
 		g_debug ("no data");
+		up_device_refresh_failed (device);
 		goto out;
 	}
 
@@ -394,6 +402,15 @@ out:
 	return TRUE;
 }
 
+/**
+ * up_device_wup_refresh_free:
+ **/
+static void
+up_device_wup_refresh_free (UpDevice *device, gpointer user_data)
+{
+	g_free (user_data);
+}
+
 /**
  * up_device_wup_init:
  **/
@@ -435,5 +452,7 @@ up_device_wup_class_init (UpDeviceWupClass *klass)
 
 	object_class->finalize = up_device_wup_finalize;
 	device_class->coldplug = up_device_wup_coldplug;
-	device_class->refresh = up_device_wup_refresh;
+	device_class->refresh_collect = up_device_wup_refresh_collect;
+	device_class->refresh_apply = up_device_wup_refresh_apply;
+	device_class->refresh_free = up_device_wup_refresh_free;
 }
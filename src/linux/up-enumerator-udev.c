@@ -310,7 +310,7 @@ uevent_signal_handler_cb (UpEnumeratorUdev *self,
 			}
 
 			g_debug ("refreshing device for path %s", g_udev_device_get_sysfs_path (device));
-			if (!up_device_refresh_internal (UP_DEVICE (obj), UP_REFRESH_EVENT))
+			if (up_device_refresh_internal (UP_DEVICE (obj), UP_REFRESH_EVENT) == UP_REFRESH_RESULT_UNCHANGED)
 				g_debug ("no changes on %s", up_device_get_object_path (UP_DEVICE (obj)));
 
 		}
@@ -42,6 +42,16 @@ G_DEFINE_TYPE_WITH_PRIVATE (UpConfig, up_config, G_TYPE_OBJECT)
 
 static gpointer up_config_object = NULL;
 
+/**
+ * up_config_has_key:
+ **/
+gboolean
+up_config_has_key (UpConfig *config, const gchar *key)
+{
+	return g_key_file_has_key (config->priv->keyfile,
+				   "UPower", key, NULL);
+}
+
 /**
  * up_config_get_boolean:
  **/
@@ -74,7 +84,7 @@ up_config_get_uint (UpConfig *config, const gchar *key)
 gdouble
 up_config_get_double (UpConfig *config, const gchar *key)
 {
-	int val;
+	gdouble val;
 
 	val = g_key_file_get_double (config->priv->keyfile,
 				     "UPower", key, NULL);
@@ -48,6 +48,8 @@ struct _UpConfigClass
 
 GType		 up_config_get_type		(void);
 UpConfig	*up_config_new			(void);
+gboolean	 up_config_has_key		(UpConfig	*config,
+						 const gchar	*key);
 gboolean	 up_config_get_boolean		(UpConfig	*config,
 						 const gchar	*key);
 guint		 up_config_get_uint		(UpConfig	*config,
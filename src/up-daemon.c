@@ -35,6 +35,8 @@
 #include "up-device.h"
 #include "up-backend.h"
 #include "up-daemon.h"
+#include "up-event-log.h"
+#include "up-poll-queue.h"
 
 struct UpDaemonPrivate
 {
@@ -43,11 +45,16 @@ struct UpDaemonPrivate
 	UpPolkit		*polkit;
 	UpBackend		*backend;
 	UpDeviceList		*power_devices;
+	UpHistoryWriter		*history_writer;
+	UpEventLog		*event_log;
 	guint			 action_timeout_id;
 	guint			 refresh_batteries_id;
 	guint			 warning_level_id;
 	gboolean                 poll_paused;
 	GSource                 *poll_source;
+	UpPollQueue		*poll_queue;
+	gint64			 poll_tick;	/* µs, 0 to not align */
+	gint64			 poll_slack;	/* µs */
 	int			 critical_action_lock_fd;
 
 	/* Display battery properties */
@@ -85,6 +92,9 @@ static gboolean	up_daemon_get_on_ac_local 	(UpDaemon	*daemon, gboolean *has_ac);
 G_DEFINE_TYPE_WITH_PRIVATE (UpDaemon, up_daemon, UP_TYPE_EXPORTED_DAEMON_SKELETON)
 
 #define UP_DAEMON_ACTION_DELAY				20 /* seconds */
+#define UP_DAEMON_EVENT_LOG_CAPACITY			4096 /* events */
+#define UP_DAEMON_POLL_TICK_DEFAULT			0 /* seconds, no tick */
+#define UP_DAEMON_POLL_SLACK_DEFAULT			5 /* seconds */
 #define UP_INTERFACE_PREFIX				"org.freedesktop.UPower."
 
 /**
@@ -487,6 +497,53 @@ up_daemon_enumerate_devices (UpExportedDaemon *skeleton,
 	return TRUE;
 }
 
+/**
+ * up_daemon_log_device_event:
+ *
+ * Records an event about @device, named after the last part of its
+ * native path such as BAT0.
+ **/
+static void
+up_daemon_log_device_event (UpDaemon *daemon, UpEventType type, UpDevice *device, gint32 value)
+{
+	const gchar *native_path;
+	g_autofree gchar *name = NULL;
+
+	native_path = up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device));
+	if (native_path != NULL)
+		name = g_path_get_basename (native_path);
+	up_event_log_add (daemon->priv->event_log, type, name, value);
+}
+
+/**
+ * up_daemon_get_events:
+ **/
+static gboolean
+up_daemon_get_events (UpExportedDaemon *skeleton,
+		      GDBusMethodInvocation *invocation,
+		      guint start,
+		      guint end,
+		      UpDaemon *daemon)
+{
+	g_autoptr(GArray) events = NULL;
+	GVariantBuilder builder;
+	guint i;
+
+	events = up_event_log_get_range (daemon->priv->event_log, start, end);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ussi)"));
+	for (i = 0; i < events->len; i++) {
+		const UpEvent *event = &g_array_index (events, UpEvent, i);
+		g_autofree gchar *subject = g_strndup (event->subject, UP_EVENT_SUBJECT_SIZE);
+
+		g_variant_builder_add (&builder, "(ussi)", event->time,
+				       up_event_type_to_string (event->type),
+				       subject, event->value);
+	}
+	up_exported_daemon_complete_get_events (skeleton, invocation,
+						g_variant_builder_end (&builder));
+	return TRUE;
+}
+
 /**
  * up_daemon_get_display_device:
  **/
@@ -589,7 +646,14 @@ up_daemon_shutdown (UpDaemon *daemon)
 	/* stop accepting new devices and clear backend state */
 	up_backend_unplug (daemon->priv->backend);
 
+	/* nothing is refreshed any more */
+	up_device_refresh_shutdown ();
+
+	/* commit all the history at once, the devices have nothing left to save */
+	up_history_writer_persist (daemon->priv->history_writer);
+
 	/* forget about discovered devices */
+	up_poll_queue_clear (daemon->priv->poll_queue);
 	up_device_list_clear (daemon->priv->power_devices);
 
 	/* release UpDaemon reference */
@@ -605,6 +669,28 @@ up_daemon_get_device_list (UpDaemon *daemon)
 	return g_object_ref (daemon->priv->power_devices);
 }
 
+/**
+ * up_daemon_get_config:
+ *
+ * Return value: (transfer none): the configuration the daemon was started with
+ **/
+UpConfig *
+up_daemon_get_config (UpDaemon *daemon)
+{
+	return daemon->priv->config;
+}
+
+/**
+ * up_daemon_get_history_writer:
+ *
+ * Return value: (transfer none): the writer that commits the history of all devices
+ **/
+UpHistoryWriter *
+up_daemon_get_history_writer (UpDaemon *daemon)
+{
+	return daemon->priv->history_writer;
+}
+
 /**
  * up_daemon_set_lid_is_closed:
  **/
@@ -660,6 +746,8 @@ take_action_timeout_cb (UpDaemon *daemon)
 		daemon->priv->critical_action_lock_fd = -1;
 	}
 
+	up_event_log_add (daemon->priv->event_log, UP_EVENT_TYPE_CRITICAL_ACTION,
+			  up_backend_get_critical_action (daemon->priv->backend), 0);
 	up_backend_take_action (daemon->priv->backend);
 
 	g_debug ("Backend was notified to take action. The timeout will be removed.");
@@ -684,6 +772,7 @@ up_daemon_set_warning_level (UpDaemon *daemon, UpDeviceLevel warning_level)
 		return;
 
 	g_debug ("warning_level = %s", up_device_level_to_string (warning_level));
+	up_event_log_add (daemon->priv->event_log, UP_EVENT_TYPE_WARNING_LEVEL, NULL, warning_level);
 
 	g_object_set (G_OBJECT (daemon->priv->display_device),
 		      "warning-level", warning_level,
@@ -771,6 +860,54 @@ up_daemon_compute_warning_level (UpDaemon      *daemon,
 	g_assert_not_reached ();
 }
 
+/**
+ * up_daemon_get_warning_percentages:
+ * @energy_full: the energy of the device when full, in Wh
+ * @energy_rate: the rate it is discharging at, in W
+ * @percentages: (out caller-allocates): room for 3 percentages
+ *
+ * Finds where the warning level from up_daemon_compute_warning_level()
+ * changes for a device discharging at @energy_rate, as a percentage of
+ * its charge, with the TimeLow, TimeCritical and TimeAction policies
+ * turned into the charge left at that rate.
+ *
+ * Return value: the number of percentages in @percentages
+ **/
+guint
+up_daemon_get_warning_percentages (UpDaemon     *daemon,
+				   UpDeviceKind  kind,
+				   gboolean      power_supply,
+				   gdouble       energy_full,
+				   gdouble       energy_rate,
+				   gdouble      *percentages)
+{
+	UpDaemonPrivate *priv = daemon->priv;
+
+	if (kind == UP_DEVICE_KIND_MOUSE ||
+	    kind == UP_DEVICE_KIND_KEYBOARD ||
+	    kind == UP_DEVICE_KIND_TOUCHPAD) {
+		percentages[0] = 10.0f;
+		percentages[1] = 5.0f;
+		return 2;
+	}
+
+	if (power_supply &&
+	    !priv->use_percentage_for_policy &&
+	    energy_full > 0.0 && energy_rate > 0.0) {
+		gdouble percent_per_second = energy_rate / energy_full * 100.0 / SECONDS_PER_HOUR;
+
+		percentages[0] = priv->low_time * percent_per_second;
+		percentages[1] = priv->critical_time * percent_per_second;
+		percentages[2] = priv->action_time * percent_per_second;
+		return 3;
+	}
+
+	percentages[0] = priv->low_percentage;
+	percentages[1] = priv->critical_percentage;
+	percentages[2] = priv->action_percentage;
+	return 3;
+}
+
 static gboolean
 up_daemon_update_warning_level_idle (UpDaemon *daemon)
 {
@@ -859,6 +996,63 @@ up_daemon_polkit_is_allowed (UpDaemon *daemon, const gchar *action_id, GDBusMeth
 	return TRUE;
 }
 
+/**
+ * up_daemon_get_poll_time:
+ *
+ * Return value: when a device refreshed at @last_refresh is next polled,
+ * on the PollTick if there is one
+ **/
+static gint64
+up_daemon_get_poll_time (UpDaemon *daemon, gint64 last_refresh, gint timeout)
+{
+	gint64 poll_time = last_refresh + timeout * G_USEC_PER_SEC;
+
+	/* never take more than half of the timeout off */
+	return up_poll_queue_align (poll_time, daemon->priv->poll_tick,
+				    MIN (daemon->priv->poll_slack, timeout * G_USEC_PER_SEC / 2));
+}
+
+/**
+ * up_daemon_queue_poll:
+ *
+ * Puts @device in the poll queue at the time it is next due, or takes it
+ * out if it isn't polled.
+ **/
+static void
+up_daemon_queue_poll (UpDaemon *daemon, UpDevice *device)
+{
+	gint timeout;
+	gint64 last_refresh;
+
+	g_object_get (device,
+		      "poll-timeout", &timeout,
+		      "last-refresh", &last_refresh,
+		      NULL);
+	if (timeout <= 0) {
+		up_poll_queue_remove (daemon->priv->poll_queue, device);
+		return;
+	}
+	up_poll_queue_update (daemon->priv->poll_queue, device,
+			      up_daemon_get_poll_time (daemon, last_refresh, timeout),
+			      timeout);
+}
+
+/**
+ * up_daemon_schedule_poll:
+ *
+ * Wakes up when the first device in the poll queue is due.
+ **/
+static void
+up_daemon_schedule_poll (UpDaemon *daemon)
+{
+	gint64 ready_time = -1;
+
+	if (daemon->priv->poll_paused)
+		return;
+	up_poll_queue_peek (daemon->priv->poll_queue, &ready_time, NULL);
+	g_source_set_ready_time (daemon->priv->poll_source, ready_time);
+}
+
 /**
  * up_daemon_device_changed_cb:
  **/
@@ -872,10 +1066,10 @@ up_daemon_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDaemon *daem
 	g_return_if_fail (UP_IS_DEVICE (device));
 
 	prop = g_param_spec_get_name (pspec);
-	if (!daemon->priv->poll_paused &&
-	    ((g_strcmp0 (prop, "poll-timeout") == 0) ||
-	     (g_strcmp0 (prop, "last-refresh") == 0))) {
-		g_source_set_ready_time (daemon->priv->poll_source, 0);
+	if ((g_strcmp0 (prop, "poll-timeout") == 0) ||
+	    (g_strcmp0 (prop, "last-refresh") == 0)) {
+		up_daemon_queue_poll (daemon, device);
+		up_daemon_schedule_poll (daemon);
 		return;
 	}
 
@@ -883,7 +1077,12 @@ up_daemon_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDaemon *daem
 	g_object_get (device,
 		      "type", &type,
 		      NULL);
+	if (type != UP_DEVICE_KIND_LINE_POWER && g_strcmp0 (prop, "state") == 0)
+		up_daemon_log_device_event (daemon, UP_EVENT_TYPE_STATE, device,
+					    up_exported_device_get_state (UP_EXPORTED_DEVICE (device)));
 	if (type == UP_DEVICE_KIND_LINE_POWER && g_strcmp0 (prop, "online") == 0) {
+		up_daemon_log_device_event (daemon, UP_EVENT_TYPE_LINE_POWER, device,
+					    up_exported_device_get_online (UP_EXPORTED_DEVICE (device)));
 		/* refresh now */
 		up_daemon_refresh_battery_devices (daemon);
 	}
@@ -896,12 +1095,11 @@ up_daemon_poll_dispatch (GSource *source, GSourceFunc callback, gpointer user_da
 {
 	UpDaemon *daemon = UP_DAEMON (user_data);
 	UpDaemonPrivate *priv = daemon->priv;
-	g_autoptr(GPtrArray) array = NULL;
-	guint i;
 	UpDevice *device;
-	gint64 ready_time = G_MAXINT64;
 	gint64 now = g_source_get_time (priv->poll_source);
+	gint64 poll_time;
 	gint max_dispatch_timeout = 0;
+	gint timeout;
 
 	g_source_set_ready_time (priv->poll_source, -1);
 	g_assert (callback == NULL);
@@ -909,48 +1107,35 @@ up_daemon_poll_dispatch (GSource *source, GSourceFunc callback, gpointer user_da
 	if (daemon->priv->poll_paused)
 		return G_SOURCE_CONTINUE;
 
-	/* Find the earliest device that needs a refresh. */
-	array = up_device_list_get_array (priv->power_devices);
-	for (i = 0; i < array->len; i += 1) {
-		gint timeout;
-		gint64 last_refresh;
-		gint64 poll_time;
+	/* Only look at the devices that are due, earliest first. */
+	while ((device = up_poll_queue_peek (priv->poll_queue, &poll_time, &timeout)) != NULL) {
 		gint64 dispatch_time;
-		device = (UpDevice *) g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "poll-timeout", &timeout,
-			      "last-refresh", &last_refresh,
-			      NULL);
-
-		if (timeout <= 0)
-			continue;
-
-		poll_time = last_refresh + timeout * G_USEC_PER_SEC;
 
 		/* Allow dispatching early if another device got dispatched.
-		 * i.e. device polling will synchronize eventually.
+		 * i.e. device polling will synchronize eventually. With a
+		 * PollTick the devices are already on the same ticks.
 		 */
-		dispatch_time = poll_time - MIN(timeout, max_dispatch_timeout) * G_USEC_PER_SEC / 2;
-
-		if (now >= dispatch_time) {
-			g_debug ("up_daemon_poll_dispatch: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
-			up_device_refresh_internal (device, UP_REFRESH_POLL);
-			max_dispatch_timeout = MAX(max_dispatch_timeout, timeout);
-
-			/* We'll wake up again immediately and then
-			 * calculate the correct time to re-poll. */
-		}
+		if (priv->poll_tick > 0)
+			dispatch_time = poll_time;
+		else
+			dispatch_time = poll_time - MIN(timeout, max_dispatch_timeout) * G_USEC_PER_SEC / 2;
+		if (now < dispatch_time)
+			break;
 
-		ready_time = MIN(ready_time, poll_time);
+		g_debug ("up_daemon_poll_dispatch: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
+		up_device_refresh_internal (device, UP_REFRESH_POLL);
+		max_dispatch_timeout = MAX(max_dispatch_timeout, timeout);
+
+		/* The refresh requeues the device through last-refresh,
+		 * make sure it moves on even if it didn't. */
+		if (up_poll_queue_peek (priv->poll_queue, &poll_time, NULL) == device &&
+		    poll_time <= now)
+			up_poll_queue_update (priv->poll_queue, device,
+					      up_daemon_get_poll_time (daemon, now, timeout),
+					      timeout);
 	}
 
-	if (ready_time == G_MAXINT64)
-		ready_time = -1;
-
-	/* Set the ready time (if it was not modified externally) */
-	if (g_source_get_ready_time (priv->poll_source) == -1)
-		g_source_set_ready_time (priv->poll_source, ready_time);
-
+	up_daemon_schedule_poll (daemon);
 	return G_SOURCE_CONTINUE;
 }
 
@@ -973,6 +1158,10 @@ up_daemon_pause_poll (UpDaemon *daemon)
 	g_debug ("Polling will be paused");
 
 	daemon->priv->poll_paused = TRUE;
+	up_event_log_add (daemon->priv->event_log, UP_EVENT_TYPE_SUSPEND, NULL, 0);
+
+	/* we are about to sleep, don't lose the history if we never resume */
+	up_history_writer_persist (daemon->priv->history_writer);
 }
 
 /**
@@ -986,6 +1175,7 @@ up_daemon_resume_poll (UpDaemon *daemon)
 	g_debug ("Polling will be resumed");
 
 	daemon->priv->poll_paused = FALSE;
+	up_event_log_add (daemon->priv->event_log, UP_EVENT_TYPE_RESUME, NULL, 0);
 
 	g_source_set_ready_time (daemon->priv->poll_source, 0);
 }
@@ -1020,6 +1210,28 @@ up_daemon_get_env_override (UpDaemon *self)
 	self->priv->state_dir_override = g_getenv ("UPOWER_STATE_DIR");
 }
 
+/**
+ * up_daemon_open_event_log:
+ *
+ * Keeps the power events next to the history, or only in memory if that
+ * can't be written.
+ **/
+static void
+up_daemon_open_event_log (UpDaemon *self)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	const gchar *dir;
+
+	self->priv->event_log = up_event_log_new (UP_DAEMON_EVENT_LOG_CAPACITY);
+	dir = g_getenv ("UPOWER_HISTORY_DIR");
+	if (dir == NULL)
+		dir = HISTORY_DIR;
+	filename = g_build_filename (dir, "events.bin", NULL);
+	if (!up_event_log_open (self->priv->event_log, filename, &error))
+		g_debug ("keeping the event log in memory only: %s", error->message);
+}
+
 /**
  * up_daemon_device_added_cb:
  **/
@@ -1048,9 +1260,12 @@ up_daemon_device_added_cb (UpBackend *backend, UpDevice *device, UpDaemon *daemo
 	}
 
 	/* Ensure we poll the new device if needed */
-	g_source_set_ready_time (daemon->priv->poll_source, 0);
+	up_daemon_queue_poll (daemon, device);
+	up_daemon_schedule_poll (daemon);
 
 	g_debug ("emitting added: %s", object_path);
+	up_daemon_log_device_event (daemon, UP_EVENT_TYPE_DEVICE_ADDED, device,
+				    up_exported_device_get_type_ (UP_EXPORTED_DEVICE (device)));
 	up_daemon_update_warning_level (daemon);
 	up_exported_daemon_emit_device_added (UP_EXPORTED_DAEMON (daemon), object_path);
 }
@@ -1068,6 +1283,7 @@ up_daemon_device_removed_cb (UpBackend *backend, UpDevice *device, UpDaemon *dae
 	g_return_if_fail (UP_IS_DEVICE (device));
 
 	g_signal_handlers_disconnect_by_data (device, daemon);
+	up_poll_queue_remove (priv->poll_queue, device);
 
 	/* remove from list (device remains valid during the function call) */
 	up_device_list_remove (priv->power_devices, device);
@@ -1082,6 +1298,8 @@ up_daemon_device_removed_cb (UpBackend *backend, UpDevice *device, UpDaemon *dae
 		return;
 	}
 	g_debug ("emitting device-removed: %s", object_path);
+	up_daemon_log_device_event (daemon, UP_EVENT_TYPE_DEVICE_REMOVED, device,
+				    up_exported_device_get_type_ (UP_EXPORTED_DEVICE (device)));
 	up_exported_daemon_emit_device_removed (UP_EXPORTED_DAEMON (daemon), object_path);
 
 	/* In case a battery was removed */
@@ -1138,14 +1356,28 @@ policy_config_validate (UpDaemon *daemon)
 static void
 up_daemon_init (UpDaemon *daemon)
 {
+	guint poll_tick;
+	guint poll_slack;
+
 	daemon->priv = up_daemon_get_instance_private (daemon);
 
 	daemon->priv->critical_action_lock_fd = -1;
 	daemon->priv->polkit = up_polkit_new ();
 	daemon->priv->config = up_config_new ();
 	daemon->priv->power_devices = up_device_list_new ();
+	daemon->priv->history_writer = up_history_writer_new ();
+	up_daemon_open_event_log (daemon);
 	daemon->priv->display_device = up_device_new (daemon, NULL);
 	daemon->priv->poll_source = g_source_new (&poll_source_funcs, sizeof (GSource));
+	daemon->priv->poll_queue = up_poll_queue_new ();
+	poll_tick = UP_DAEMON_POLL_TICK_DEFAULT;
+	if (up_config_has_key (daemon->priv->config, "PollTick"))
+		poll_tick = up_config_get_uint (daemon->priv->config, "PollTick");
+	poll_slack = UP_DAEMON_POLL_SLACK_DEFAULT;
+	if (up_config_has_key (daemon->priv->config, "PollSlack"))
+		poll_slack = up_config_get_uint (daemon->priv->config, "PollSlack");
+	daemon->priv->poll_tick = (gint64) poll_tick * G_USEC_PER_SEC;
+	daemon->priv->poll_slack = (gint64) poll_slack * G_USEC_PER_SEC;
 
 	g_source_set_callback (daemon->priv->poll_source, NULL, daemon, NULL);
 	g_source_set_name (daemon->priv->poll_source, "up-device-poll");
@@ -1174,6 +1406,8 @@ up_daemon_init (UpDaemon *daemon)
 			  G_CALLBACK (up_daemon_get_critical_action), daemon);
 	g_signal_connect (daemon, "handle-get-display-device",
 			  G_CALLBACK (up_daemon_get_display_device), daemon);
+	g_signal_connect (daemon, "handle-get-events",
+			  G_CALLBACK (up_daemon_get_events), daemon);
 }
 
 static const GDBusErrorEntry up_daemon_error_entries[] = {
@@ -1226,9 +1460,12 @@ up_daemon_finalize (GObject *object)
 	}
 
 	g_clear_pointer (&daemon->priv->poll_source, g_source_destroy);
+	up_poll_queue_free (priv->poll_queue);
 
 	g_object_unref (priv->power_devices);
 	g_object_unref (priv->display_device);
+	g_object_unref (priv->event_log);
+	g_object_unref (priv->history_writer);
 	g_object_unref (priv->polkit);
 	g_object_unref (priv->config);
 	g_object_unref (priv->backend);
@@ -25,6 +25,8 @@
 
 #include "up-types.h"
 #include "up-device-list.h"
+#include "up-config.h"
+#include "up-history-writer.h"
 
 G_BEGIN_DECLS
 
@@ -83,6 +85,12 @@ UpDeviceLevel	 up_daemon_compute_warning_level(UpDaemon		*daemon,
 						 gboolean		 power_supply,
 						 gdouble		 percentage,
 						 gint64			 time_to_empty);
+guint		 up_daemon_get_warning_percentages (UpDaemon		*daemon,
+						 UpDeviceKind		 kind,
+						 gboolean		 power_supply,
+						 gdouble		 energy_full,
+						 gdouble		 energy_rate,
+						 gdouble		*percentages);
 const gchar	*up_daemon_get_charge_icon	(UpDaemon		*daemon,
 						 gdouble		 percentage,
 						 UpDeviceLevel		 battery_level,
@@ -92,6 +100,8 @@ gboolean	 up_daemon_polkit_is_allowed	(UpDaemon		*daemon,
 						 const gchar		*action_id,
 						 GDBusMethodInvocation	*invocation);
 
+UpConfig	*up_daemon_get_config		(UpDaemon		*daemon);
+UpHistoryWriter	*up_daemon_get_history_writer	(UpDaemon		*daemon);
 void             up_daemon_pause_poll           (UpDaemon               *daemon);
 void             up_daemon_resume_poll          (UpDaemon               *daemon);
 void		 up_daemon_set_debug		(UpDaemon		*daemon,
@@ -18,10 +18,12 @@
  *
  */
 
+#include <math.h>
 #include <string.h>
 
 #include "up-constants.h"
 #include "up-config.h"
+#include "up-daemon.h"
 #include "up-device-battery.h"
 
 /* Chosen to be quite big, in case there was a lot of re-polling */
@@ -181,18 +183,105 @@ up_device_battery_estimate_power (UpDeviceBattery *self, UpBatteryValues *cur)
 	cur->energy.rate = energy_rate;
 }
 
+/**
+ * up_device_battery_compute_poll_timeout:
+ * @percentage: the charge now
+ * @energy_full: the energy when full, in Wh
+ * @energy_rate: the rate it is (dis)charging at, in W
+ * @thresholds: the percentages at which the warning level changes
+ *
+ * Works out how long the battery can go without polling from how fast it
+ * is (dis)charging. The next whole percent is worth a poll, but never
+ * sooner than UP_DAEMON_SHORT_TIMEOUT. Reaching one of the @thresholds
+ * when discharging, or full when charging, is noticed within
+ * UP_DAEMON_ESTIMATE_TIMEOUT. For that, only half of the time left until
+ * then is slept, so a rate that is off by up to half still gets polled
+ * before the crossing, and the poll interval shrinks as the boundary
+ * gets closer.
+ *
+ * Return value: the poll timeout in seconds
+ **/
+gint
+up_device_battery_compute_poll_timeout (UpDeviceState  state,
+					gdouble        percentage,
+					gdouble        energy_full,
+					gdouble        energy_rate,
+					const gdouble *thresholds,
+					guint          n_thresholds)
+{
+	gdouble percent_per_second;
+	gdouble next_percent;
+	gdouble timeout = UP_DAEMON_LONG_TIMEOUT;
+	guint i;
+
+	if ((state != UP_DEVICE_STATE_CHARGING && state != UP_DEVICE_STATE_DISCHARGING) ||
+	    energy_rate < UP_DAEMON_EPSILON || energy_full < UP_DAEMON_EPSILON)
+		return UP_DAEMON_SHORT_TIMEOUT;
+	percent_per_second = energy_rate / energy_full * 100.0 / SECONDS_PER_HOUR;
+
+	if (state == UP_DEVICE_STATE_DISCHARGING)
+		next_percent = ceil (percentage) - 1.0;
+	else
+		next_percent = floor (percentage) + 1.0;
+	timeout = MIN (timeout, MAX (fabs (next_percent - percentage) / percent_per_second,
+				     UP_DAEMON_SHORT_TIMEOUT));
+
+	if (state == UP_DEVICE_STATE_DISCHARGING) {
+		for (i = 0; i < n_thresholds; i++) {
+			gdouble distance = percentage - thresholds[i];
+			if (distance <= 0.0)
+				continue;
+			timeout = MIN (timeout, MAX (distance / percent_per_second / 2,
+						     UP_DAEMON_ESTIMATE_TIMEOUT));
+		}
+	} else if (percentage < 100.0) {
+		timeout = MIN (timeout, MAX ((100.0 - percentage) / percent_per_second / 2,
+					     UP_DAEMON_ESTIMATE_TIMEOUT));
+	}
+
+	return (gint) timeout;
+}
+
 static void
 up_device_battery_update_poll_frequency (UpDeviceBattery *self,
-					 UpDeviceState    state,
+					 UpBatteryValues *values,
 					 UpRefreshReason  reason)
 {
 	UpDeviceBatteryPrivate *priv = up_device_battery_get_instance_private (self);
+	UpDeviceState state = values->state;
+	UpDaemon *daemon;
+	gdouble thresholds[3];
+	guint n_thresholds = 0;
 	gint slow_poll_timeout;
 
 	if (priv->disable_battery_poll)
 		return;
 
-	slow_poll_timeout = priv->repoll_needed ? UP_DAEMON_ESTIMATE_TIMEOUT : UP_DAEMON_SHORT_TIMEOUT;
+	daemon = up_device_get_daemon (UP_DEVICE (self));
+	if (daemon != NULL && state == UP_DEVICE_STATE_DISCHARGING) {
+		UpDeviceKind kind;
+		gboolean power_supply;
+
+		g_object_get (self,
+			      "type", &kind,
+			      "power-supply", &power_supply,
+			      NULL);
+		n_thresholds = up_daemon_get_warning_percentages (daemon, kind, power_supply,
+								  priv->energy_full,
+								  values->energy.rate,
+								  thresholds);
+	}
+	g_clear_object (&daemon);
+
+	if (priv->repoll_needed)
+		slow_poll_timeout = UP_DAEMON_ESTIMATE_TIMEOUT;
+	else
+		slow_poll_timeout = up_device_battery_compute_poll_timeout (state,
+									    values->percentage,
+									    priv->energy_full,
+									    values->energy.rate,
+									    thresholds,
+									    n_thresholds);
 	priv->repoll_needed = FALSE;
 
 	/* We start fast-polling if the reason to update was not a normal POLL
@@ -396,7 +485,7 @@ up_device_battery_report (UpDeviceBattery *self,
 		      "update-time", (guint64) g_get_real_time () / G_USEC_PER_SEC,
 		      NULL);
 
-	up_device_battery_update_poll_frequency (self, values->state, reason);
+	up_device_battery_update_poll_frequency (self, values, reason);
 }
 
 static gboolean
@@ -102,6 +102,12 @@ typedef struct {
 
 
 void up_device_battery_update_info (UpDeviceBattery *self, UpBatteryInfo *info);
+gint up_device_battery_compute_poll_timeout (UpDeviceState state,
+					     gdouble percentage,
+					     gdouble energy_full,
+					     gdouble energy_rate,
+					     const gdouble *thresholds,
+					     guint n_thresholds);
 void up_device_battery_report (UpDeviceBattery *self, UpBatteryValues *values, UpRefreshReason reason);
 
 G_END_DECLS
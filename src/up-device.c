@@ -27,12 +27,21 @@
 #include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
 
 #include "up-native.h"
+#include "up-config.h"
 #include "up-device.h"
 #include "up-history.h"
-#include "up-history-item.h"
-#include "up-stats-item.h"
+
+typedef struct {
+	UpDevice		*device;
+	UpRefreshReason		 reason;
+	gpointer		 data;
+	GMainContext		*context;
+	GPtrArray		*invocations;	/* Refresh calls waiting for it */
+	gboolean		 registered;	/* when it was queued */
+} UpDeviceRefreshJob;
 
 typedef struct
 {
@@ -45,6 +54,13 @@ typedef struct
 
 	gint64			last_refresh;
 	int			poll_timeout;
+	UpDeviceRefreshJob	*refresh_job;		/* in flight */
+
+	/* failing refreshes */
+	gboolean		refresh_failed;		/* by the one running now */
+	guint			refresh_failures;	/* in a row */
+	UpDeviceCircuit		circuit;
+	int			backoff;		/* seconds, while open */
 
 	/* This is TRUE if the wireless_status property is present, and
 	 * its value is "disconnected"
@@ -53,6 +69,7 @@ typedef struct
 } UpDevicePrivate;
 
 static void up_device_initable_iface_init (GInitableIface *iface);
+static int up_device_get_effective_poll_timeout (UpDevice *device);
 
 G_DEFINE_TYPE_EXTENDED (UpDevice, up_device, UP_TYPE_EXPORTED_DEVICE_SKELETON, 0,
                         G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE,
@@ -73,6 +90,17 @@ static GParamSpec *properties[N_PROPS];
 
 #define UP_DEVICES_DBUS_PATH "/org/freedesktop/UPower/devices"
 
+#define UP_DEVICE_REFRESH_THREADS	2
+
+/* After this many failed refreshes in a row, the device is polled less
+ * and less often, up to UP_DEVICE_BACKOFF_MAX, until one works again. */
+#define UP_DEVICE_CIRCUIT_FAILURES	3
+#define UP_DEVICE_BACKOFF_MAX		300 /* seconds */
+#define UP_DEVICE_BACKOFF_JITTER	0.2 /* of the backoff, either way */
+
+/* shared by all devices with a refresh_collect */
+static GThreadPool *refresh_pool = NULL;
+
 static gchar * up_device_get_id (UpDevice *device);
 
 /* This needs to be called when one of those properties changes:
@@ -168,6 +196,60 @@ update_icon_name (UpDevice *device)
 	up_exported_device_set_icon_name (skeleton, icon_name);
 }
 
+/* the smallest change worth recording, in the units of each series */
+static const struct {
+	UpHistoryType	 type;
+	const gchar	*key;
+	gdouble		 deadband;
+} history_deadbands[] = {
+	{ UP_HISTORY_TYPE_CHARGE,	"HistoryChargeDeadband",	0.0 },
+	{ UP_HISTORY_TYPE_RATE,		"HistoryRateDeadband",		0.1 },
+	{ UP_HISTORY_TYPE_TIME_FULL,	"HistoryTimeDeadband",		60.0 },
+	{ UP_HISTORY_TYPE_TIME_EMPTY,	"HistoryTimeDeadband",		60.0 },
+	{ UP_HISTORY_TYPE_VOLTAGE,	"HistoryVoltageDeadband",	0.01 },
+	{ UP_HISTORY_TYPE_TEMPERATURE,	"HistoryTemperatureDeadband",	0.5 },
+	{ UP_HISTORY_TYPE_ENERGY,	"HistoryEnergyDeadband",	0.01 },
+};
+
+#define HISTORY_KEEP_ALIVE_DEFAULT	600 /* s */
+#define HISTORY_PERSIST_INTERVAL_DEFAULT	(6 * 60 * 60) /* s */
+
+static void
+configure_history (UpHistory *history, UpConfig *config)
+{
+	g_autofree gchar *staging_dir = NULL;
+	guint keep_alive = HISTORY_KEEP_ALIVE_DEFAULT;
+	guint persist_interval = HISTORY_PERSIST_INTERVAL_DEFAULT;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (history_deadbands); i++) {
+		gdouble deadband = history_deadbands[i].deadband;
+
+		if (config != NULL && up_config_has_key (config, history_deadbands[i].key))
+			deadband = up_config_get_double (config, history_deadbands[i].key);
+		up_history_set_deadband (history, history_deadbands[i].type, deadband);
+	}
+
+	if (config != NULL && up_config_has_key (config, "HistoryKeepAlive"))
+		keep_alive = up_config_get_uint (config, "HistoryKeepAlive");
+	up_history_set_keep_alive (history, keep_alive);
+	if (config == NULL)
+		return;
+
+	/* stage the history on a tmpfs, to spare flash storage */
+	staging_dir = up_config_get_string (config, "HistoryStagingDirectory");
+	if (staging_dir == NULL || staging_dir[0] == '\0')
+		return;
+	if (g_strcmp0 (staging_dir, up_history_get_directory (history)) == 0) {
+		g_warning ("HistoryStagingDirectory is the history directory, not staging");
+		return;
+	}
+	if (up_config_has_key (config, "HistoryPersistInterval"))
+		persist_interval = up_config_get_uint (config, "HistoryPersistInterval");
+	up_history_set_staging_directory (history, staging_dir);
+	up_history_set_persist_interval (history, persist_interval);
+}
+
 static void
 ensure_history (UpDevice *device)
 {
@@ -178,6 +260,10 @@ ensure_history (UpDevice *device)
 		return;
 
 	priv->history = up_history_new ();
+	configure_history (priv->history,
+			   priv->daemon != NULL ? up_daemon_get_config (priv->daemon) : NULL);
+	if (priv->daemon != NULL)
+		up_history_set_writer (priv->history, up_daemon_get_history_writer (priv->daemon));
 	id = up_device_get_id (device);
 	if (id)
 		up_history_set_id (priv->history, id);
@@ -213,6 +299,9 @@ update_history (UpDevice *device)
 	up_history_set_rate_data (priv->history, up_exported_device_get_energy_rate (skeleton));
 	up_history_set_time_full_data (priv->history, up_exported_device_get_time_to_full (skeleton));
 	up_history_set_time_empty_data (priv->history, up_exported_device_get_time_to_empty (skeleton));
+	up_history_set_voltage_data (priv->history, up_exported_device_get_voltage (skeleton));
+	up_history_set_temperature_data (priv->history, up_exported_device_get_temperature (skeleton));
+	up_history_set_energy_data (priv->history, up_exported_device_get_energy (skeleton));
 }
 
 static void
@@ -516,11 +605,34 @@ up_device_refresh (UpExportedDevice *skeleton,
 		   GDBusMethodInvocation *invocation,
 		   UpDevice *device)
 {
-	up_device_refresh_internal (device, UP_REFRESH_POLL);
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	/* answered once the data is in */
+	if (up_device_refresh_internal (device, UP_REFRESH_POLL) == UP_REFRESH_RESULT_QUEUED) {
+		g_ptr_array_add (priv->refresh_job->invocations, g_object_ref (invocation));
+		return TRUE;
+	}
 	up_exported_device_complete_refresh (skeleton, invocation);
 	return TRUE;
 }
 
+/**
+ * up_device_get_refresh_status:
+ **/
+static gboolean
+up_device_get_refresh_status (UpExportedDevice *skeleton,
+			      GDBusMethodInvocation *invocation,
+			      UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	up_exported_device_complete_get_refresh_status (skeleton, invocation,
+							up_device_circuit_to_string (priv->circuit),
+							priv->refresh_failures,
+							up_device_get_effective_poll_timeout (device));
+	return TRUE;
+}
+
 static gboolean
 up_device_initable_init (GInitable     *initable,
                          GCancellable  *cancellable,
@@ -534,9 +646,12 @@ up_device_initable_init (GInitable     *initable,
 
 	g_return_val_if_fail (UP_IS_DEVICE (device), FALSE);
 
-	if (up_daemon_get_debug (priv->daemon))
+	if (up_daemon_get_debug (priv->daemon)) {
 		g_signal_connect (device, "handle-refresh",
 				  G_CALLBACK (up_device_refresh), device);
+		g_signal_connect (device, "handle-get-refresh-status",
+				  G_CALLBACK (up_device_get_refresh_status), device);
+	}
 	if (priv->native) {
 		native_path = up_native_get_native_path (priv->native);
 		up_exported_device_set_native_path (UP_EXPORTED_DEVICE (device), native_path);
@@ -555,8 +670,7 @@ up_device_initable_init (GInitable     *initable,
 	}
 
 	/* force a refresh, although failure isn't fatal */
-	ret = up_device_refresh_internal (device, UP_REFRESH_INIT);
-	if (!ret) {
+	if (up_device_refresh_internal (device, UP_REFRESH_INIT) == UP_REFRESH_RESULT_UNCHANGED) {
 		g_debug ("failed to refresh %s", native_path);
 
 		/* XXX: We do not store a history if the initial refresh failed.
@@ -584,8 +698,8 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 			  UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	GPtrArray *array = NULL;
-	UpStatsItem *item;
+	UpHistoryProfileStat stats[UP_HISTORY_PROFILE_BINS];
+	gboolean ret = FALSE;
 	guint i;
 	GVariantBuilder builder;
 
@@ -600,40 +714,108 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 
 	/* get the correct data */
 	if (g_strcmp0 (type, "charging") == 0)
-		array = up_history_get_profile_data (priv->history, TRUE);
+		ret = up_history_get_profile_data (priv->history, TRUE, stats);
 	else if (g_strcmp0 (type, "discharging") == 0)
-		array = up_history_get_profile_data (priv->history, FALSE);
+		ret = up_history_get_profile_data (priv->history, FALSE, stats);
 
 	/* maybe the device doesn't support histories */
-	if (array == NULL) {
+	if (!ret) {
 		g_dbus_method_invocation_return_error_literal (invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 							       "device has no statistics");
 		goto out;
 	}
 
-	/* always 101 items of data */
-	if (array->len != 101) {
-		g_dbus_method_invocation_return_error (invocation,
-						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
-						       "statistics invalid as have %i items", array->len);
-		goto out;
-	}
-
 	/* copy data to dbus struct */
 	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(dd)"));
-	for (i = 0; i < array->len; i++) {
-		item = (UpStatsItem *) g_ptr_array_index (array, i);
-		g_variant_builder_add (&builder, "(dd)",
-				       up_stats_item_get_value (item),
-				       up_stats_item_get_accuracy (item));
-	}
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++)
+		g_variant_builder_add (&builder, "(dd)", stats[i].value, stats[i].accuracy);
 
 	up_exported_device_complete_get_statistics (skeleton, invocation,
 						    g_variant_builder_end (&builder));
 out:
-	if (array != NULL)
-		g_ptr_array_unref (array);
+	return TRUE;
+}
+
+/* the serialised size of a (udu), with padding before the d and at the end */
+#define UP_DEVICE_HISTORY_ITEM_SIZE	24
+
+/**
+ * up_device_history_view_to_variant:
+ *
+ * Serialises the samples straight into the a(udu) wire format, rather
+ * than going through a GVariantBuilder for every item.
+ **/
+static GVariant *
+up_device_history_view_to_variant (const UpHistoryView *view)
+{
+	guint8 *data;
+	guint i;
+
+	if (view->len == 0)
+		return g_variant_new_array (G_VARIANT_TYPE ("(udu)"), NULL, 0);
+
+	data = g_malloc0_n (view->len, UP_DEVICE_HISTORY_ITEM_SIZE);
+	for (i = 0; i < view->len; i++) {
+		const UpHistorySample *item = up_history_view_get (view, i);
+		guint8 *p = data + i * UP_DEVICE_HISTORY_ITEM_SIZE;
+
+		memcpy (p, &item->time, 4);
+		memcpy (p + 8, &item->value, 8);
+		memcpy (p + 16, &item->state, 4);
+	}
+	return g_variant_new_from_data (G_VARIANT_TYPE ("a(udu)"),
+					data, view->len * UP_DEVICE_HISTORY_ITEM_SIZE,
+					TRUE, g_free, data);
+}
+
+/* the flags of GetHistoryWithFlags */
+#define UP_DEVICE_HISTORY_FLAG_LTTB	(1 << 0)
+#define UP_DEVICE_HISTORY_FLAG_MIN_MAX	(1 << 1)
+
+/**
+ * up_device_get_history_view:
+ *
+ * Return value: %TRUE if @view was set up, otherwise an error has been
+ * returned to @invocation
+ **/
+static gboolean
+up_device_get_history_view (UpDevice *device,
+			    GDBusMethodInvocation *invocation,
+			    const gchar *type_string,
+			    guint timespan,
+			    guint resolution,
+			    UpHistoryDownsample downsample,
+			    UpHistoryView *view)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	gboolean ret = FALSE;
+	UpHistoryType type;
+
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (UP_EXPORTED_DEVICE (device))) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		return FALSE;
+	}
+
+	/* get the correct data */
+	type = up_history_type_from_string (type_string);
+
+	/* something recognized */
+	if (type != UP_HISTORY_TYPE_UNKNOWN) {
+		ensure_history (device);
+		ret = up_history_get_view (priv->history, type, timespan, resolution, downsample, view);
+	}
+
+	/* maybe the device doesn't have any history */
+	if (!ret) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -644,13 +826,74 @@ up_device_get_history (UpExportedDevice *skeleton,
 		       guint timespan,
 		       guint resolution,
 		       UpDevice *device)
+{
+	UpHistoryView view;
+
+	if (!up_device_get_history_view (device, invocation, type_string, timespan, resolution,
+					 UP_HISTORY_DOWNSAMPLE_AVERAGE, &view))
+		return TRUE;
+
+	up_exported_device_complete_get_history (skeleton, invocation,
+						 up_device_history_view_to_variant (&view));
+	up_history_view_clear (&view);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_with_flags (UpExportedDevice *skeleton,
+				  GDBusMethodInvocation *invocation,
+				  const gchar *type_string,
+				  guint timespan,
+				  guint resolution,
+				  guint flags,
+				  UpDevice *device)
+{
+	UpHistoryDownsample downsample = UP_HISTORY_DOWNSAMPLE_AVERAGE;
+	UpHistoryView view;
+
+	switch (flags) {
+	case 0:
+		break;
+	case UP_DEVICE_HISTORY_FLAG_LTTB:
+		downsample = UP_HISTORY_DOWNSAMPLE_LTTB;
+		break;
+	case UP_DEVICE_HISTORY_FLAG_MIN_MAX:
+		downsample = UP_HISTORY_DOWNSAMPLE_MIN_MAX;
+		break;
+	default:
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "invalid flags 0x%x", flags);
+		return TRUE;
+	}
+
+	if (!up_device_get_history_view (device, invocation, type_string, timespan, resolution,
+					 downsample, &view))
+		return TRUE;
+
+	up_exported_device_complete_get_history_with_flags (skeleton, invocation,
+							    up_device_history_view_to_variant (&view));
+	up_history_view_clear (&view);
+	return TRUE;
+}
+
+/* more buckets than pixels on any screen */
+#define UP_DEVICE_HISTORY_MAX_BUCKETS	10000
+
+static gboolean
+up_device_get_history_aggregated (UpExportedDevice *skeleton,
+				  GDBusMethodInvocation *invocation,
+				  const gchar *type_string,
+				  guint start,
+				  guint end,
+				  guint n_buckets,
+				  UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	GPtrArray *array = NULL;
-	UpHistoryItem *item;
-	guint i;
-	UpHistoryType type = UP_HISTORY_TYPE_UNKNOWN;
 	GVariantBuilder builder;
+	GArray *array = NULL;
+	UpHistoryType type;
+	guint i;
 
 	/* doesn't even try to support this */
 	if (!up_exported_device_get_has_history (skeleton)) {
@@ -660,22 +903,28 @@ up_device_get_history (UpExportedDevice *skeleton,
 		goto out;
 	}
 
-	/* get the correct data */
-	if (g_strcmp0 (type_string, "rate") == 0)
-		type = UP_HISTORY_TYPE_RATE;
-	else if (g_strcmp0 (type_string, "charge") == 0)
-		type = UP_HISTORY_TYPE_CHARGE;
-	else if (g_strcmp0 (type_string, "time-full") == 0)
-		type = UP_HISTORY_TYPE_TIME_FULL;
-	else if (g_strcmp0 (type_string, "time-empty") == 0)
-		type = UP_HISTORY_TYPE_TIME_EMPTY;
+	type = up_history_type_from_string (type_string);
+	if (type == UP_HISTORY_TYPE_UNKNOWN) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "unknown history type '%s'", type_string);
+		goto out;
+	}
 
-	/* something recognized */
-	if (type != UP_HISTORY_TYPE_UNKNOWN) {
-		ensure_history (device);
-		array = up_history_get_data (priv->history, type, timespan, resolution);
+	/* up to now */
+	if (end == 0)
+		end = g_get_real_time () / G_USEC_PER_SEC;
+	if (start >= end || n_buckets == 0 || n_buckets > UP_DEVICE_HISTORY_MAX_BUCKETS) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "invalid range %u-%u in %u buckets",
+						       start, end, n_buckets);
+		goto out;
 	}
 
+	ensure_history (device);
+	array = up_history_get_aggregated_data (priv->history, type, start, end, n_buckets);
+
 	/* maybe the device doesn't have any history */
 	if (array == NULL) {
 		g_dbus_method_invocation_return_error_literal (invocation,
@@ -684,22 +933,110 @@ up_device_get_history (UpExportedDevice *skeleton,
 		goto out;
 	}
 
-	/* copy data to dbus struct */
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uudddu)"));
 	for (i = 0; i < array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		g_variant_builder_add (&builder, "(udu)",
-				       up_history_item_get_time (item),
-				       up_history_item_get_value (item),
-				       up_history_item_get_state (item));
+		const UpHistoryAggregate *bucket = &g_array_index (array, UpHistoryAggregate, i);
+
+		g_variant_builder_add (&builder, "(uudddu)",
+				       bucket->time, bucket->count,
+				       bucket->min, bucket->max, bucket->mean,
+				       bucket->state);
 	}
+	up_exported_device_complete_get_history_aggregated (skeleton, invocation,
+							    g_variant_builder_end (&builder));
+out:
+	g_clear_pointer (&array, g_array_unref);
+	return TRUE;
+}
 
-	up_exported_device_complete_get_history (skeleton, invocation,
-						 g_variant_builder_end (&builder));
+static gboolean
+up_device_get_sessions (UpExportedDevice *skeleton,
+			GDBusMethodInvocation *invocation,
+			guint since,
+			UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GVariantBuilder builder;
+	GArray *array = NULL;
+	guint i;
 
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		goto out;
+	}
+
+	ensure_history (device);
+	array = up_history_get_sessions (priv->history, since);
+
+	/* maybe the device doesn't have any history */
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		goto out;
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uuuddd)"));
+	for (i = 0; i < array->len; i++) {
+		const UpHistorySession *session = &g_array_index (array, UpHistorySession, i);
+
+		g_variant_builder_add (&builder, "(uuuddd)",
+				       session->start, session->end, session->state,
+				       session->start_charge, session->end_charge,
+				       session->energy);
+	}
+	up_exported_device_complete_get_sessions (skeleton, invocation,
+						  g_variant_builder_end (&builder));
+out:
+	g_clear_pointer (&array, g_array_unref);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_fd (UpExportedDevice *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  GUnixFDList *fd_list,
+			  const gchar *type_string,
+			  UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autoptr(GUnixFDList) out_fd_list = NULL;
+	g_autoptr(GError) error = NULL;
+	UpHistoryType type;
+	gint fd;
+
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		goto out;
+	}
+
+	type = up_history_type_from_string (type_string);
+	if (type == UP_HISTORY_TYPE_UNKNOWN) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "unknown history type '%s'", type_string);
+		goto out;
+	}
+
+	ensure_history (device);
+	fd = up_history_export_fd (priv->history, type, &error);
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "failed to export history: %s", error->message);
+		goto out;
+	}
+
+	/* the list takes the descriptor */
+	out_fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+	up_exported_device_complete_get_history_fd (skeleton, invocation, out_fd_list, 0);
 out:
-	if (array != NULL)
-		g_ptr_array_unref (array);
 	return TRUE;
 }
 
@@ -712,38 +1049,316 @@ up_device_sibling_discovered (UpDevice *device, GObject *sibling)
 		klass->sibling_discovered (device, sibling);
 }
 
-gboolean
-up_device_refresh_internal (UpDevice *device, UpRefreshReason reason)
+/**
+ * up_device_circuit_to_string:
+ **/
+const gchar *
+up_device_circuit_to_string (UpDeviceCircuit circuit)
+{
+	switch (circuit) {
+	case UP_DEVICE_CIRCUIT_CLOSED:
+		return "closed";
+	case UP_DEVICE_CIRCUIT_OPEN:
+		return "open";
+	case UP_DEVICE_CIRCUIT_HALF_OPEN:
+		return "half-open";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * up_device_get_circuit:
+ * @failures: (out) (optional): the number of failed refreshes in a row
+ **/
+UpDeviceCircuit
+up_device_get_circuit (UpDevice *device, guint *failures)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	gboolean ret = FALSE;
-	UpDeviceClass *klass = UP_DEVICE_GET_CLASS (device);
 
-	if (priv->native == NULL)
-		return TRUE;
+	if (failures != NULL)
+		*failures = priv->refresh_failures;
+	return priv->circuit;
+}
 
-	/* not implemented */
-	if (klass->refresh == NULL)
-		goto out;
+/**
+ * up_device_refresh_failed:
+ *
+ * For backends to call while refreshing when they could not get at the
+ * device at all, as opposed to there being nothing new.
+ **/
+void
+up_device_refresh_failed (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
 
-	/* do the refresh, and change the property */
-	ret = klass->refresh (device, reason);
+	priv->refresh_failed = TRUE;
+}
+
+/**
+ * up_device_get_effective_poll_timeout:
+ *
+ * Return value: the poll timeout of the backend, or the backoff while
+ * the device keeps failing
+ **/
+static int
+up_device_get_effective_poll_timeout (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	if (priv->circuit == UP_DEVICE_CIRCUIT_OPEN && priv->poll_timeout > 0)
+		return MAX (priv->backoff, priv->poll_timeout);
+	return priv->poll_timeout;
+}
+
+/**
+ * up_device_get_backoff:
+ *
+ * Return value: the seconds to wait after @failures failed refreshes,
+ * doubling each time and spread out a bit so devices that failed together
+ * don't keep trying together
+ **/
+static int
+up_device_get_backoff (int poll_timeout, guint failures)
+{
+	gdouble backoff = MAX (poll_timeout, 1);
+	guint i;
+
+	for (i = UP_DEVICE_CIRCUIT_FAILURES; i <= failures && backoff < UP_DEVICE_BACKOFF_MAX; i++)
+		backoff *= 2;
+	backoff *= g_random_double_range (1.0 - UP_DEVICE_BACKOFF_JITTER,
+					  1.0 + UP_DEVICE_BACKOFF_JITTER);
+	return MAX (MIN ((int) backoff, UP_DEVICE_BACKOFF_MAX), poll_timeout);
+}
+
+/**
+ * up_device_refresh_start:
+ *
+ * A refresh while backing off is the one that tries again.
+ **/
+static void
+up_device_refresh_start (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	if (priv->circuit == UP_DEVICE_CIRCUIT_OPEN)
+		priv->circuit = UP_DEVICE_CIRCUIT_HALF_OPEN;
+}
+
+/**
+ * up_device_refresh_track:
+ *
+ * Opens the circuit after too many failed refreshes, and closes it again
+ * after one that worked.
+ **/
+static void
+up_device_refresh_track (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	int old_timeout = up_device_get_effective_poll_timeout (device);
+
+	if (!priv->refresh_failed) {
+		if (priv->refresh_failures >= UP_DEVICE_CIRCUIT_FAILURES)
+			g_debug ("%s works again after %u failed refreshes",
+				 up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)),
+				 priv->refresh_failures);
+		priv->refresh_failures = 0;
+		priv->circuit = UP_DEVICE_CIRCUIT_CLOSED;
+	} else {
+		priv->refresh_failures++;
+		if (priv->refresh_failures >= UP_DEVICE_CIRCUIT_FAILURES) {
+			priv->circuit = UP_DEVICE_CIRCUIT_OPEN;
+			priv->backoff = up_device_get_backoff (priv->poll_timeout, priv->refresh_failures);
+			g_debug ("%u failed refreshes of %s, backing off for %is",
+				 priv->refresh_failures,
+				 up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)),
+				 priv->backoff);
+		}
+	}
+	priv->refresh_failed = FALSE;
+
+	if (up_device_get_effective_poll_timeout (device) != old_timeout)
+		g_object_notify_by_pspec (G_OBJECT (device), properties[PROP_POLL_TIMEOUT]);
+}
+
+/**
+ * up_device_refresh_done:
+ *
+ * Records that @device was refreshed, whether or not anything changed.
+ **/
+static void
+up_device_refresh_done (UpDevice *device, gboolean ret)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	up_device_refresh_track (device);
 	priv->last_refresh = g_get_monotonic_time ();
 	g_object_notify_by_pspec (G_OBJECT (device), properties[PROP_LAST_REFRESH]);
 
 	if (!ret) {
 		g_debug ("no changes");
-		goto out;
+		return;
 	}
 
 	/* the first time, print all properties */
 	if (!priv->has_ever_refresh) {
 		g_debug ("added native-path: %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
 		priv->has_ever_refresh = TRUE;
+	}
+}
+
+/**
+ * up_device_refresh_apply_cb:
+ *
+ * Hands what the worker collected to the device, on the thread the
+ * refresh was started from.
+ **/
+static gboolean
+up_device_refresh_apply_cb (gpointer user_data)
+{
+	UpDeviceRefreshJob *job = user_data;
+	UpDevicePrivate *priv = up_device_get_instance_private (job->device);
+	UpDeviceClass *klass = UP_DEVICE_GET_CLASS (job->device);
+	gboolean ret;
+	guint i;
+
+	priv->refresh_job = NULL;
+
+	/* the device went away, or the daemon is shutting down */
+	if (refresh_pool == NULL ||
+	    (job->registered && !up_device_is_registered (job->device))) {
+		g_debug ("dropping refresh of %s",
+			 up_exported_device_get_native_path (UP_EXPORTED_DEVICE (job->device)));
+		if (klass->refresh_free != NULL)
+			klass->refresh_free (job->device, job->data);
+		for (i = 0; i < job->invocations->len; i++)
+			g_dbus_method_invocation_return_error_literal (g_ptr_array_index (job->invocations, i),
+								       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+								       "device was removed");
 		goto out;
 	}
+
+	priv->refresh_failed = FALSE;
+	ret = klass->refresh_apply (job->device, job->reason, job->data);
+	up_device_refresh_done (job->device, ret);
+
+	for (i = 0; i < job->invocations->len; i++)
+		up_exported_device_complete_refresh (UP_EXPORTED_DEVICE (job->device),
+						     g_ptr_array_index (job->invocations, i));
 out:
-	return ret;
+
+	g_ptr_array_unref (job->invocations);
+	g_main_context_unref (job->context);
+	g_object_unref (job->device);
+	g_free (job);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * up_device_refresh_worker:
+ **/
+static void
+up_device_refresh_worker (gpointer data, gpointer user_data)
+{
+	UpDeviceRefreshJob *job = data;
+	UpDeviceClass *klass = UP_DEVICE_GET_CLASS (job->device);
+
+	job->data = klass->refresh_collect (job->device, job->reason);
+	g_main_context_invoke (job->context, up_device_refresh_apply_cb, job);
+}
+
+/**
+ * up_device_refresh_queue:
+ *
+ * Collects the data of @device on the worker pool, so that a device that
+ * is slow to answer doesn't hold up everything else.
+ **/
+static void
+up_device_refresh_queue (UpDevice *device, UpRefreshReason reason)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceRefreshJob *job;
+
+	/* the answer to the one in flight will do */
+	if (priv->refresh_job != NULL) {
+		g_debug ("refresh of %s already pending",
+			 up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
+		return;
+	}
+
+	if (refresh_pool == NULL)
+		refresh_pool = g_thread_pool_new (up_device_refresh_worker, NULL,
+						  UP_DEVICE_REFRESH_THREADS, FALSE, NULL);
+
+	up_device_refresh_start (device);
+	job = g_new0 (UpDeviceRefreshJob, 1);
+	job->device = g_object_ref (device);
+	job->reason = reason;
+	job->context = g_main_context_ref_thread_default ();
+	job->invocations = g_ptr_array_new_with_free_func (g_object_unref);
+	job->registered = up_device_is_registered (device);
+	priv->refresh_job = job;
+	g_thread_pool_push (refresh_pool, job, NULL);
+}
+
+/**
+ * up_device_refresh_shutdown:
+ *
+ * Waits for the refreshes that are being collected. What they return is
+ * dropped rather than applied, as the daemon is going away.
+ **/
+void
+up_device_refresh_shutdown (void)
+{
+	if (refresh_pool == NULL)
+		return;
+	g_thread_pool_free (refresh_pool, FALSE, TRUE);
+	refresh_pool = NULL;
+}
+
+/**
+ * up_device_refresh_internal:
+ *
+ * Refreshes @device, or starts doing so in the background for backends
+ * with a refresh_collect. The initial refresh is always done straight
+ * away, as the device is only put on the bus after it.
+ *
+ * Return value: whether something changed, or %UP_REFRESH_RESULT_QUEUED if
+ * the refresh is done in the background and nothing is known yet
+ **/
+UpRefreshResult
+up_device_refresh_internal (UpDevice *device, UpRefreshReason reason)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	gboolean ret = FALSE;
+	UpDeviceClass *klass = UP_DEVICE_GET_CLASS (device);
+
+	if (priv->native == NULL)
+		return UP_REFRESH_RESULT_CHANGED;
+
+	if (klass->refresh_collect != NULL) {
+		if (reason != UP_REFRESH_INIT) {
+			up_device_refresh_queue (device, reason);
+			return UP_REFRESH_RESULT_QUEUED;
+		}
+		up_device_refresh_start (device);
+		priv->refresh_failed = FALSE;
+		ret = klass->refresh_apply (device, reason,
+					    klass->refresh_collect (device, reason));
+		up_device_refresh_done (device, ret);
+		return ret ? UP_REFRESH_RESULT_CHANGED : UP_REFRESH_RESULT_UNCHANGED;
+	}
+
+	/* not implemented */
+	if (klass->refresh == NULL)
+		return UP_REFRESH_RESULT_UNCHANGED;
+
+	/* do the refresh, and change the property */
+	up_device_refresh_start (device);
+	priv->refresh_failed = FALSE;
+	ret = klass->refresh (device, reason);
+	up_device_refresh_done (device, ret);
+	return ret ? UP_REFRESH_RESULT_CHANGED : UP_REFRESH_RESULT_UNCHANGED;
 }
 
 const gchar *
@@ -782,6 +1397,14 @@ up_device_init (UpDevice *device)
 
 	g_signal_connect (device, "handle-get-history",
 			  G_CALLBACK (up_device_get_history), device);
+	g_signal_connect (device, "handle-get-history-with-flags",
+			  G_CALLBACK (up_device_get_history_with_flags), device);
+	g_signal_connect (device, "handle-get-history-aggregated",
+			  G_CALLBACK (up_device_get_history_aggregated), device);
+	g_signal_connect (device, "handle-get-history-fd",
+			  G_CALLBACK (up_device_get_history_fd), device);
+	g_signal_connect (device, "handle-get-sessions",
+			  G_CALLBACK (up_device_get_sessions), device);
 	g_signal_connect (device, "handle-get-statistics",
 			  G_CALLBACK (up_device_get_statistics), device);
 }
@@ -852,7 +1475,7 @@ up_device_get_property (GObject      *object,
 	switch (prop_id)
 	{
 	case PROP_POLL_TIMEOUT:
-		g_value_set_int (value, priv->poll_timeout);
+		g_value_set_int (value, up_device_get_effective_poll_timeout (device));
 		break;
 
 	case PROP_LAST_REFRESH:
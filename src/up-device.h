@@ -39,6 +39,18 @@ typedef enum {
 	UP_REFRESH_LINE_POWER,
 } UpRefreshReason;
 
+typedef enum {
+	UP_REFRESH_RESULT_UNCHANGED,
+	UP_REFRESH_RESULT_CHANGED,
+	UP_REFRESH_RESULT_QUEUED,	/* collected in the background */
+} UpRefreshResult;
+
+typedef enum {
+	UP_DEVICE_CIRCUIT_CLOSED,	/* refreshing as usual */
+	UP_DEVICE_CIRCUIT_OPEN,		/* failing, backing off */
+	UP_DEVICE_CIRCUIT_HALF_OPEN,	/* trying again after backing off */
+} UpDeviceCircuit;
+
 struct _UpDeviceClass
 {
 	UpExportedDeviceSkeletonClass parent_class;
@@ -49,6 +61,18 @@ struct _UpDeviceClass
 						 GObject	*sibling);
 	gboolean	 (*refresh)		(UpDevice	*device,
 						 UpRefreshReason reason);
+	/* instead of refresh, for backends where getting the data blocks:
+	 * refresh_collect runs on a worker thread and must not touch the
+	 * properties, refresh_apply gets what it returned on the main
+	 * thread and frees it */
+	gpointer	 (*refresh_collect)	(UpDevice	*device,
+						 UpRefreshReason reason);
+	gboolean	 (*refresh_apply)	(UpDevice	*device,
+						 UpRefreshReason reason,
+						 gpointer	 data);
+	/* frees what refresh_collect returned when it isn't applied */
+	void		 (*refresh_free)	(UpDevice	*device,
+						 gpointer	 data);
 	const gchar	*(*get_id)		(UpDevice	*device);
 	gboolean	 (*get_on_battery)	(UpDevice	*device,
 						 gboolean	*on_battery);
@@ -72,8 +96,13 @@ gboolean	 up_device_polkit_is_allowed	(UpDevice	*device,
 						 GDBusMethodInvocation *invocation);
 void		 up_device_sibling_discovered	(UpDevice	*device,
 						 GObject	*sibling);
-gboolean	 up_device_refresh_internal	(UpDevice	*device,
+UpRefreshResult	 up_device_refresh_internal	(UpDevice	*device,
 						 UpRefreshReason reason);
+void		 up_device_refresh_failed	(UpDevice	*device);
+void		 up_device_refresh_shutdown	(void);
+UpDeviceCircuit	 up_device_get_circuit		(UpDevice	*device,
+						 guint		*failures);
+const gchar	*up_device_circuit_to_string	(UpDeviceCircuit circuit);
 void		 up_device_unregister		(UpDevice	*device);
 gboolean	 up_device_register		(UpDevice	*device);
 gboolean	 up_device_is_registered	(UpDevice	*device);
@@ -0,0 +1,372 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "up-event-log.h"
+
+/*
+ * The daemon records the power events worth knowing about afterwards,
+ * such as plugging in or going to sleep, in a ring of fixed-size records.
+ * The ring is kept in memory for queries and mirrored to a file of the
+ * same layout, where each event is a single write of its record:
+ *
+ *   header:  "UPEV", u32 version, u32 capacity, u32 record size
+ *   records: u32 time, u32 seq, u16 type, u16 reserved, i32 value,
+ *            16 bytes of subject, padded with NULs
+ *
+ * All integers are little endian. Event number seq goes to the record
+ * at seq % capacity, so the newest is found on load as the largest seq
+ * and older events are overwritten once the ring is full.
+ */
+#define UP_EVENT_LOG_MAGIC		"UPEV"
+#define UP_EVENT_LOG_VERSION		1
+#define UP_EVENT_LOG_HEADER_SIZE	16
+#define UP_EVENT_LOG_RECORD_SIZE	32
+
+static void	up_event_log_finalize	(GObject		*object);
+
+struct _UpEventLogPrivate
+{
+	UpEvent			*events;	/* indexed by seq % capacity */
+	guint			 capacity;
+	guint32			 last_seq;
+	gint			 fd;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (UpEventLog, up_event_log, G_TYPE_OBJECT)
+
+/* indexed by UpEventType */
+static const gchar *up_event_type_names[] = {
+	"device-added",
+	"device-removed",
+	"line-power",
+	"state",
+	"warning-level",
+	"suspend",
+	"resume",
+	"critical-action",
+};
+
+/**
+ * up_event_type_to_string:
+ *
+ * Return value: the name used on the bus
+ **/
+const gchar *
+up_event_type_to_string (UpEventType type)
+{
+	if (type >= UP_EVENT_TYPE_LAST)
+		return "unknown";
+	return up_event_type_names[type];
+}
+
+/**
+ * up_event_log_record_write:
+ **/
+static void
+up_event_log_record_write (guint8 *data, const UpEvent *event)
+{
+	guint32 u32;
+	guint16 u16;
+
+	u32 = GUINT32_TO_LE (event->time);
+	memcpy (data, &u32, 4);
+	u32 = GUINT32_TO_LE (event->seq);
+	memcpy (data + 4, &u32, 4);
+	u16 = GUINT16_TO_LE (event->type);
+	memcpy (data + 8, &u16, 2);
+	u16 = 0;
+	memcpy (data + 10, &u16, 2);
+	u32 = GUINT32_TO_LE ((guint32) event->value);
+	memcpy (data + 12, &u32, 4);
+	memcpy (data + 16, event->subject, UP_EVENT_SUBJECT_SIZE);
+}
+
+/**
+ * up_event_log_record_read:
+ **/
+static void
+up_event_log_record_read (const guint8 *data, UpEvent *event)
+{
+	guint32 u32;
+	guint16 u16;
+
+	memcpy (&u32, data, 4);
+	event->time = GUINT32_FROM_LE (u32);
+	memcpy (&u32, data + 4, 4);
+	event->seq = GUINT32_FROM_LE (u32);
+	memcpy (&u16, data + 8, 2);
+	event->type = GUINT16_FROM_LE (u16);
+	event->reserved = 0;
+	memcpy (&u32, data + 12, 4);
+	event->value = (gint32) GUINT32_FROM_LE (u32);
+	memcpy (event->subject, data + 16, UP_EVENT_SUBJECT_SIZE);
+}
+
+/**
+ * up_event_log_write_header:
+ **/
+static gboolean
+up_event_log_write_header (gint fd, guint capacity)
+{
+	guint8 header[UP_EVENT_LOG_HEADER_SIZE];
+	guint32 u32;
+
+	memcpy (header, UP_EVENT_LOG_MAGIC, 4);
+	u32 = GUINT32_TO_LE (UP_EVENT_LOG_VERSION);
+	memcpy (header + 4, &u32, 4);
+	u32 = GUINT32_TO_LE (capacity);
+	memcpy (header + 8, &u32, 4);
+	u32 = GUINT32_TO_LE (UP_EVENT_LOG_RECORD_SIZE);
+	memcpy (header + 12, &u32, 4);
+
+	if (ftruncate (fd, 0) < 0)
+		return FALSE;
+	return pwrite (fd, header, sizeof (header), 0) == sizeof (header);
+}
+
+/**
+ * up_event_log_load:
+ *
+ * Return value: %FALSE if the file is not a log of our capacity, and
+ * should be started again
+ **/
+static gboolean
+up_event_log_load (UpEventLog *log, const gchar *data, gsize length)
+{
+	UpEventLogPrivate *priv = log->priv;
+	guint32 u32;
+	guint i;
+
+	if (length < UP_EVENT_LOG_HEADER_SIZE ||
+	    memcmp (data, UP_EVENT_LOG_MAGIC, 4) != 0)
+		return FALSE;
+	memcpy (&u32, data + 4, 4);
+	if (GUINT32_FROM_LE (u32) != UP_EVENT_LOG_VERSION)
+		return FALSE;
+	memcpy (&u32, data + 8, 4);
+	if (GUINT32_FROM_LE (u32) != priv->capacity)
+		return FALSE;
+	memcpy (&u32, data + 12, 4);
+	if (GUINT32_FROM_LE (u32) != UP_EVENT_LOG_RECORD_SIZE)
+		return FALSE;
+
+	/* a torn record at the end is simply not there */
+	for (i = 0; i < priv->capacity; i++) {
+		gsize offset = UP_EVENT_LOG_HEADER_SIZE + (gsize) i * UP_EVENT_LOG_RECORD_SIZE;
+		UpEvent event;
+
+		if (offset + UP_EVENT_LOG_RECORD_SIZE > length)
+			break;
+		up_event_log_record_read ((const guint8 *) data + offset, &event);
+		if (event.seq == 0 || event.seq % priv->capacity != i)
+			continue;
+		priv->events[i] = event;
+		priv->last_seq = MAX (priv->last_seq, event.seq);
+	}
+
+	/* only keep what belongs to the last lap of the ring */
+	for (i = 0; i < priv->capacity; i++) {
+		if (priv->events[i].seq + priv->capacity <= priv->last_seq)
+			memset (&priv->events[i], 0, sizeof (UpEvent));
+	}
+	return TRUE;
+}
+
+/**
+ * up_event_log_open:
+ * @filename: the file to keep the log in
+ *
+ * Loads the events saved in @filename and keeps it open to add new ones.
+ * Without a file the log is only kept in memory.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+up_event_log_open (UpEventLog *log, const gchar *filename, GError **error)
+{
+	UpEventLogPrivate *priv;
+	g_autofree gchar *data = NULL;
+	gsize length = 0;
+	gint fd;
+
+	g_return_val_if_fail (UP_IS_EVENT_LOG (log), FALSE);
+	priv = log->priv;
+
+	fd = g_open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int errsv = errno;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "failed to open %s: %s", filename, g_strerror (errsv));
+		return FALSE;
+	}
+
+	if (!g_file_get_contents (filename, &data, &length, error)) {
+		close (fd);
+		return FALSE;
+	}
+	if (!up_event_log_load (log, data, length)) {
+		if (length > 0)
+			g_debug ("starting a new event log in %s", filename);
+		if (!up_event_log_write_header (fd, priv->capacity)) {
+			int errsv = errno;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     "failed to write %s: %s", filename, g_strerror (errsv));
+			close (fd);
+			return FALSE;
+		}
+	}
+
+	if (priv->fd >= 0)
+		close (priv->fd);
+	priv->fd = fd;
+	return TRUE;
+}
+
+/**
+ * up_event_log_add:
+ * @subject: what the event is about, such as the name of the device,
+ *   truncated to %UP_EVENT_SUBJECT_SIZE bytes, or %NULL
+ * @value: the new value, where the type of event has one
+ **/
+void
+up_event_log_add (UpEventLog *log, UpEventType type, const gchar *subject, gint32 value)
+{
+	UpEventLogPrivate *priv;
+	UpEvent *event;
+
+	g_return_if_fail (UP_IS_EVENT_LOG (log));
+	priv = log->priv;
+
+	priv->last_seq++;
+	event = &priv->events[priv->last_seq % priv->capacity];
+	memset (event, 0, sizeof (UpEvent));
+	event->time = g_get_real_time () / G_USEC_PER_SEC;
+	event->seq = priv->last_seq;
+	event->type = type;
+	event->value = value;
+	if (subject != NULL)
+		memcpy (event->subject, subject, strnlen (subject, UP_EVENT_SUBJECT_SIZE));
+
+	g_debug ("event %s %.*s %i", up_event_type_to_string (type),
+		 UP_EVENT_SUBJECT_SIZE, event->subject, value);
+
+	if (priv->fd >= 0) {
+		guint8 data[UP_EVENT_LOG_RECORD_SIZE];
+		off_t offset;
+
+		up_event_log_record_write (data, event);
+		offset = UP_EVENT_LOG_HEADER_SIZE +
+			 (off_t) (event->seq % priv->capacity) * UP_EVENT_LOG_RECORD_SIZE;
+		if (pwrite (priv->fd, data, sizeof (data), offset) != sizeof (data))
+			g_warning ("failed to write event: %s", g_strerror (errno));
+	}
+}
+
+/**
+ * up_event_log_get_range:
+ * @start: the first second to return, as a UNIX time
+ * @end: the second after the last one to return, or 0 for no limit
+ *
+ * Return value: an array of #UpEvent, oldest first
+ **/
+GArray *
+up_event_log_get_range (UpEventLog *log, guint32 start, guint32 end)
+{
+	UpEventLogPrivate *priv;
+	GArray *array;
+	guint32 seq;
+
+	g_return_val_if_fail (UP_IS_EVENT_LOG (log), NULL);
+	priv = log->priv;
+
+	array = g_array_new (FALSE, FALSE, sizeof (UpEvent));
+	seq = priv->last_seq >= priv->capacity ? priv->last_seq - priv->capacity + 1 : 1;
+	for (; seq != 0 && seq <= priv->last_seq; seq++) {
+		const UpEvent *event = &priv->events[seq % priv->capacity];
+
+		if (event->seq != seq)
+			continue;
+		if (event->time < start || (end != 0 && event->time >= end))
+			continue;
+		g_array_append_vals (array, event, 1);
+	}
+	return array;
+}
+
+/**
+ * up_event_log_class_init:
+ **/
+static void
+up_event_log_class_init (UpEventLogClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_event_log_finalize;
+}
+
+/**
+ * up_event_log_init:
+ **/
+static void
+up_event_log_init (UpEventLog *log)
+{
+	log->priv = up_event_log_get_instance_private (log);
+	log->priv->fd = -1;
+}
+
+/**
+ * up_event_log_finalize:
+ **/
+static void
+up_event_log_finalize (GObject *object)
+{
+	UpEventLog *log = UP_EVENT_LOG (object);
+
+	if (log->priv->fd >= 0)
+		close (log->priv->fd);
+	g_free (log->priv->events);
+
+	G_OBJECT_CLASS (up_event_log_parent_class)->finalize (object);
+}
+
+/**
+ * up_event_log_new:
+ * @capacity: the number of events to keep
+ **/
+UpEventLog *
+up_event_log_new (guint capacity)
+{
+	UpEventLog *log;
+
+	g_return_val_if_fail (capacity > 0, NULL);
+
+	log = g_object_new (UP_TYPE_EVENT_LOG, NULL);
+	log->priv->capacity = capacity;
+	log->priv->events = g_new0 (UpEvent, capacity);
+	return log;
+}
@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __UP_EVENT_LOG_H
+#define __UP_EVENT_LOG_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_EVENT_LOG		(up_event_log_get_type ())
+#define UP_EVENT_LOG(o)			(G_TYPE_CHECK_INSTANCE_CAST ((o), UP_TYPE_EVENT_LOG, UpEventLog))
+#define UP_EVENT_LOG_CLASS(k)		(G_TYPE_CHECK_CLASS_CAST((k), UP_TYPE_EVENT_LOG, UpEventLogClass))
+#define UP_IS_EVENT_LOG(o)		(G_TYPE_CHECK_INSTANCE_TYPE ((o), UP_TYPE_EVENT_LOG))
+
+typedef struct _UpEventLogPrivate	UpEventLogPrivate;
+typedef struct _UpEventLog		UpEventLog;
+typedef struct _UpEventLogClass		UpEventLogClass;
+
+struct _UpEventLog
+{
+	 GObject			 parent;
+	 UpEventLogPrivate		*priv;
+};
+
+struct _UpEventLogClass
+{
+	GObjectClass			 parent_class;
+};
+
+typedef enum {
+	UP_EVENT_TYPE_DEVICE_ADDED,
+	UP_EVENT_TYPE_DEVICE_REMOVED,
+	UP_EVENT_TYPE_LINE_POWER,	/* value is whether it is online */
+	UP_EVENT_TYPE_STATE,		/* value is the UpDeviceState */
+	UP_EVENT_TYPE_WARNING_LEVEL,	/* value is the UpDeviceLevel */
+	UP_EVENT_TYPE_SUSPEND,
+	UP_EVENT_TYPE_RESUME,
+	UP_EVENT_TYPE_CRITICAL_ACTION,	/* subject is the action */
+	UP_EVENT_TYPE_LAST
+} UpEventType;
+
+#define UP_EVENT_SUBJECT_SIZE		16
+
+typedef struct {
+	guint32			 time;
+	guint32			 seq;		/* from 1, 0 for no event */
+	guint16			 type;		/* UpEventType */
+	guint16			 reserved;
+	gint32			 value;
+	gchar			 subject[UP_EVENT_SUBJECT_SIZE];	/* not always terminated */
+} UpEvent;
+
+GType		 up_event_log_get_type		(void);
+UpEventLog	*up_event_log_new		(guint			 capacity);
+gboolean	 up_event_log_open		(UpEventLog		*log,
+						 const gchar		*filename,
+						 GError			**error);
+void		 up_event_log_add		(UpEventLog		*log,
+						 UpEventType		 type,
+						 const gchar		*subject,
+						 gint32			 value);
+GArray		*up_event_log_get_range		(UpEventLog		*log,
+						 guint32		 start,
+						 guint32		 end);
+const gchar	*up_event_type_to_string	(UpEventType		 type);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(UpEventLog, g_object_unref)
+
+G_END_DECLS
+
+#endif /* __UP_EVENT_LOG_H */
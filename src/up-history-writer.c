@@ -0,0 +1,232 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include "config.h"
+
+#include "up-history-writer.h"
+
+/*
+ * The history of every device is committed to disk by a single writer
+ * owned by the daemon. Each history marks itself dirty with the time it
+ * wants to be saved within, and the writer keeps one timer for the
+ * earliest of these. When it fires all the dirty histories are saved
+ * together, so that devices share their disk wakeups. Each history only
+ * syncs the files it wrote to the history directory, and nothing at all
+ * while it is only staging.
+ */
+
+static void	up_history_writer_finalize	(GObject		*object);
+
+struct _UpHistoryWriterPrivate
+{
+	GPtrArray		*histories;	/* of UpHistory, not referenced */
+	GPtrArray		*dirty;		/* of UpHistory, not referenced */
+	GSource			*save_source;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (UpHistoryWriter, up_history_writer, G_TYPE_OBJECT)
+
+/**
+ * up_history_writer_save_cb:
+ **/
+static gboolean
+up_history_writer_save_cb (UpHistoryWriter *writer)
+{
+	up_history_writer_flush (writer);
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * up_history_writer_schedule:
+ * @timeout: the number of seconds within which the history should be saved
+ *
+ * Adds the history to the next commit, bringing it forward if needed.
+ **/
+void
+up_history_writer_schedule (UpHistoryWriter *writer, UpHistory *history, guint timeout)
+{
+	UpHistoryWriterPrivate *priv;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+	priv = writer->priv;
+
+	if (!g_ptr_array_find (priv->dirty, history, NULL))
+		g_ptr_array_add (priv->dirty, history);
+
+	/* we already have one queued, clear it if this one will fire earlier */
+	if (priv->save_source != NULL) {
+		gint64 ready = g_source_get_ready_time (priv->save_source);
+
+		if (ready > g_source_get_time (priv->save_source) + (gint64) timeout * G_USEC_PER_SEC) {
+			g_clear_pointer (&priv->save_source, g_source_destroy);
+		} else {
+			g_debug ("deferring as earlier timeout is already queued");
+			return;
+		}
+	}
+
+	/* nothing scheduled */
+	g_debug ("saving in %u seconds", timeout);
+	priv->save_source = g_timeout_source_new_seconds (timeout);
+	g_source_set_name (priv->save_source, "[upower] up_history_writer_save_cb");
+	g_source_set_callback (priv->save_source,
+			       (GSourceFunc) up_history_writer_save_cb, writer,
+			       NULL);
+	g_source_attach (priv->save_source, NULL);
+	/* g_source_destroy removes the last reference */
+	g_source_unref (priv->save_source);
+}
+
+/**
+ * up_history_writer_add:
+ *
+ * Adds a history to the ones that are persisted by up_history_writer_persist().
+ **/
+void
+up_history_writer_add (UpHistoryWriter *writer, UpHistory *history)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	if (!g_ptr_array_find (writer->priv->histories, history, NULL))
+		g_ptr_array_add (writer->priv->histories, history);
+}
+
+/**
+ * up_history_writer_remove:
+ *
+ * Forgets about a history that is going away, it saves itself.
+ **/
+void
+up_history_writer_remove (UpHistoryWriter *writer, UpHistory *history)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+	g_ptr_array_remove_fast (writer->priv->histories, history);
+	g_ptr_array_remove_fast (writer->priv->dirty, history);
+}
+
+/**
+ * up_history_writer_flush:
+ *
+ * Saves all the dirty histories now.
+ *
+ * Return value: %FALSE if any history could not be saved
+ **/
+gboolean
+up_history_writer_flush (UpHistoryWriter *writer)
+{
+	UpHistoryWriterPrivate *priv;
+	g_autoptr(GPtrArray) dirty = NULL;
+	gboolean ret = TRUE;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY_WRITER (writer), FALSE);
+	priv = writer->priv;
+
+	g_clear_pointer (&priv->save_source, g_source_destroy);
+	if (priv->dirty->len == 0)
+		return TRUE;
+
+	/* anything that gets dirty from here on is in the next commit */
+	dirty = g_steal_pointer (&priv->dirty);
+	priv->dirty = g_ptr_array_new ();
+
+	for (i = 0; i < dirty->len; i++) {
+		if (!up_history_save_data (g_ptr_array_index (dirty, i)))
+			ret = FALSE;
+	}
+	g_debug ("committed history of %u devices", dirty->len);
+	return ret;
+}
+
+/**
+ * up_history_writer_persist:
+ *
+ * Saves all the histories now, including what they have staged. This is
+ * used on shutdown and before going to sleep, when a staging directory on
+ * a tmpfs may not survive.
+ *
+ * Return value: %FALSE if any history could not be saved
+ **/
+gboolean
+up_history_writer_persist (UpHistoryWriter *writer)
+{
+	UpHistoryWriterPrivate *priv;
+	gboolean ret = TRUE;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY_WRITER (writer), FALSE);
+	priv = writer->priv;
+
+	g_clear_pointer (&priv->save_source, g_source_destroy);
+	g_ptr_array_set_size (priv->dirty, 0);
+
+	for (i = 0; i < priv->histories->len; i++) {
+		if (!up_history_persist_data (g_ptr_array_index (priv->histories, i)))
+			ret = FALSE;
+	}
+	g_debug ("persisted history of %u devices", priv->histories->len);
+	return ret;
+}
+
+/**
+ * up_history_writer_class_init:
+ **/
+static void
+up_history_writer_class_init (UpHistoryWriterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_history_writer_finalize;
+}
+
+/**
+ * up_history_writer_init:
+ **/
+static void
+up_history_writer_init (UpHistoryWriter *writer)
+{
+	writer->priv = up_history_writer_get_instance_private (writer);
+	writer->priv->histories = g_ptr_array_new ();
+	writer->priv->dirty = g_ptr_array_new ();
+}
+
+/**
+ * up_history_writer_finalize:
+ **/
+static void
+up_history_writer_finalize (GObject *object)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (object);
+
+	up_history_writer_flush (writer);
+	g_ptr_array_unref (writer->priv->histories);
+	g_ptr_array_unref (writer->priv->dirty);
+
+	G_OBJECT_CLASS (up_history_writer_parent_class)->finalize (object);
+}
+
+/**
+ * up_history_writer_new:
+ **/
+UpHistoryWriter *
+up_history_writer_new (void)
+{
+	return g_object_new (UP_TYPE_HISTORY_WRITER, NULL);
+}
@@ -19,17 +19,25 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "up-history.h"
-#include "up-stats-item.h"
-#include "up-history-item.h"
+#include "up-history-writer.h"
 
 static void	up_history_finalize	(GObject		*object);
 
@@ -37,22 +45,241 @@ static void	up_history_finalize	(GObject		*object);
 #define UP_HISTORY_SAVE_INTERVAL_LOW_POWER	5	/* seconds */
 #define UP_HISTORY_LOW_POWER_PERCENT	10
 #define UP_HISTORY_DEFAULT_MAX_DATA_AGE	(7*24*60*60)	/* seconds */
+#define UP_HISTORY_DEFAULT_MEMORY_BUDGET	(16*1024*1024)	/* bytes, for all devices */
+#define UP_HISTORY_DEFAULT_PERSIST_INTERVAL	(6*60*60)	/* seconds */
+
+/*
+ * On-disk format, all fixed size integers are little endian. Each device
+ * has a file for the raw samples of all the metrics, history-ID.bin, and
+ * one for each saved rollup, e.g. history-ID-hourly.bin:
+ *
+ *   header: "UPHS", guint32 version, guint32 number of metrics, guint32 base
+ *   block:  guint32 rows, guint32 size of the columns in bytes, guint32 CRC-32
+ *           of the rest of the block, time column, state column, one value
+ *           column per metric
+ *
+ * A row holds the samples of all the metrics taken at the same time in the
+ * same state. The columns are made of LEB128 varints: times are stored as
+ * the zigzag encoded change in the interval from the previous row, states
+ * as (state, count) runs, and values are quantized with the scale of their
+ * metric and stored as zigzag deltas from the previous value plus one, so
+ * that 0 followed by a count can mark rows without a sample of that metric.
+ *
+ * Each save appends a single block; the file is rewritten from scratch when
+ * enough of it is older than max_data_age, or when it could not be parsed.
+ * The checksum lets loading find where an interrupted append left off
+ * without decoding anything, and only that block is lost: the file is cut
+ * back to the last good block before the next append.
+ *
+ * When a staging directory is set the blocks are appended to a file of
+ * the same name there instead, and copied over to the history directory
+ * only every persist_interval, or when asked to. The base in the header
+ * of a staging file is the size the persistent file had when staging
+ * started, so that blocks which were already copied over when the daemon
+ * died can be told apart from new ones. It is 0 in persistent files.
+ *
+ * Version 3 had the same blocks without the checksum, version 2 stored the
+ * columns as plain guint32 and gdouble arrays with NaN for missing samples,
+ * version 1 used a file per metric made of guint32 time, guint32 state,
+ * gdouble value records, and older versions a text file per metric; they
+ * are all imported on load.
+ */
+#define UP_HISTORY_FILE_MAGIC		"UPHS"
+#define UP_HISTORY_FILE_VERSION		4
+#define UP_HISTORY_FILE_VERSION_VARINT	3
+#define UP_HISTORY_FILE_VERSION_PLAIN	2
+#define UP_HISTORY_FILE_HEADER_SIZE	16
+#define UP_HISTORY_FILE_BLOCK_HEADER_SIZE	12
+#define UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD	8	/* versions 2 and 3 */
+#define UP_HISTORY_FILE_VERSION_SERIES	1
+#define UP_HISTORY_FILE_RECORD_SIZE	16
+
+/*
+ * The charge and discharge profiles are kept up to date as charge samples
+ * arrive: the time it took to move into a percentage is added to its bin,
+ * as long as the state did not change and the step was reasonable. They
+ * are saved to history-ID-profile.bin so that they outlive the samples:
+ *
+ *   header: "UPHP", guint32 version, guint32 number of bins, guint32 reserved
+ *   bin:    gdouble seconds, guint32 count, guint32 reserved
+ *
+ * with all the discharging bins first, then the charging ones.
+ */
+#define UP_HISTORY_PROFILE_MAGIC	"UPHP"
+#define UP_HISTORY_PROFILE_VERSION	1
+#define UP_HISTORY_PROFILE_BIN_SIZE	16
+
+typedef struct {
+	gdouble			 time_sum;	/* seconds */
+	guint32			 count;
+} UpHistoryProfileBin;
+
+typedef struct {
+	UpHistoryProfileBin	 bins[2][UP_HISTORY_PROFILE_BINS];	/* indexed by charging */
+	UpHistorySample		 last;
+	UpHistorySample		 old;		/* where the current step started */
+	gboolean		 has_last;
+	gboolean		 has_old;
+	guint			 old_bin;
+	gboolean		 dirty;
+} UpHistoryProfile;
+
+/*
+ * The samples of each series are kept in a ring buffer that grows up to
+ * UP_HISTORY_SERIES_MAX_SAMPLES and then overwrites the oldest sample.
+ * Samples older than max_data_age are dropped as new ones arrive, and
+ * when all the buffers together go over the memory budget the devices
+ * that were queried least recently have the samples they already saved
+ * downsampled. That only ever happens in memory: the files keep the full
+ * detail, and queries are answered at the reduced resolution. It is only
+ * read back, in a thread, when the file has to be rewritten.
+ */
+#define UP_HISTORY_SERIES_MIN_SIZE	64
+#define UP_HISTORY_SERIES_MAX_SAMPLES	(7*24*60*60)	/* a week at 1Hz */
+
+typedef struct {
+	UpHistorySample		*samples;
+	guint			 size;		/* allocated samples */
+	guint			 head;		/* index of the oldest sample */
+	guint			 len;
+	guint			 n_saved;	/* samples already written to disk */
+	guint			 n_file;	/* samples in the file */
+	gboolean		 needs_rewrite;
+	gboolean		 thinned;	/* the saved samples were downsampled */
+} UpHistorySeries;
+
+/*
+ * Each series is also rolled up into buckets of a minute and of an hour
+ * as samples arrive, so that long timespans can be answered without
+ * walking every raw sample. A bucket is closed early when the state
+ * changes, so that each one has a single state. The hourly buckets
+ * outlive the raw samples and so are saved to their own file; the rest
+ * is rebuilt from the raw samples on load.
+ */
+typedef enum {
+	UP_HISTORY_ROLLUP_MINUTE,
+	UP_HISTORY_ROLLUP_HOUR,
+	UP_HISTORY_ROLLUP_LAST
+} UpHistoryRollupKind;
+
+typedef struct {
+	guint			 interval;	/* seconds */
+	guint			 max_age;	/* seconds */
+	const gchar		*suffix;	/* of the file, or %NULL if not saved */
+} UpHistoryRollupInfo;
+
+/* indexed by UpHistoryRollupKind */
+static const UpHistoryRollupInfo up_history_rollups[] = {
+	{ 60,		7*24*60*60,	NULL },
+	{ 60*60,	365*24*60*60,	"-hourly" },
+};
+
+typedef struct {
+	UpHistorySeries		 series;	/* closed buckets */
+	guint32			 start;		/* of the open bucket */
+	guint32			 state;
+	guint64			 sum_time;
+	gdouble			 sum_value;
+	guint			 count;
+} UpHistoryRollup;
+
+/*
+ * The charge series is also indexed by runs of the same state, so that
+ * questions like "when was it last unplugged" take one entry per run
+ * rather than one per sample. The index is rebuilt from the series on
+ * load and then kept up to date as samples arrive, and the runs are kept
+ * for as long as the coarsest rollup.
+ */
+#define UP_HISTORY_SESSIONS_MAX		8192
+
+/* the raw samples, then one for each UpHistoryRollupKind */
+#define UP_HISTORY_TIER_RAW		0
+#define UP_HISTORY_TIER_LAST		(1 + UP_HISTORY_ROLLUP_LAST)
+
+typedef struct {
+	gsize			 size;		/* bytes we know are in the file */
+	gboolean		 needs_rewrite;
+	gboolean		 needs_truncate;	/* anything after size is a torn block */
+	GPtrArray		*legacy_files;	/* imported, to remove once saved */
+} UpHistoryFile;
+
+/* what the loading thread read for a tier, to be merged on the main thread */
+typedef struct {
+	GArray			*samples[UP_HISTORY_TYPE_UNKNOWN];
+	gsize			 size;
+	gsize			 base;
+	gboolean		 needs_rewrite;
+	gboolean		 needs_truncate;
+	GPtrArray		*legacy_files;
+} UpHistoryLoadFile;
+
+typedef struct {
+	gchar			*dir;
+	gchar			*staging_dir;
+	gsize			 staged_size[UP_HISTORY_TIER_LAST];
+	gboolean		 staged_truncate[UP_HISTORY_TIER_LAST];
+	gchar			*id;
+	guint32			 marker_time;
+	UpHistoryLoadFile	 files[UP_HISTORY_TIER_LAST];
+	UpHistoryProfileBin	 profile[2][UP_HISTORY_PROFILE_BINS];
+	gboolean		 has_profile;
+	guint			 n_staged;	/* charge samples not persisted yet */
+} UpHistoryLoad;
+
+/* indexed by UpHistoryType */
+static const gchar *up_history_series_names[] = {
+	"charge",
+	"rate",
+	"time-full",
+	"time-empty",
+	"voltage",
+	"temperature",
+	"energy",
+};
+
+/* how values are quantized on disk, indexed by UpHistoryType */
+static const gdouble up_history_series_scales[] = {
+	100,	/* hundredths of a percent */
+	1000,	/* mW */
+	1,	/* seconds */
+	1,	/* seconds */
+	1000,	/* mV */
+	10,	/* tenths of a degree */
+	1000,	/* mWh */
+};
+
+/* decides which of the polled values of a series are worth keeping */
+typedef struct {
+	gdouble			 last;		/* the last value recorded */
+	gint64			 last_time;	/* when it was recorded */
+	gdouble			 deadband;	/* changes smaller than this are dropped */
+} UpHistoryRecorder;
 
 struct UpHistoryPrivate
 {
 	gchar			*id;
-	gdouble			 rate_last;
-	gint64			 time_full_last;
-	gint64			 time_empty_last;
-	gdouble			 percentage_last;
+	UpHistoryRecorder	 recorders[UP_HISTORY_TYPE_UNKNOWN];
+	guint			 keep_alive;
 	UpDeviceState		 state;
-	GPtrArray		*data_rate;
-	GPtrArray		*data_charge;
-	GPtrArray		*data_time_full;
-	GPtrArray		*data_time_empty;
-	GSource			*save_source;
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryRollup		 rollups[UP_HISTORY_TYPE_UNKNOWN][UP_HISTORY_ROLLUP_LAST];
+	UpHistoryFile		 files[UP_HISTORY_TIER_LAST];
+	UpHistoryFile		 staged[UP_HISTORY_TIER_LAST];
+	gchar			*staging_dir;
+	guint			 persist_interval;
+	gint64			 last_persist;	/* monotonic */
+	UpHistoryProfile	 profile;
+	GArray			*sessions;	/* of UpHistorySession, oldest first */
+	gboolean		 session_open;	/* the last session can be extended */
+	gboolean		 session_has_energy;
+	gdouble			 session_energy;	/* the last energy of the open session */
+	UpHistoryWriter		*writer;
 	guint			 max_data_age;
 	gchar			*dir;
+	gint64			 last_query;	/* monotonic */
+	gboolean		 loading;
+	gboolean		 reloading;	/* the downsampled samples */
+	gboolean		 closing;	/* saving for the last time */
 };
 
 enum {
@@ -62,6 +289,13 @@ enum {
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpHistory, up_history, G_TYPE_OBJECT)
 
+static GList *up_history_instances = NULL;
+static gsize up_history_memory_used = 0;
+static gsize up_history_memory_budget = UP_HISTORY_DEFAULT_MEMORY_BUDGET;
+
+static gboolean	up_history_schedule_save	(UpHistory		*history);
+static void	up_history_reload_thinned	(UpHistory		*history);
+
 /**
  * up_history_set_max_data_age:
  **/
@@ -72,17 +306,500 @@ up_history_set_max_data_age (UpHistory *history, guint max_data_age)
 }
 
 /**
- * up_history_array_copy_cb:
+ * up_history_set_deadband:
+ * @deadband: the smallest change worth recording, in the units of the series
+ *
+ * Values within @deadband of the last recorded value are dropped. As this is
+ * compared with the last recorded rather than the last seen value, a slow
+ * drift is still recorded once it adds up. The default of 0 records every
+ * change.
+ **/
+void
+up_history_set_deadband (UpHistory *history, UpHistoryType type, gdouble deadband)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+	g_return_if_fail (type < UP_HISTORY_TYPE_UNKNOWN);
+
+	history->priv->recorders[type].deadband = MAX (deadband, 0.f);
+}
+
+/**
+ * up_history_set_keep_alive:
+ * @keep_alive: the longest time in seconds between two samples, or 0
+ *
+ * Records a value even if it did not change once the last sample of the
+ * series is older than @keep_alive, so clients can tell a steady value
+ * apart from missing data.
+ **/
+void
+up_history_set_keep_alive (UpHistory *history, guint keep_alive)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	history->priv->keep_alive = keep_alive;
+}
+
+/**
+ * up_history_series_get:
+ * @i: the position in the series, where 0 is the oldest sample
+ **/
+static inline const UpHistorySample *
+up_history_series_get (const UpHistorySeries *series, guint i)
+{
+	return &series->samples[(series->head + i) % series->size];
+}
+
+/**
+ * up_history_series_resize:
+ *
+ * Moves the samples to a new buffer of @size, with the oldest sample first
+ **/
+static void
+up_history_series_resize (UpHistorySeries *series, guint size)
+{
+	UpHistorySample *samples;
+	guint first;
+
+	g_assert (size >= series->len);
+
+	samples = g_new (UpHistorySample, size);
+	if (series->len > 0) {
+		first = MIN (series->len, series->size - series->head);
+		memcpy (samples, series->samples + series->head, first * sizeof (UpHistorySample));
+		memcpy (samples + first, series->samples, (series->len - first) * sizeof (UpHistorySample));
+	}
+	g_free (series->samples);
+
+	up_history_memory_used -= series->size * sizeof (UpHistorySample);
+	up_history_memory_used += size * sizeof (UpHistorySample);
+	g_debug ("history memory now %" G_GSIZE_FORMAT " bytes", up_history_memory_used);
+
+	series->samples = samples;
+	series->size = size;
+	series->head = 0;
+}
+
+/**
+ * up_history_series_drop_oldest:
+ **/
+static void
+up_history_series_drop_oldest (UpHistorySeries *series, guint count)
+{
+	series->head = (series->head + count) % series->size;
+	series->len -= count;
+	series->n_saved = series->n_saved > count ? series->n_saved - count : 0;
+}
+
+/**
+ * up_history_series_add:
+ **/
+static void
+up_history_series_add (UpHistorySeries *series, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistorySample *sample;
+
+	/* full, so drop the oldest sample */
+	if (series->len == UP_HISTORY_SERIES_MAX_SAMPLES)
+		up_history_series_drop_oldest (series, 1);
+
+	if (series->len == series->size)
+		up_history_series_resize (series, CLAMP (series->size * 2,
+							 UP_HISTORY_SERIES_MIN_SIZE,
+							 UP_HISTORY_SERIES_MAX_SAMPLES));
+
+	sample = &series->samples[(series->head + series->len) % series->size];
+	sample->time = time_s;
+	sample->state = state;
+	sample->value = value;
+	series->len++;
+}
+
+/**
+ * up_history_series_evict:
+ * @oldest: the time of the oldest sample to keep
+ *
+ * Drops the samples that are too old, and gives memory back once the
+ * buffer is mostly empty.
+ **/
+static void
+up_history_series_evict (UpHistorySeries *series, guint32 oldest)
+{
+	guint count = 0;
+
+	/* the data is ordered, so the old entries are at the start */
+	while (count < series->len && up_history_series_get (series, count)->time < oldest)
+		count++;
+	if (count == 0)
+		return;
+	up_history_series_drop_oldest (series, count);
+
+	if (series->size > UP_HISTORY_SERIES_MIN_SIZE && series->len < series->size / 4)
+		up_history_series_resize (series, MAX (series->size / 2, UP_HISTORY_SERIES_MIN_SIZE));
+}
+
+/**
+ * up_history_series_downsample:
+ *
+ * Halves the number of saved samples by merging neighbours, averaging them
+ * when they are in the same state and keeping the newer one otherwise. The
+ * samples that still have to be saved are kept as-is, so that the files
+ * never lose any detail.
+ **/
+static void
+up_history_series_downsample (UpHistorySeries *series)
+{
+	UpHistorySample *samples;
+	const UpHistorySample *a;
+	const UpHistorySample *b;
+	guint size;
+	guint len = 0;
+	guint n_saved;
+	guint n;
+	guint i;
+
+	/* the newest sample is the current value, and is kept as-is */
+	n = MIN (series->n_saved, series->len - 1);
+	samples = g_new (UpHistorySample, series->len);
+	for (i = 0; i + 1 < n; i += 2) {
+		a = up_history_series_get (series, i);
+		b = up_history_series_get (series, i + 1);
+		samples[len] = *b;
+		if (a->state == b->state) {
+			samples[len].time = ((guint64) a->time + b->time) / 2;
+			samples[len].value = (a->value + b->value) / 2;
+		}
+		len++;
+	}
+	n_saved = len + series->n_saved - i;
+	for (; i < series->len; i++)
+		samples[len++] = *up_history_series_get (series, i);
+	g_debug ("downsampled from %i to %i samples", series->len, len);
+
+	size = MAX (len, UP_HISTORY_SERIES_MIN_SIZE);
+	up_history_memory_used -= series->size * sizeof (UpHistorySample);
+	up_history_memory_used += size * sizeof (UpHistorySample);
+	g_free (series->samples);
+	series->samples = g_renew (UpHistorySample, samples, size);
+	series->size = size;
+	series->head = 0;
+	series->len = len;
+	series->n_saved = n_saved;
+	series->thinned = TRUE;
+}
+
+/**
+ * up_history_series_clear:
+ **/
+static void
+up_history_series_clear (UpHistorySeries *series)
+{
+	up_history_memory_used -= series->size * sizeof (UpHistorySample);
+	g_free (series->samples);
+	memset (series, 0, sizeof (UpHistorySeries));
+}
+
+/**
+ * up_history_can_downsample:
+ **/
+static gboolean
+up_history_can_downsample (UpHistory *history)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (history->priv->series); i++) {
+		if (history->priv->series[i].n_saved > UP_HISTORY_SERIES_MIN_SIZE)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * up_history_compare_last_query:
+ **/
+static gint
+up_history_compare_last_query (gconstpointer a, gconstpointer b)
+{
+	const UpHistory *history_a = a;
+	const UpHistory *history_b = b;
+
+	if (history_a->priv->last_query < history_b->priv->last_query)
+		return -1;
+	return history_a->priv->last_query > history_b->priv->last_query;
+}
+
+/**
+ * up_history_enforce_memory_budget:
+ *
+ * Downsamples the saved history of the devices until all the samples fit
+ * into the memory budget again. Each pass halves every device once, the
+ * ones that were queried least recently first, so that the cut is spread
+ * over all of them rather than taken from a single one.
+ **/
+static void
+up_history_enforce_memory_budget (void)
+{
+	GList *l;
+	guint i;
+
+	while (up_history_memory_used > up_history_memory_budget) {
+		GList *victims = NULL;
+
+		for (l = up_history_instances; l != NULL; l = l->next) {
+			if (up_history_can_downsample (l->data))
+				victims = g_list_prepend (victims, l->data);
+		}
+
+		/* nothing more we can do */
+		if (victims == NULL) {
+			g_debug ("history memory %" G_GSIZE_FORMAT " bytes is over budget", up_history_memory_used);
+			return;
+		}
+
+		victims = g_list_sort (victims, up_history_compare_last_query);
+		for (l = victims; l != NULL; l = l->next) {
+			UpHistory *victim = l->data;
+
+			if (up_history_memory_used <= up_history_memory_budget)
+				break;
+			g_debug ("downsampling history of %s to reduce memory", victim->priv->id);
+			for (i = 0; i < G_N_ELEMENTS (victim->priv->series); i++) {
+				if (victim->priv->series[i].n_saved > UP_HISTORY_SERIES_MIN_SIZE)
+					up_history_series_downsample (&victim->priv->series[i]);
+			}
+		}
+		g_list_free (victims);
+	}
+}
+
+/**
+ * up_history_get_total_memory:
+ *
+ * Return value: the number of bytes used for the samples of all devices
+ **/
+gsize
+up_history_get_total_memory (void)
+{
+	return up_history_memory_used;
+}
+
+/**
+ * up_history_set_memory_budget:
+ **/
+void
+up_history_set_memory_budget (gsize budget)
+{
+	up_history_memory_budget = budget;
+	up_history_enforce_memory_budget ();
+}
+
+/**
+ * up_history_rollup_get_pending:
+ *
+ * Return value: %TRUE if there is an open bucket, which is copied to @sample
+ **/
+static gboolean
+up_history_rollup_get_pending (const UpHistoryRollup *rollup, UpHistorySample *sample)
+{
+	if (rollup->count == 0)
+		return FALSE;
+	sample->time = rollup->sum_time / rollup->count;
+	sample->state = rollup->state;
+	sample->value = rollup->sum_value / rollup->count;
+	return TRUE;
+}
+
+/**
+ * up_history_rollup_add:
+ **/
+static void
+up_history_rollup_add (UpHistoryRollup *rollup, guint interval, const UpHistorySample *sample)
+{
+	UpHistorySample bucket;
+	guint32 start = sample->time - sample->time % interval;
+
+	/* close the open bucket */
+	if (up_history_rollup_get_pending (rollup, &bucket) &&
+	    (start != rollup->start || sample->state != rollup->state)) {
+		up_history_series_add (&rollup->series, bucket.time, bucket.value, bucket.state);
+		rollup->sum_time = 0;
+		rollup->sum_value = 0;
+		rollup->count = 0;
+	}
+
+	if (rollup->count == 0) {
+		rollup->start = start;
+		rollup->state = sample->state;
+	}
+	rollup->sum_time += sample->time;
+	rollup->sum_value += sample->value;
+	rollup->count++;
+}
+
+/**
+ * up_history_profile_add:
+ **/
+static void
+up_history_profile_add (UpHistoryProfile *profile, const UpHistorySample *sample)
+{
+	gdouble delta;
+	guint bin;
+
+	if (!profile->has_last || sample->state != profile->last.state) {
+		profile->has_old = FALSE;
+		goto out;
+	}
+
+	/* round to the nearest int */
+	bin = rint (sample->value);
+
+	/* ensure bin is in range */
+	if (bin >= UP_HISTORY_PROFILE_BINS)
+		bin = UP_HISTORY_PROFILE_BINS - 1;
+
+	/* same */
+	if (bin == profile->old_bin)
+		goto out;
+	profile->old_bin = bin;
+
+	if (profile->has_old) {
+		/* not enough or too much difference */
+		delta = fabs (sample->value - profile->old.value);
+		if (delta < 0.01f || delta > 3.0f) {
+			profile->has_old = FALSE;
+			goto out;
+		}
+
+		if (sample->state == UP_DEVICE_STATE_CHARGING ||
+		    sample->state == UP_DEVICE_STATE_DISCHARGING) {
+			UpHistoryProfileBin *profile_bin;
+
+			profile_bin = &profile->bins[sample->state == UP_DEVICE_STATE_CHARGING][bin];
+			profile_bin->time_sum += sample->time - profile->old.time;
+			profile_bin->count++;
+			profile->dirty = TRUE;
+		}
+	}
+	profile->old = *sample;
+	profile->has_old = TRUE;
+out:
+	profile->last = *sample;
+	profile->has_last = TRUE;
+}
+
+/**
+ * up_history_sessions_add:
+ *
+ * Extends the open session with a charge or energy sample, or starts a new
+ * one with a charge sample in another state.
+ **/
+static void
+up_history_sessions_add (UpHistory *history, UpHistoryType type, const UpHistorySample *sample)
+{
+	UpHistoryPrivate *priv = history->priv;
+	UpHistorySession *session = NULL;
+	guint max_age = up_history_rollups[UP_HISTORY_ROLLUP_LAST - 1].max_age;
+	guint n_old = 0;
+
+	/* the markers of a restart close the session, we don't know what
+	 * happened in between */
+	if (sample->state == UP_DEVICE_STATE_UNKNOWN) {
+		priv->session_open = FALSE;
+		return;
+	}
+
+	if (priv->session_open)
+		session = &g_array_index (priv->sessions, UpHistorySession, priv->sessions->len - 1);
+
+	if (type == UP_HISTORY_TYPE_ENERGY) {
+		if (session == NULL || session->state != sample->state)
+			return;
+		if (priv->session_has_energy)
+			session->energy += sample->value - priv->session_energy;
+		priv->session_energy = sample->value;
+		priv->session_has_energy = TRUE;
+		return;
+	}
+
+	if (session == NULL || session->state != sample->state) {
+		UpHistorySession new_session = { 0 };
+
+		new_session.start = sample->time;
+		new_session.state = sample->state;
+		new_session.start_charge = sample->value;
+		g_array_append_val (priv->sessions, new_session);
+		session = &g_array_index (priv->sessions, UpHistorySession, priv->sessions->len - 1);
+		priv->session_open = TRUE;
+		priv->session_has_energy = FALSE;
+	}
+	session->end = sample->time;
+	session->end_charge = sample->value;
+
+	/* drop the sessions that ended too long ago, or too many */
+	while (n_old < priv->sessions->len - 1 &&
+	       (priv->sessions->len - n_old > UP_HISTORY_SESSIONS_MAX ||
+		(sample->time > max_age &&
+		 g_array_index (priv->sessions, UpHistorySession, n_old).end < sample->time - max_age)))
+		n_old++;
+	if (n_old > 0)
+		g_array_remove_range (priv->sessions, 0, n_old);
+}
+
+/**
+ * up_history_add_sample:
+ **/
+static void
+up_history_add_sample (UpHistory *history, UpHistoryType type,
+		       guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistorySeries *series = &history->priv->series[type];
+	UpHistorySample sample;
+	guint i;
+
+	up_history_series_add (series, time_s, value, state);
+	if (time_s > history->priv->max_data_age)
+		up_history_series_evict (series, time_s - history->priv->max_data_age);
+
+	/* the rollups are rebuilt once the saved samples have been loaded */
+	if (history->priv->loading) {
+		up_history_enforce_memory_budget ();
+		return;
+	}
+
+	sample.time = time_s;
+	sample.state = state;
+	sample.value = value;
+	if (type == UP_HISTORY_TYPE_CHARGE)
+		up_history_profile_add (&history->priv->profile, &sample);
+	if (type == UP_HISTORY_TYPE_CHARGE || type == UP_HISTORY_TYPE_ENERGY)
+		up_history_sessions_add (history, type, &sample);
+	for (i = 0; i < UP_HISTORY_ROLLUP_LAST; i++) {
+		UpHistoryRollup *rollup = &history->priv->rollups[type][i];
+
+		up_history_rollup_add (rollup, up_history_rollups[i].interval, &sample);
+		if (time_s > up_history_rollups[i].max_age)
+			up_history_series_evict (&rollup->series, time_s - up_history_rollups[i].max_age);
+	}
+
+	up_history_enforce_memory_budget ();
+}
+
+/**
+ * up_history_sample_array_add:
  **/
 static void
-up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
+up_history_sample_array_add (GArray *array, guint64 time_s, gdouble value, UpDeviceState state)
 {
-	g_ptr_array_add (dest, g_object_ref (item));
+	UpHistorySample sample;
+
+	sample.time = time_s;
+	sample.state = state;
+	sample.value = value;
+	g_array_append_val (array, sample);
 }
 
 /**
- * up_history_array_limit_resolution:
- * @array: The data we have for a specific graph
+ * up_history_view_limit_resolution:
+ * @view: The data we have for a specific graph
  * @max_num: The max desired points
  *
  * We need to reduce the number of data points else the graph will take a long
@@ -113,40 +830,29 @@ up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
  * 2 = 41,70
  * 3 = 85,30
  **/
-static GPtrArray *
-up_history_array_limit_resolution (GPtrArray *array, guint max_num)
+static GArray *
+up_history_view_limit_resolution (const UpHistoryView *view, guint max_num)
 {
-	UpHistoryItem *item;
-	UpHistoryItem *item_new;
+	const UpHistorySample *item;
 	guint length;
 	guint i;
 	guint64 last;
 	guint64 first;
-	GPtrArray *new;
+	GArray *new;
 	UpDeviceState state = UP_DEVICE_STATE_UNKNOWN;
 	guint64 time_s = 0;
 	gdouble value = 0;
 	guint64 count = 0;
 	guint step = 1;
 
-	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	g_debug ("length of array (before) %i", array->len);
+	g_debug ("length of array (before) %i", view->len);
 
-	/* check length */
-	length = array->len;
-	if (length == 0)
-		goto out;
-	if (length < max_num) {
-		/* need to copy array */
-		g_ptr_array_foreach (array, (GFunc) up_history_array_copy_cb, new);
-		goto out;
-	}
+	length = view->len;
+	new = g_array_sized_new (FALSE, FALSE, sizeof (UpHistorySample), max_num + 1);
 
 	/* last element */
-	item = (UpHistoryItem *) g_ptr_array_index (array, length-1);
-	last = up_history_item_get_time (item);
-	item = (UpHistoryItem *) g_ptr_array_index (array, 0);
-	first = up_history_item_get_time (item);
+	last = up_history_view_get (view, length-1)->time;
+	first = up_history_view_get (view, 0)->time;
 
 	/* Reduces the number of points to a pre-set level using a time
 	 * division algorithm so we don't keep diluting the previous
@@ -154,213 +860,392 @@ up_history_array_limit_resolution (GPtrArray *array, guint max_num)
 	for (i = 0; i < length; i++) {
 		guint64 preset;
 
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		item = up_history_view_get (view, i);
 		preset = last + ((first - last) * (guint64) step) / max_num;
 
 		/* if state changed or we went over the preset do a new point */
 		if (count > 0 &&
-		    (up_history_item_get_time (item) > preset ||
-		     up_history_item_get_state (item) != state)) {
-			item_new = up_history_item_new ();
-			up_history_item_set_time (item_new, time_s / count);
-			up_history_item_set_value (item_new, value / count);
-			up_history_item_set_state (item_new, state);
-			g_ptr_array_add (new, item_new);
+		    (item->time > preset ||
+		     item->state != state)) {
+			up_history_sample_array_add (new, time_s / count, value / count, state);
 
 			step++;
-			time_s = up_history_item_get_time (item);
-			value = up_history_item_get_value (item);
-			state = up_history_item_get_state (item);
+			time_s = item->time;
+			value = item->value;
+			state = item->state;
 			count = 1;
 		} else {
 			count++;
-			time_s += up_history_item_get_time (item);
-			value += up_history_item_get_value (item);
+			time_s += item->time;
+			value += item->value;
 		}
 	}
 
 	/* only add if nonzero */
-	if (count > 0) {
-		item_new = up_history_item_new ();
-		up_history_item_set_time (item_new, time_s / count);
-		up_history_item_set_value (item_new, value / count);
-		up_history_item_set_state (item_new, state);
-		g_ptr_array_add (new, item_new);
-	}
+	if (count > 0)
+		up_history_sample_array_add (new, time_s / count, value / count, state);
 
 	/* check length */
 	g_debug ("length of array (after) %i", new->len);
-out:
 	return new;
 }
 
 /**
- * up_history_copy_array_timespan:
+ * up_history_view_lttb:
+ * @view: The data we have for a specific graph
+ * @max_num: The max desired points
+ *
+ * Picks @max_num of the samples with the largest-triangle-three-buckets
+ * algorithm: the first and last samples are kept, and from each bucket in
+ * between the sample that makes the largest triangle with the one picked
+ * before and the mean of the next bucket. Unlike averaging this keeps the
+ * peaks and edges, and the samples returned are real ones.
  **/
-static GPtrArray *
-up_history_copy_array_timespan (const GPtrArray *array, guint timespan)
+static GArray *
+up_history_view_lttb (const UpHistoryView *view, guint max_num)
 {
-	guint i;
-	UpHistoryItem *item;
-	GPtrArray *array_new;
-	gint64 time_now;
-
-	/* no data */
-	if (array->len == 0)
-		return NULL;
-
-	/* no limit on data */
-	if (timespan == 0) {
-		array_new = g_ptr_array_ref ((GPtrArray *) array);
-		goto out;
+	const UpHistorySample *a;
+	GArray *new;
+	gdouble every;
+	guint length = view->len;
+	guint i, j;
+
+	new = g_array_sized_new (FALSE, FALSE, sizeof (UpHistorySample), max_num);
+	a = up_history_view_get (view, 0);
+	g_array_append_vals (new, a, 1);
+	if (max_num < 3) {
+		if (max_num == 2)
+			g_array_append_vals (new, up_history_view_get (view, length - 1), 1);
+		return new;
 	}
 
-	/* new data */
-	array_new = g_ptr_array_new ();
-	time_now = g_get_real_time ();
-	g_debug ("limiting data to last %i seconds", timespan);
-
-	/* treat the timespan like a range, and search backwards */
-	timespan *= 0.95f;
-	for (i=array->len-1; i>0; i--) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if ((time_now / 1000000) - up_history_item_get_time (item) < timespan)
-			g_ptr_array_add (array_new, g_object_ref (item));
+	every = (gdouble) (length - 2) / (max_num - 2);
+	for (i = 0; i < max_num - 2; i++) {
+		const UpHistorySample *picked = NULL;
+		guint start = (guint) (i * every) + 1;
+		guint end = (guint) ((i + 1) * every) + 1;
+		guint next_end = MIN ((guint) ((i + 2) * every) + 1, length);
+		gdouble next_time = 0;
+		gdouble next_value = 0;
+		gdouble max_area = -1;
+
+		/* the mean of the next bucket, relative to the picked sample
+		 * as the view can be newest first */
+		for (j = end; j < next_end; j++) {
+			const UpHistorySample *item = up_history_view_get (view, j);
+
+			next_time += (gdouble) item->time - a->time;
+			next_value += item->value;
+		}
+		next_time /= next_end - end;
+		next_value = next_value / (next_end - end) - a->value;
+
+		for (j = start; j < end; j++) {
+			const UpHistorySample *item = up_history_view_get (view, j);
+			gdouble area;
+
+			area = fabs (((gdouble) item->time - a->time) * next_value -
+				     next_time * (item->value - a->value));
+			if (area > max_area) {
+				max_area = area;
+				picked = item;
+			}
+		}
+		g_array_append_vals (new, picked, 1);
+		a = picked;
 	}
-out:
-	return array_new;
+
+	g_array_append_vals (new, up_history_view_get (view, length - 1), 1);
+	return new;
 }
 
 /**
- * up_history_get_data:
+ * up_history_view_min_max:
+ * @view: The data we have for a specific graph
+ * @max_num: The max desired points
+ *
+ * Splits the samples in @max_num / 2 buckets and keeps the smallest and
+ * largest sample of each, in the order they came in, so that the envelope
+ * of the data is exact.
  **/
-GPtrArray *
-up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+static GArray *
+up_history_view_min_max (const UpHistoryView *view, guint max_num)
 {
-	GPtrArray *array;
-	GPtrArray *array_resolution;
-	const GPtrArray *array_data = NULL;
-
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
-
-	if (history->priv->id == NULL)
-		return NULL;
-
-	if (type == UP_HISTORY_TYPE_CHARGE)
-		array_data = history->priv->data_charge;
-	else if (type == UP_HISTORY_TYPE_RATE)
-		array_data = history->priv->data_rate;
-	else if (type == UP_HISTORY_TYPE_TIME_FULL)
-		array_data = history->priv->data_time_full;
-	else if (type == UP_HISTORY_TYPE_TIME_EMPTY)
-		array_data = history->priv->data_time_empty;
-
-	/* not recognized */
-	if (array_data == NULL)
-		return NULL;
-
-	/* only return a certain time */
-	array = up_history_copy_array_timespan (array_data, timespan);
-	if (array == NULL)
-		return NULL;
-
-	/* only add a certain number of points */
-	array_resolution = up_history_array_limit_resolution (array, resolution);
-	g_ptr_array_unref (array);
+	GArray *new;
+	guint n_buckets = MAX (max_num / 2, 1);
+	guint length = view->len;
+	guint i, j;
+
+	new = g_array_sized_new (FALSE, FALSE, sizeof (UpHistorySample), n_buckets * 2);
+	for (i = 0; i < n_buckets; i++) {
+		guint start = (guint64) length * i / n_buckets;
+		guint end = (guint64) length * (i + 1) / n_buckets;
+		guint min = start;
+		guint max = start;
+
+		if (start == end)
+			continue;
+		for (j = start + 1; j < end; j++) {
+			gdouble value = up_history_view_get (view, j)->value;
 
-	return array_resolution;
+			if (value < up_history_view_get (view, min)->value)
+				min = j;
+			if (value > up_history_view_get (view, max)->value)
+				max = j;
+		}
+		g_array_append_vals (new, up_history_view_get (view, MIN (min, max)), 1);
+		if (min != max)
+			g_array_append_vals (new, up_history_view_get (view, MAX (min, max)), 1);
+	}
+	return new;
 }
 
 /**
- * up_history_get_profile_data:
+ * up_history_series_upper_bound:
+ *
+ * Return value: the position of the first sample newer than @time_s
  **/
-GPtrArray *
-up_history_get_profile_data (UpHistory *history, gboolean charging)
+static guint
+up_history_series_upper_bound (const UpHistorySeries *series, guint32 time_s)
 {
-	guint i;
-	guint non_zero_accuracy = 0;
-	gfloat average = 0.0f;
-	guint bin;
-	guint oldbin = 999;
-	UpHistoryItem *item_last = NULL;
-	UpHistoryItem *item;
-	UpHistoryItem *item_old = NULL;
-	UpStatsItem *stats;
-	GPtrArray *array;
-	GPtrArray *data;
-	guint time_s;
-	gdouble value;
-	gdouble total_value = 0.0f;
+	guint lo = 0;
+	guint hi = series->len;
 
-	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
 
-	/* create 100 item list and set to zero */
-	data = g_ptr_array_new_full (101, g_object_unref);
-	for (i=0; i<101; i++) {
-		stats = up_stats_item_new ();
-		g_ptr_array_add (data, stats);
-	}
-
-	array = history->priv->data_charge;
-	for (i=0; i<array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if (item_last == NULL ||
-		    up_history_item_get_state (item) != up_history_item_get_state (item_last)) {
-			item_old = NULL;
-			goto cont;
-		}
-
-		/* round to the nearest int */
-		bin = rint (up_history_item_get_value (item));
-
-		/* ensure bin is in range */
-		if (bin >= data->len)
-			bin = data->len - 1;
-
-		/* different */
-		if (oldbin != bin) {
-			oldbin = bin;
-			if (item_old != NULL) {
-				/* not enough or too much difference */
-				value = fabs (up_history_item_get_value (item) - up_history_item_get_value (item_old));
-				if (value < 0.01f) {
-					item_old = NULL;
-					goto cont;
-				}
-				if (value > 3.0f) {
-					item_old = NULL;
-					goto cont;
-				}
+		if (up_history_series_get (series, mid)->time <= time_s)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-				time_s = up_history_item_get_time (item) - up_history_item_get_time (item_old);
-				/* use the accuracy field as a counter for now */
-				if ((charging && up_history_item_get_state (item) == UP_DEVICE_STATE_CHARGING) ||
-				    (!charging && up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)) {
-					stats = (UpStatsItem *) g_ptr_array_index (data, bin);
-					up_stats_item_set_value (stats, up_stats_item_get_value (stats) + time_s);
-					up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) + 1);
-				}
-			}
-			item_old = item;
+/**
+ * up_history_view_set_series:
+ * @start: the position of the first sample to include
+ *
+ * Points the view at the samples from @start onwards, which are at most
+ * two runs of the ring buffer.
+ **/
+static void
+up_history_view_set_series (UpHistoryView *view, const UpHistorySeries *series, guint start)
+{
+	guint count = series->len - start;
+	guint index;
+
+	if (count == 0)
+		return;
+	index = (series->head + start) % series->size;
+	view->segments[0] = series->samples + index;
+	view->lengths[0] = MIN (count, series->size - index);
+	view->segments[1] = series->samples;
+	view->lengths[1] = count - view->lengths[0];
+}
+
+/**
+ * up_history_view_get:
+ * @i: the position in the order the samples should be returned in
+ **/
+const UpHistorySample *
+up_history_view_get (const UpHistoryView *view, guint i)
+{
+	if (view->reversed)
+		i = view->len - 1 - i;
+	if (i < view->lengths[0])
+		return &view->segments[0][i];
+	i -= view->lengths[0];
+	if (i < view->lengths[1])
+		return &view->segments[1][i];
+	return &view->pending;
+}
+
+/**
+ * up_history_view_clear:
+ **/
+void
+up_history_view_clear (UpHistoryView *view)
+{
+	g_clear_pointer (&view->downsampled, g_array_unref);
+}
+
+/**
+ * up_history_get_oldest_time:
+ **/
+static guint32
+up_history_get_oldest_time (UpHistory *history, UpHistoryType type, guint32 time_now)
+{
+	const UpHistorySeries *series;
+	guint32 oldest = time_now;
+	guint i;
+
+	series = &history->priv->series[type];
+	if (series->len > 0)
+		oldest = MIN (oldest, up_history_series_get (series, 0)->time);
+	for (i = 0; i < UP_HISTORY_ROLLUP_LAST; i++) {
+		series = &history->priv->rollups[type][i].series;
+		if (series->len > 0)
+			oldest = MIN (oldest, up_history_series_get (series, 0)->time);
+	}
+	return oldest;
+}
+
+/**
+ * up_history_get_view:
+ * @timespan: the number of seconds to return, or 0 for everything
+ * @resolution: the maximum number of samples to return, or 0 for no limit
+ * @downsample: how to reduce the samples to @resolution
+ * @view: the #UpHistoryView to set up, to be cleared with up_history_view_clear()
+ *
+ * Finds the samples to return for a query without copying them. Limited
+ * timespans are returned newest first, everything else oldest first.
+ * The saved samples of a device that was not queried for a while may have
+ * been downsampled to fit the memory budget, which the view then says.
+ *
+ * Return value: %FALSE if there is no data
+ **/
+gboolean
+up_history_get_view (UpHistory *history, UpHistoryType type, guint timespan,
+		     guint resolution, UpHistoryDownsample downsample, UpHistoryView *view)
+{
+	const UpHistorySeries *series;
+	gboolean reduced;
+	GArray *array;
+	guint32 time_now;
+	guint32 cutoff = 0;
+	guint start = 0;
+	guint span;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	memset (view, 0, sizeof (UpHistoryView));
+
+	if (history->priv->id == NULL)
+		return FALSE;
+
+	/* not recognized */
+	if (type >= UP_HISTORY_TYPE_UNKNOWN)
+		return FALSE;
+	history->priv->last_query = g_get_monotonic_time ();
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+
+	/* use the coarsest rollup that still has at least half the points
+	 * asked for over the part of the timespan we have data for */
+	series = &history->priv->series[type];
+	if (timespan > 0 && resolution > 0) {
+		span = MIN (timespan, time_now - up_history_get_oldest_time (history, type, time_now));
+		for (i = UP_HISTORY_ROLLUP_LAST; i > 0; i--) {
+			const UpHistoryRollup *rollup = &history->priv->rollups[type][i - 1];
+
+			if ((guint64) up_history_rollups[i - 1].interval * resolution > (guint64) span * 2)
+				continue;
+			g_debug ("using %is buckets for %is at %i points",
+				 up_history_rollups[i - 1].interval, timespan, resolution);
+			series = &rollup->series;
+			view->has_pending = up_history_rollup_get_pending (rollup, &view->pending);
+			break;
 		}
-cont:
-		item_last = item;
 	}
 
-	/* divide the value by the number of samples to make the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) != 0)
-			up_stats_item_set_value (stats, up_stats_item_get_value (stats) / up_stats_item_get_accuracy (stats));
+	/* no data */
+	if (series->len == 0 && !view->has_pending)
+		return FALSE;
+
+	/* treat the timespan like a range, the samples are in time order */
+	if (timespan > 0) {
+		g_debug ("limiting data to last %i seconds", timespan);
+		timespan *= 0.95f;
+		if (time_now > timespan)
+			cutoff = time_now - timespan;
+		start = up_history_series_upper_bound (series, cutoff);
+		if (view->has_pending && view->pending.time <= cutoff)
+			view->has_pending = FALSE;
+		view->reversed = TRUE;
+	}
+	up_history_view_set_series (view, series, start);
+	view->len = view->lengths[0] + view->lengths[1] + (view->has_pending ? 1 : 0);
+	view->reduced = series->thinned;
+
+	/* only add a certain number of points */
+	if (resolution == 0 || view->len < resolution)
+		return TRUE;
+	switch (downsample) {
+	case UP_HISTORY_DOWNSAMPLE_LTTB:
+		array = up_history_view_lttb (view, resolution);
+		break;
+	case UP_HISTORY_DOWNSAMPLE_MIN_MAX:
+		array = up_history_view_min_max (view, resolution);
+		break;
+	default:
+		array = up_history_view_limit_resolution (view, resolution);
+		break;
 	}
+	reduced = view->reduced;
+	memset (view, 0, sizeof (UpHistoryView));
+	view->downsampled = array;
+	view->reduced = reduced;
+	view->segments[0] = (const UpHistorySample *) array->data;
+	view->lengths[0] = array->len;
+	view->len = array->len;
+	return TRUE;
+}
 
-	/* find non-zero accuracy values for the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0) {
-			total_value += up_stats_item_get_value (stats);
-			non_zero_accuracy++;
-		}
+/**
+ * up_history_get_data:
+ *
+ * Return value: an array of #UpHistorySample in the order described for
+ * up_history_get_view(), or %NULL if there is no data
+ **/
+GArray *
+up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+{
+	UpHistoryView view;
+	GArray *array;
+	guint i;
+
+	if (!up_history_get_view (history, type, timespan, resolution,
+				  UP_HISTORY_DOWNSAMPLE_AVERAGE, &view))
+		return NULL;
+
+	array = g_array_sized_new (FALSE, FALSE, sizeof (UpHistorySample), view.len);
+	for (i = 0; i < view.len; i++)
+		g_array_append_vals (array, up_history_view_get (&view, i), 1);
+	up_history_view_clear (&view);
+	return array;
+}
+
+/**
+ * up_history_get_profile_data:
+ * @stats: (out caller-allocates): UP_HISTORY_PROFILE_BINS items to fill in
+ *
+ * Gets how long each percentage takes compared to the average, where 1.0
+ * is twice the average and -1.0 half of it, and how many cycles that is
+ * based on, 20% for each.
+ **/
+gboolean
+up_history_get_profile_data (UpHistory *history, gboolean charging, UpHistoryProfileStat *stats)
+{
+	const UpHistoryProfileBin *bins;
+	guint non_zero_accuracy = 0;
+	gdouble total_value = 0.0f;
+	gdouble average = 0.0f;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	history->priv->last_query = g_get_monotonic_time ();
+
+	/* divide the time by the number of samples to make the average */
+	bins = history->priv->profile.bins[charging ? 1 : 0];
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+		stats[i].value = 0.0f;
+		if (bins[i].count == 0)
+			continue;
+		stats[i].value = bins[i].time_sum / bins[i].count;
+		total_value += stats[i].value;
+		non_zero_accuracy++;
 	}
 
 	/* average */
@@ -368,342 +1253,2340 @@ cont:
 		average = total_value / non_zero_accuracy;
 	g_debug ("average is %f", average);
 
-	/* make the values a factor of 0, so that 1.0 is twice the
-	 * average, and -1.0 is half the average */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		if (up_stats_item_get_accuracy (stats) > 0)
-			up_stats_item_set_value (stats, (up_stats_item_get_value (stats) - average) / average);
-		else
-			up_stats_item_set_value (stats, 0.0f);
+	/* make the values a factor of 0, so that 1.0 is twice the
+	 * average, and -1.0 is half the average */
+	for (i = 0; i < UP_HISTORY_PROFILE_BINS; i++) {
+		if (bins[i].count > 0)
+			stats[i].value = (stats[i].value - average) / average;
+		stats[i].accuracy = bins[i].count * 20.0f;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_tier_get_suffix:
+ *
+ * Return value: the suffix of the file, or %NULL if the tier is not saved
+ **/
+static const gchar *
+up_history_tier_get_suffix (guint tier)
+{
+	if (tier == UP_HISTORY_TIER_RAW)
+		return "";
+	return up_history_rollups[tier - 1].suffix;
+}
+
+/**
+ * up_history_tier_get_max_age:
+ **/
+static guint
+up_history_tier_get_max_age (UpHistory *history, guint tier)
+{
+	if (tier == UP_HISTORY_TIER_RAW)
+		return history->priv->max_data_age;
+	return up_history_rollups[tier - 1].max_age;
+}
+
+/**
+ * up_history_tier_get_series:
+ **/
+static UpHistorySeries *
+up_history_tier_get_series (UpHistory *history, guint tier, UpHistoryType type)
+{
+	if (tier == UP_HISTORY_TIER_RAW)
+		return &history->priv->series[type];
+	return &history->priv->rollups[type][tier - 1].series;
+}
+
+/**
+ * up_history_type_from_string:
+ *
+ * Return value: the type with the name used on the bus and on disk, or
+ * %UP_HISTORY_TYPE_UNKNOWN
+ **/
+UpHistoryType
+up_history_type_from_string (const gchar *type)
+{
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		if (g_strcmp0 (type, up_history_series_names[i]) == 0)
+			return i;
+	}
+	return UP_HISTORY_TYPE_UNKNOWN;
+}
+
+/**
+ * up_history_get_tier_limits:
+ * @end: the time after the last one of interest
+ * @until: (out): for each tier, the time from which it leaves the samples
+ *   to the finer tiers
+ *
+ * Each tier only answers for the time before the finer ones start, so
+ * that walking them coarsest first covers every second once and in order.
+ **/
+static void
+up_history_get_tier_limits (UpHistory *history, UpHistoryType type, guint64 end, guint64 *until)
+{
+	guint64 oldest = end;
+	guint tier;
+
+	for (tier = 0; tier < UP_HISTORY_TIER_LAST; tier++) {
+		const UpHistorySeries *series = up_history_tier_get_series (history, tier, type);
+
+		until[tier] = oldest;
+		if (series->len > 0)
+			oldest = MIN (oldest, up_history_series_get (series, 0)->time);
+	}
+}
+
+/**
+ * up_history_aggregate_close:
+ * @counts: the number of samples in each state, which is reset
+ *
+ * Turns the running sum of @bucket into its mean and picks the state it
+ * spent the most samples in.
+ **/
+static void
+up_history_aggregate_close (UpHistoryAggregate *bucket, guint *counts)
+{
+	guint i;
+
+	if (bucket->count == 0)
+		return;
+	bucket->mean /= bucket->count;
+	for (i = 0; i < UP_DEVICE_STATE_LAST; i++) {
+		if (counts[i] > counts[bucket->state])
+			bucket->state = i;
+	}
+	memset (counts, 0, sizeof (guint) * UP_DEVICE_STATE_LAST);
+}
+
+/**
+ * up_history_get_aggregated_data:
+ * @start: the first second to return, as a UNIX time
+ * @end: the second after the last one to return
+ * @n_buckets: the number of equal buckets to split the range in
+ *
+ * Computes the count, minimum, maximum, mean and dominant state of the
+ * samples in each bucket in a single pass. Where the raw samples have
+ * been dropped the rollups fill in, using the finest one that covers
+ * the time, and each of their buckets then counts as one sample.
+ *
+ * Return value: an array of @n_buckets #UpHistoryAggregate, oldest first,
+ * or %NULL if there is no data
+ **/
+GArray *
+up_history_get_aggregated_data (UpHistory *history, UpHistoryType type,
+				guint32 start, guint32 end, guint n_buckets)
+{
+	UpHistoryAggregate *buckets;
+	UpHistoryAggregate *bucket = NULL;
+	guint counts[UP_DEVICE_STATE_LAST] = { 0 };
+	guint64 until[UP_HISTORY_TIER_LAST];
+	guint64 span;
+	GArray *array;
+	gint tier;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+	if (type >= UP_HISTORY_TYPE_UNKNOWN || n_buckets == 0 || start >= end)
+		return NULL;
+	history->priv->last_query = g_get_monotonic_time ();
+	span = end - start;
+
+	array = g_array_sized_new (FALSE, TRUE, sizeof (UpHistoryAggregate), n_buckets);
+	g_array_set_size (array, n_buckets);
+	buckets = (UpHistoryAggregate *) array->data;
+	for (i = 0; i < n_buckets; i++)
+		buckets[i].time = start + span * i / n_buckets;
+
+	up_history_get_tier_limits (history, type, end, until);
+
+	/* the tiers are walked coarsest first, so the samples arrive in order */
+	for (tier = UP_HISTORY_TIER_LAST - 1; tier >= 0; tier--) {
+		const UpHistorySeries *series = up_history_tier_get_series (history, tier, type);
+
+		for (i = start > 0 ? up_history_series_upper_bound (series, start - 1) : 0;
+		     i < series->len; i++) {
+			const UpHistorySample *sample = up_history_series_get (series, i);
+			UpHistoryAggregate *next;
+
+			if (sample->time >= until[tier])
+				break;
+			next = &buckets[(guint64) (sample->time - start) * n_buckets / span];
+			if (next != bucket) {
+				if (bucket != NULL)
+					up_history_aggregate_close (bucket, counts);
+				bucket = next;
+			}
+
+			if (bucket->count == 0 || sample->value < bucket->min)
+				bucket->min = sample->value;
+			if (bucket->count == 0 || sample->value > bucket->max)
+				bucket->max = sample->value;
+			bucket->mean += sample->value;
+			bucket->count++;
+			if (sample->state < UP_DEVICE_STATE_LAST)
+				counts[sample->state]++;
+		}
+	}
+	if (bucket == NULL) {
+		g_array_unref (array);
+		return NULL;
+	}
+	up_history_aggregate_close (bucket, counts);
+	return array;
+}
+
+/**
+ * up_history_get_sessions:
+ * @since: the time from which sessions are of interest, as a UNIX time
+ *
+ * Gets the runs of the same state in the charge history that ended at or
+ * after @since. The last one is still open and grows with new samples.
+ * Where only the rollups are left the times and charges are those of
+ * their buckets.
+ *
+ * Return value: an array of #UpHistorySession, oldest first, or %NULL if
+ * there is no history
+ **/
+GArray *
+up_history_get_sessions (UpHistory *history, guint32 since)
+{
+	GArray *sessions = history->priv->sessions;
+	GArray *array;
+	guint low = 0;
+	guint high;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+	history->priv->last_query = g_get_monotonic_time ();
+
+	/* the ends are in order too */
+	high = sessions->len;
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		if (g_array_index (sessions, UpHistorySession, mid).end < since)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	array = g_array_sized_new (FALSE, FALSE, sizeof (UpHistorySession), sessions->len - low);
+	g_array_append_vals (array, &g_array_index (sessions, UpHistorySession, low), sessions->len - low);
+	return array;
+}
+
+/**
+ * up_history_build_filename:
+ * @type_name: the metric, for the files written by older versions, or %NULL
+ **/
+static gchar *
+up_history_build_filename (const gchar *dir, const gchar *id, const gchar *type_name,
+			   const gchar *suffix, const gchar *extension)
+{
+	g_autofree gchar *filename = NULL;
+
+	if (type_name != NULL)
+		filename = g_strdup_printf ("history-%s-%s%s.%s", type_name, id, suffix, extension);
+	else
+		filename = g_strdup_printf ("history-%s%s.%s", id, suffix, extension);
+	return g_build_filename (dir, filename, NULL);
+}
+
+/**
+ * up_history_get_directory:
+ **/
+const gchar *
+up_history_get_directory (UpHistory *history)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+	return history->priv->dir;
+}
+
+/**
+ * up_history_set_directory:
+ **/
+void
+up_history_set_directory (UpHistory *history, const gchar *dir)
+{
+	g_free (history->priv->dir);
+	history->priv->dir = g_strdup (dir);
+	g_mkdir_with_parents (dir, 0755);
+}
+
+/**
+ * up_history_buf_append_u32:
+ **/
+static inline void
+up_history_buf_append_u32 (GByteArray *buf, guint32 value)
+{
+	value = GUINT32_TO_LE (value);
+	g_byte_array_append (buf, (const guint8 *) &value, 4);
+}
+
+/**
+ * up_history_buf_append_double:
+ **/
+static inline void
+up_history_buf_append_double (GByteArray *buf, gdouble value)
+{
+	union {
+		gdouble d;
+		guint64 u;
+	} tmp;
+
+	tmp.d = value;
+	tmp.u = GUINT64_TO_LE (tmp.u);
+	g_byte_array_append (buf, (const guint8 *) &tmp.u, 8);
+}
+
+/**
+ * up_history_read_u32:
+ **/
+static inline guint32
+up_history_read_u32 (const gchar *data)
+{
+	guint32 value;
+
+	memcpy (&value, data, 4);
+	return GUINT32_FROM_LE (value);
+}
+
+/**
+ * up_history_read_double:
+ **/
+static inline gdouble
+up_history_read_double (const gchar *data)
+{
+	union {
+		gdouble d;
+		guint64 u;
+	} tmp;
+
+	memcpy (&tmp.u, data, 8);
+	tmp.u = GUINT64_FROM_LE (tmp.u);
+	return tmp.d;
+}
+
+/**
+ * up_history_buf_append_varint:
+ **/
+static inline void
+up_history_buf_append_varint (GByteArray *buf, guint64 value)
+{
+	guint8 tmp[10];
+	guint len = 0;
+
+	do {
+		tmp[len] = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+			tmp[len] |= 0x80;
+		len++;
+	} while (value != 0);
+	g_byte_array_append (buf, tmp, len);
+}
+
+/**
+ * up_history_zigzag:
+ **/
+static inline guint64
+up_history_zigzag (gint64 value)
+{
+	return ((guint64) value << 1) ^ (guint64) (value >> 63);
+}
+
+/**
+ * up_history_unzigzag:
+ **/
+static inline gint64
+up_history_unzigzag (guint64 value)
+{
+	return (gint64) (value >> 1) ^ -(gint64) (value & 1);
+}
+
+/**
+ * up_history_crc32:
+ * @crc: the CRC of the data before, or 0
+ *
+ * Continues the CRC-32 used by zlib and PNG over @data.
+ **/
+static guint32
+up_history_crc32 (guint32 crc, const guint8 *data, gsize len)
+{
+	static guint32 table[256];
+	static gsize table_init = 0;
+	gsize i;
+
+	/* the loading threads may get here first */
+	if (g_once_init_enter (&table_init)) {
+		for (i = 0; i < 256; i++) {
+			guint32 c = i;
+			guint k;
+
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		g_once_init_leave (&table_init, 1);
+	}
+
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+typedef struct {
+	const guint8		*data;
+	const guint8		*end;
+	gboolean		 error;
+} UpHistoryReader;
+
+/**
+ * up_history_reader_varint:
+ **/
+static guint64
+up_history_reader_varint (UpHistoryReader *reader)
+{
+	guint64 value = 0;
+	guint shift;
+
+	for (shift = 0; shift < 64 && reader->data < reader->end; shift += 7) {
+		guint8 byte = *reader->data++;
+
+		value |= (guint64) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+	reader->error = TRUE;
+	return 0;
+}
+
+/**
+ * up_history_file_append_header:
+ **/
+static void
+up_history_file_append_header (GByteArray *buf, gsize base)
+{
+	g_byte_array_append (buf, (const guint8 *) UP_HISTORY_FILE_MAGIC, 4);
+	up_history_buf_append_u32 (buf, UP_HISTORY_FILE_VERSION);
+	up_history_buf_append_u32 (buf, UP_HISTORY_TYPE_UNKNOWN);
+	up_history_buf_append_u32 (buf, base);
+}
+
+/**
+ * up_history_file_append_block:
+ * @series: the series of each metric
+ * @first: the first sample of each series to write
+ *
+ * Merges the samples of all the metrics into rows and appends them as
+ * a single block.
+ **/
+static void
+up_history_file_append_block (GByteArray *buf, UpHistorySeries **series, const guint *first)
+{
+	g_autoptr(GByteArray) columns = g_byte_array_new ();
+	g_autoptr(GByteArray) states = g_byte_array_new ();
+	GByteArray *values[UP_HISTORY_TYPE_UNKNOWN];
+	gint64 last_value[UP_HISTORY_TYPE_UNKNOWN] = { 0 };
+	guint missing[UP_HISTORY_TYPE_UNKNOWN] = { 0 };
+	guint pos[UP_HISTORY_TYPE_UNKNOWN];
+	gint64 last_time = 0;
+	gint64 last_interval = 0;
+	guint32 run_state = 0;
+	guint32 crc;
+	guint run = 0;
+	guint n_rows = 0;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		values[i] = g_byte_array_new ();
+
+	memcpy (pos, first, sizeof (pos));
+	for (;;) {
+		const UpHistorySample *sample;
+		guint32 time_s = 0;
+		guint32 state = 0;
+		gboolean found = FALSE;
+
+		/* the oldest sample left decides the time and state of the row */
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			if (pos[i] >= series[i]->len)
+				continue;
+			sample = up_history_series_get (series[i], pos[i]);
+			if (!found || sample->time < time_s) {
+				time_s = sample->time;
+				state = sample->state;
+				found = TRUE;
+			}
+		}
+		if (!found)
+			break;
+		n_rows++;
+
+		up_history_buf_append_varint (columns, up_history_zigzag ((time_s - last_time) - last_interval));
+		last_interval = time_s - last_time;
+		last_time = time_s;
+
+		if (run > 0 && state != run_state) {
+			up_history_buf_append_varint (states, run_state);
+			up_history_buf_append_varint (states, run);
+			run = 0;
+		}
+		run_state = state;
+		run++;
+
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+			gint64 value;
+
+			if (pos[i] >= series[i]->len)
+				goto missing;
+			sample = up_history_series_get (series[i], pos[i]);
+			if (sample->time != time_s || sample->state != state)
+				goto missing;
+			pos[i]++;
+
+			if (missing[i] > 0) {
+				up_history_buf_append_varint (values[i], 0);
+				up_history_buf_append_varint (values[i], missing[i]);
+				missing[i] = 0;
+			}
+			value = llround (sample->value * up_history_series_scales[i]);
+			up_history_buf_append_varint (values[i], up_history_zigzag (value - last_value[i]) + 1);
+			last_value[i] = value;
+			continue;
+missing:
+			missing[i]++;
+		}
+	}
+	if (run > 0) {
+		up_history_buf_append_varint (states, run_state);
+		up_history_buf_append_varint (states, run);
+	}
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		if (missing[i] > 0) {
+			up_history_buf_append_varint (values[i], 0);
+			up_history_buf_append_varint (values[i], missing[i]);
+		}
+	}
+
+	g_byte_array_append (columns, states->data, states->len);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_byte_array_append (columns, values[i]->data, values[i]->len);
+		g_byte_array_unref (values[i]);
+	}
+	up_history_buf_append_u32 (buf, n_rows);
+	up_history_buf_append_u32 (buf, columns->len);
+	crc = up_history_crc32 (0, buf->data + buf->len - 8, 8);
+	up_history_buf_append_u32 (buf, up_history_crc32 (crc, columns->data, columns->len));
+	g_byte_array_append (buf, columns->data, columns->len);
+}
+
+/**
+ * up_history_file_write_all:
+ **/
+static gboolean
+up_history_file_write_all (gint fd, const guint8 *data, gsize len)
+{
+	while (len > 0) {
+		gssize wrote = write (fd, data, len);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		data += wrote;
+		len -= wrote;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_file_sync:
+ *
+ * Makes sure what was written to @fd is on disk, without flushing
+ * anything else on the file system.
+ **/
+static void
+up_history_file_sync (gint fd, const gchar *filename)
+{
+#ifdef HAVE_FDATASYNC
+	if (fdatasync (fd) < 0)
+#else
+	if (fsync (fd) < 0)
+#endif
+		g_warning ("failed to sync %s: %s", filename, g_strerror (errno));
+}
+
+/**
+ * up_history_file_sync_dir:
+ *
+ * Makes sure a file that was renamed into place is still there after a
+ * crash.
+ **/
+static void
+up_history_file_sync_dir (const gchar *filename)
+{
+	g_autofree gchar *dir = g_path_get_dirname (filename);
+	gint fd;
+
+	fd = g_open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		g_warning ("failed to open %s: %s", dir, g_strerror (errno));
+		return;
+	}
+	if (fsync (fd) < 0)
+		g_warning ("failed to sync %s: %s", dir, g_strerror (errno));
+	close (fd);
+}
+
+/**
+ * up_history_file_rewrite:
+ * @first: the first sample of each series that is recent enough to keep
+ *
+ * Replaces the file with the samples we still want, used for compaction
+ * and for the first save after migrating from older formats.
+ **/
+static gboolean
+up_history_file_rewrite (UpHistoryFile *file, UpHistorySeries **series,
+			 const guint *first, const gchar *filename)
+{
+	g_autoptr(GError) error = NULL;
+	GByteArray *buf;
+	gboolean ret;
+	guint culled = 0;
+	guint total = 0;
+	guint i;
+
+	buf = g_byte_array_new ();
+	up_history_file_append_header (buf, 0);
+	up_history_file_append_block (buf, series, first);
+
+	/* how many did we kill? */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		culled += first[i];
+		total += series[i]->len;
+	}
+	g_debug ("culled %u of %u", culled, total);
+
+	ret = g_file_set_contents_full (filename, (const gchar *) buf->data, buf->len,
+					G_FILE_SET_CONTENTS_CONSISTENT | G_FILE_SET_CONTENTS_DURABLE,
+					0644, &error);
+	if (!ret) {
+		g_warning ("failed to set data: %s", error->message);
+		g_byte_array_unref (buf);
+		return FALSE;
+	}
+	up_history_file_sync_dir (filename);
+	g_debug ("saved %s", filename);
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		series[i]->n_saved = series[i]->len;
+		series[i]->n_file = series[i]->len - first[i];
+		series[i]->needs_rewrite = FALSE;
+	}
+	file->size = buf->len;
+	file->needs_rewrite = FALSE;
+	file->needs_truncate = FALSE;
+	g_byte_array_unref (buf);
+	return TRUE;
+}
+
+/**
+ * up_history_file_check:
+ * @first: (out): the first sample of each series that is recent enough to keep
+ *
+ * Return value: %TRUE if the file has to be rewritten rather than appended to
+ **/
+static gboolean
+up_history_file_check (UpHistoryFile *file, UpHistorySeries **series, guint max_age, guint *first)
+{
+	gint64 time_now;
+	guint n_file = 0;
+	guint n_new = 0;
+	guint dead = 0;
+	guint live;
+	guint i;
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		/* the data is ordered, so the old entries are at the start */
+		first[i] = 0;
+		while (first[i] < series[i]->len) {
+			if (time_now - up_history_series_get (series[i], first[i])->time <= max_age)
+				break;
+			first[i]++;
+		}
+
+		/* saved samples that have expired or been dropped, which we
+		 * can't tell once they were downsampled */
+		live = series[i]->n_saved > first[i] ? series[i]->n_saved - first[i] : 0;
+		if (series[i]->n_file > live && !series[i]->thinned)
+			dead += series[i]->n_file - live;
+		n_file += series[i]->n_file;
+		n_new += series[i]->len - series[i]->n_saved;
+		if (series[i]->needs_rewrite)
+			file->needs_rewrite = TRUE;
+	}
+
+	/* compact once a quarter of the file has expired or been dropped */
+	if (dead > 0 && dead * 4 >= n_file + n_new)
+		file->needs_rewrite = TRUE;
+	return file->needs_rewrite;
+}
+
+/**
+ * up_history_file_open_append:
+ *
+ * Opens the file to append blocks to, after cutting off what an interrupted
+ * append left behind.
+ *
+ * Return value: the file descriptor, or -1 if the file has to be rewritten
+ **/
+static gint
+up_history_file_open_append (UpHistoryFile *file, const gchar *filename)
+{
+	struct stat st;
+	gint fd;
+
+	fd = g_open (filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		g_warning ("failed to open %s: %s", filename, g_strerror (errno));
+		return -1;
+	}
+	if (fstat (fd, &st) < 0) {
+		close (fd);
+		file->needs_rewrite = TRUE;
+		return -1;
+	}
+
+	if (file->needs_truncate && (gsize) st.st_size > file->size) {
+		g_debug ("dropping %" G_GSIZE_FORMAT " bytes of a partial block from %s",
+			 (gsize) st.st_size - file->size, filename);
+		if (ftruncate (fd, file->size) == 0)
+			st.st_size = file->size;
+	}
+	file->needs_truncate = FALSE;
+	if ((gsize) st.st_size != file->size) {
+		/* somebody else touched the file, start again */
+		close (fd);
+		file->needs_rewrite = TRUE;
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * up_history_file_append:
+ * @series: the series of each metric
+ * @base: the base to write in the header if the file is new
+ * @durable: whether to sync the file, which the staging files are not
+ *
+ * Appends the samples added to any metric since the last save to the file
+ **/
+static gboolean
+up_history_file_append (UpHistoryFile *file, UpHistorySeries **series,
+			const gchar *filename, gsize base, gboolean durable)
+{
+	GByteArray *buf;
+	guint first[UP_HISTORY_TYPE_UNKNOWN];
+	guint n_new = 0;
+	guint i;
+	gint fd;
+	gboolean ret;
+
+	/* nothing new */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		first[i] = series[i]->n_saved;
+		n_new += series[i]->len - series[i]->n_saved;
+	}
+	if (n_new == 0)
+		return TRUE;
+
+	fd = up_history_file_open_append (file, filename);
+	if (fd < 0)
+		return FALSE;
+
+	buf = g_byte_array_new ();
+	if (file->size == 0)
+		up_history_file_append_header (buf, base);
+	up_history_file_append_block (buf, series, first);
+	ret = up_history_file_write_all (fd, buf->data, buf->len);
+	if (!ret)
+		g_warning ("failed to append to %s: %s", filename, g_strerror (errno));
+	else if (durable)
+		up_history_file_sync (fd, filename);
+	close (fd);
+	if (!ret) {
+		/* whatever made it to disk fails its checksum */
+		file->needs_truncate = TRUE;
+		g_byte_array_unref (buf);
+		return FALSE;
+	}
+	g_debug ("saved %s", filename);
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		series[i]->n_file += series[i]->len - series[i]->n_saved;
+		series[i]->n_saved = series[i]->len;
+	}
+	file->size += buf->len;
+	g_byte_array_unref (buf);
+	return TRUE;
+}
+
+/**
+ * up_history_file_save:
+ * @series: the series of each metric
+ * @max_age: the age after which samples are not kept
+ *
+ * Appends the samples added to any metric since the last save to the file,
+ * or rewrites it if that is due.
+ **/
+static gboolean
+up_history_file_save (UpHistoryFile *file, UpHistorySeries **series,
+		      const gchar *filename, guint max_age)
+{
+	guint first[UP_HISTORY_TYPE_UNKNOWN];
+
+	if (!up_history_file_check (file, series, max_age, first) &&
+	    up_history_file_append (file, series, filename, 0, TRUE))
+		return TRUE;
+	if (!file->needs_rewrite)
+		return FALSE;
+	return up_history_file_rewrite (file, series, first, filename);
+}
+
+/**
+ * up_history_file_stage:
+ * @staged: the staging file
+ * @file: the persistent file it follows
+ *
+ * Appends the samples added since the last save to the staging file.
+ **/
+static gboolean
+up_history_file_stage (UpHistoryFile *staged, UpHistoryFile *file,
+		       UpHistorySeries **series, const gchar *staged_filename)
+{
+	if (up_history_file_append (staged, series, staged_filename, file->size, FALSE))
+		return TRUE;
+
+	/* start staging again, with everything going to the persistent file */
+	if (staged->needs_rewrite) {
+		staged->needs_rewrite = FALSE;
+		staged->needs_truncate = TRUE;
+		staged->size = 0;
+		file->needs_rewrite = TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * up_history_file_persist:
+ * @staged: the staging file
+ * @file: the persistent file it follows
+ *
+ * Copies the staged blocks over to the persistent file, or rewrites it if
+ * that is due, and empties the staging file.
+ **/
+static gboolean
+up_history_file_persist (UpHistoryFile *staged, UpHistoryFile *file, UpHistorySeries **series,
+			 const gchar *staged_filename, const gchar *filename, guint max_age)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *data = NULL;
+	g_autoptr(GByteArray) buf = NULL;
+	guint first[UP_HISTORY_TYPE_UNKNOWN];
+	gsize length;
+	gboolean ret;
+	gint fd;
+
+	if (up_history_file_check (file, series, max_age, first))
+		goto rewrite;
+
+	/* nothing staged */
+	if (staged->size <= UP_HISTORY_FILE_HEADER_SIZE)
+		return TRUE;
+
+	if (!g_file_get_contents (staged_filename, &data, &length, &error) ||
+	    length < staged->size) {
+		g_warning ("failed to read %s: %s", staged_filename,
+			   error != NULL ? error->message : "file is too short");
+		goto rewrite;
+	}
+
+	fd = up_history_file_open_append (file, filename);
+	if (fd < 0) {
+		if (file->needs_rewrite)
+			goto rewrite;
+		return FALSE;
+	}
+	buf = g_byte_array_new ();
+	if (file->size == 0)
+		up_history_file_append_header (buf, 0);
+	g_byte_array_append (buf, (const guint8 *) data + UP_HISTORY_FILE_HEADER_SIZE,
+			     staged->size - UP_HISTORY_FILE_HEADER_SIZE);
+	ret = up_history_file_write_all (fd, buf->data, buf->len);
+	if (!ret)
+		g_warning ("failed to append to %s: %s", filename, g_strerror (errno));
+	else
+		up_history_file_sync (fd, filename);
+	close (fd);
+	if (!ret) {
+		file->needs_truncate = TRUE;
+		return FALSE;
+	}
+	g_debug ("persisted %s", filename);
+	file->size += buf->len;
+	goto out;
+
+rewrite:
+	if (!up_history_file_rewrite (file, series, first, filename))
+		return FALSE;
+out:
+	g_unlink (staged_filename);
+	staged->size = 0;
+	staged->needs_truncate = FALSE;
+	return TRUE;
+}
+
+/**
+ * up_history_load_block_plain:
+ *
+ * Loads a block of a version 2 file, returning the number of samples or
+ * -1 if the block is incomplete
+ **/
+static gint
+up_history_load_block_plain (UpHistoryLoadFile *file, const gchar *data, gsize length, guint n_columns)
+{
+	const gchar *times, *states, *values;
+	guint32 n_rows;
+	guint64 block_size;
+	gint n_samples = 0;
+	guint32 j;
+	guint i;
+
+	n_rows = up_history_read_u32 (data);
+	block_size = (guint64) n_rows * (4 + 4 + 8 * n_columns);
+	if (length - UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD < block_size)
+		return -1;
+
+	times = data + UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD;
+	states = times + 4 * n_rows;
+	values = states + 4 * n_rows;
+	for (j = 0; j < n_rows; j++) {
+		UpHistorySample sample;
+
+		sample.time = up_history_read_u32 (times + 4 * j);
+		sample.state = up_history_read_u32 (states + 4 * j);
+		for (i = 0; i < MIN (n_columns, UP_HISTORY_TYPE_UNKNOWN); i++) {
+			sample.value = up_history_read_double (values + 8 * ((gsize) i * n_rows + j));
+			if (isnan (sample.value))
+				continue;
+			g_array_append_val (file->samples[i], sample);
+			n_samples++;
+		}
+	}
+	file->size += UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD + block_size;
+	return n_samples;
+}
+
+/**
+ * up_history_load_block:
+ * @header_size: the size of the block header of the version of the file
+ *
+ * Decodes a block straight into the samples, returning the number of
+ * samples or -1 if the block is incomplete or corrupt
+ **/
+static gint
+up_history_load_block (UpHistoryLoadFile *file, const gchar *data, gsize length,
+		       guint n_columns, gsize header_size)
+{
+	UpHistoryReader reader;
+	g_autofree guint32 *times = NULL;
+	g_autofree guint32 *states = NULL;
+	guint old_len[UP_HISTORY_TYPE_UNKNOWN];
+	guint32 n_rows;
+	guint32 size;
+	gint64 time_s = 0;
+	gint64 interval = 0;
+	gint n_samples = 0;
+	guint32 j;
+	guint i;
+
+	n_rows = up_history_read_u32 (data);
+	size = up_history_read_u32 (data + 4);
+	if (length - header_size < size)
+		return -1;
+
+	/* every row takes at least a byte in the time column */
+	if (n_rows > size)
+		return -1;
+
+	reader.data = (const guint8 *) data + header_size;
+	reader.end = reader.data + size;
+	reader.error = FALSE;
+
+	times = g_new (guint32, n_rows);
+	for (j = 0; j < n_rows; j++) {
+		interval += up_history_unzigzag (up_history_reader_varint (&reader));
+		time_s += interval;
+		times[j] = time_s;
+	}
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		old_len[i] = file->samples[i]->len;
+
+	states = g_new (guint32, n_rows);
+	for (j = 0; j < n_rows && !reader.error;) {
+		guint32 state = up_history_reader_varint (&reader);
+		guint64 run = up_history_reader_varint (&reader);
+
+		if (run == 0 || run > n_rows - j)
+			return -1;
+		while (run-- > 0)
+			states[j++] = state;
+	}
+
+	for (i = 0; i < n_columns && !reader.error; i++) {
+		gint64 value = 0;
+
+		for (j = 0; j < n_rows && !reader.error; j++) {
+			UpHistorySample sample;
+			guint64 code = up_history_reader_varint (&reader);
+
+			/* rows without a sample */
+			if (code == 0) {
+				guint64 skip = up_history_reader_varint (&reader);
+				if (skip == 0 || skip > n_rows - j) {
+					reader.error = TRUE;
+					break;
+				}
+				j += skip - 1;
+				continue;
+			}
+			value += up_history_unzigzag (code - 1);
+
+			/* metrics added by newer versions are ignored */
+			if (i >= UP_HISTORY_TYPE_UNKNOWN)
+				continue;
+			sample.time = times[j];
+			sample.state = states[j];
+			sample.value = value / up_history_series_scales[i];
+			g_array_append_val (file->samples[i], sample);
+			n_samples++;
+		}
+	}
+	if (reader.error || reader.data != reader.end) {
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+			g_array_set_size (file->samples[i], old_len[i]);
+		return -1;
+	}
+
+	file->size += header_size + size;
+	return n_samples;
+}
+
+/**
+ * up_history_load_file_old:
+ *
+ * Loads the blocks of a file of version 2 or 3, which have no checksum.
+ **/
+static gboolean
+up_history_load_file_old (UpHistoryLoadFile *file, const gchar *filename,
+			  const gchar *data, gsize length, guint32 version, guint n_columns)
+{
+	guint n_samples = 0;
+
+	file->needs_rewrite = TRUE;
+	file->size = UP_HISTORY_FILE_HEADER_SIZE;
+	while (file->size < length) {
+		gint ret;
+
+		/* a partial block at the end means a save was interrupted */
+		if (length - file->size < UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD)
+			break;
+		if (version == UP_HISTORY_FILE_VERSION_PLAIN)
+			ret = up_history_load_block_plain (file, data + file->size, length - file->size, n_columns);
+		else
+			ret = up_history_load_block (file, data + file->size, length - file->size, n_columns,
+						     UP_HISTORY_FILE_BLOCK_HEADER_SIZE_OLD);
+		if (ret < 0)
+			break;
+		n_samples += ret;
+	}
+	if (file->size < length)
+		g_debug ("dropping partial block at the end of %s", filename);
+	g_debug ("loaded %u items of data from %s", n_samples, filename);
+	return TRUE;
+}
+
+/**
+ * up_history_load_file:
+ *
+ * Loads the history file of a tier, returning %FALSE if there was none.
+ * This is called from the loading thread.
+ **/
+static gboolean
+up_history_load_file (UpHistoryLoadFile *file, const gchar *filename)
+{
+	g_autofree gchar *data = NULL;
+	g_autoptr(GError) error = NULL;
+	gsize length;
+	guint32 version;
+	guint n_columns;
+	guint n_samples = 0;
+
+	if (!g_file_get_contents (filename, &data, &length, &error)) {
+		if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_warning ("failed to get data: %s", error->message);
+		return FALSE;
+	}
+
+	/* check the header */
+	if (length < UP_HISTORY_FILE_HEADER_SIZE ||
+	    memcmp (data, UP_HISTORY_FILE_MAGIC, 4) != 0) {
+		g_warning ("%s is not a history file, ignoring", filename);
+		file->needs_rewrite = TRUE;
+		return FALSE;
+	}
+	version = up_history_read_u32 (data + 4);
+	if (version != UP_HISTORY_FILE_VERSION &&
+	    version != UP_HISTORY_FILE_VERSION_VARINT &&
+	    version != UP_HISTORY_FILE_VERSION_PLAIN) {
+		g_warning ("%s has unsupported version %u, ignoring", filename, version);
+		file->needs_rewrite = TRUE;
+		return FALSE;
+	}
+	n_columns = up_history_read_u32 (data + 8);
+	file->base = up_history_read_u32 (data + 12);
+
+	/* older versions are converted on the next save */
+	if (version != UP_HISTORY_FILE_VERSION)
+		return up_history_load_file_old (file, filename, data, length, version, n_columns);
+
+	file->size = UP_HISTORY_FILE_HEADER_SIZE;
+	while (file->size < length) {
+		const gchar *block = data + file->size;
+		gsize left = length - file->size;
+		guint32 size;
+		guint32 crc;
+		gint ret;
+
+		/* a partial block at the end means a save was interrupted */
+		if (left < UP_HISTORY_FILE_BLOCK_HEADER_SIZE)
+			break;
+		size = up_history_read_u32 (block + 4);
+		if (left - UP_HISTORY_FILE_BLOCK_HEADER_SIZE < size)
+			break;
+		crc = up_history_crc32 (0, (const guint8 *) block, 8);
+		crc = up_history_crc32 (crc, (const guint8 *) block + UP_HISTORY_FILE_BLOCK_HEADER_SIZE, size);
+		if (crc != up_history_read_u32 (block + 8))
+			break;
+
+		/* the checksum matched, so this is not an interrupted save */
+		ret = up_history_load_block (file, block, left, n_columns,
+					     UP_HISTORY_FILE_BLOCK_HEADER_SIZE);
+		if (ret < 0) {
+			g_warning ("failed to decode block at %" G_GSIZE_FORMAT " of %s",
+				   file->size, filename);
+			file->needs_rewrite = TRUE;
+			break;
+		}
+		n_samples += ret;
+	}
+	if (file->size < length && !file->needs_rewrite) {
+		g_debug ("ignoring %" G_GSIZE_FORMAT " bytes of a partial block at the end of %s",
+			 length - file->size, filename);
+		file->needs_truncate = TRUE;
+	}
+	g_debug ("loaded %u items of data from %s", n_samples, filename);
+	return TRUE;
+}
+
+/**
+ * up_history_profile_to_file:
+ **/
+static gboolean
+up_history_profile_to_file (UpHistoryProfile *profile, const gchar *filename)
+{
+	g_autoptr(GError) error = NULL;
+	GByteArray *buf;
+	gboolean ret;
+	guint i, j;
+
+	buf = g_byte_array_sized_new (UP_HISTORY_FILE_HEADER_SIZE +
+				      2 * UP_HISTORY_PROFILE_BINS * UP_HISTORY_PROFILE_BIN_SIZE);
+	g_byte_array_append (buf, (const guint8 *) UP_HISTORY_PROFILE_MAGIC, 4);
+	up_history_buf_append_u32 (buf, UP_HISTORY_PROFILE_VERSION);
+	up_history_buf_append_u32 (buf, UP_HISTORY_PROFILE_BINS);
+	up_history_buf_append_u32 (buf, 0);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < UP_HISTORY_PROFILE_BINS; j++) {
+			up_history_buf_append_double (buf, profile->bins[i][j].time_sum);
+			up_history_buf_append_u32 (buf, profile->bins[i][j].count);
+			up_history_buf_append_u32 (buf, 0);
+		}
+	}
+
+	ret = g_file_set_contents_full (filename, (const gchar *) buf->data, buf->len,
+					G_FILE_SET_CONTENTS_CONSISTENT | G_FILE_SET_CONTENTS_DURABLE,
+					0644, &error);
+	g_byte_array_unref (buf);
+	if (!ret) {
+		g_warning ("failed to set data: %s", error->message);
+		return FALSE;
+	}
+	up_history_file_sync_dir (filename);
+	g_debug ("saved %s", filename);
+
+	profile->dirty = FALSE;
+	return TRUE;
+}
+
+/**
+ * up_history_load_profile_file:
+ *
+ * Loads the profile bins, returning %FALSE if there were none.
+ * This is called from the loading thread.
+ **/
+static gboolean
+up_history_load_profile_file (UpHistoryProfileBin bins[2][UP_HISTORY_PROFILE_BINS], const gchar *filename)
+{
+	g_autofree gchar *data = NULL;
+	gsize length;
+	const gchar *p;
+	guint i, j;
+
+	if (!g_file_get_contents (filename, &data, &length, NULL))
+		return FALSE;
+	if (length != UP_HISTORY_FILE_HEADER_SIZE + 2 * UP_HISTORY_PROFILE_BINS * UP_HISTORY_PROFILE_BIN_SIZE ||
+	    memcmp (data, UP_HISTORY_PROFILE_MAGIC, 4) != 0 ||
+	    up_history_read_u32 (data + 4) != UP_HISTORY_PROFILE_VERSION ||
+	    up_history_read_u32 (data + 8) != UP_HISTORY_PROFILE_BINS) {
+		g_warning ("%s is not a valid profile, rebuilding it", filename);
+		return FALSE;
+	}
+
+	p = data + UP_HISTORY_FILE_HEADER_SIZE;
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < UP_HISTORY_PROFILE_BINS; j++) {
+			bins[i][j].time_sum = up_history_read_double (p);
+			bins[i][j].count = up_history_read_u32 (p + 8);
+			p += UP_HISTORY_PROFILE_BIN_SIZE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_load_series_file:
+ *
+ * Loads the samples from a binary file of a single metric written by
+ * older versions. This is called from the loading thread.
+ **/
+static gboolean
+up_history_load_series_file (GArray *samples, const gchar *filename)
+{
+	g_autofree gchar *data = NULL;
+	gsize length;
+	gsize i;
+
+	if (!g_file_get_contents (filename, &data, &length, NULL))
+		return FALSE;
+	if (length < UP_HISTORY_FILE_HEADER_SIZE ||
+	    memcmp (data, UP_HISTORY_FILE_MAGIC, 4) != 0 ||
+	    up_history_read_u32 (data + 4) != UP_HISTORY_FILE_VERSION_SERIES ||
+	    up_history_read_u32 (data + 8) != UP_HISTORY_FILE_RECORD_SIZE)
+		return FALSE;
+
+	for (i = UP_HISTORY_FILE_HEADER_SIZE;
+	     i + UP_HISTORY_FILE_RECORD_SIZE <= length;
+	     i += UP_HISTORY_FILE_RECORD_SIZE) {
+		UpHistorySample sample;
+
+		sample.time = up_history_read_u32 (data + i);
+		sample.state = up_history_read_u32 (data + i + 4);
+		sample.value = up_history_read_double (data + i + 8);
+		g_array_append_val (samples, sample);
+	}
+	g_debug ("loaded %u items of data from %s", samples->len, filename);
+	return TRUE;
+}
+
+/**
+ * up_history_parse_legacy_uint:
+ *
+ * Parses an unsigned decimal field of a legacy line, without copying it.
+ **/
+static gboolean
+up_history_parse_legacy_uint (const gchar *p, const gchar *end, guint *value)
+{
+	guint64 tmp = 0;
+
+	if (p == end)
+		return FALSE;
+	for (; p < end; p++) {
+		if (!g_ascii_isdigit (*p))
+			return FALSE;
+		tmp = tmp * 10 + (*p - '0');
+		if (tmp > G_MAXUINT)
+			return FALSE;
+	}
+	*value = tmp;
+	return TRUE;
+}
+
+/**
+ * up_history_parse_legacy_double:
+ *
+ * Parses a fixed point field of a legacy line, as written by "%.3f".
+ **/
+static gboolean
+up_history_parse_legacy_double (const gchar *p, const gchar *end, gdouble *value)
+{
+	gdouble tmp = 0.f;
+	gdouble scale = 1.f;
+	gboolean negative = FALSE;
+	gboolean fraction = FALSE;
+	gboolean digits = FALSE;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	for (; p < end; p++) {
+		if (*p == '.' && !fraction) {
+			fraction = TRUE;
+			continue;
+		}
+		if (!g_ascii_isdigit (*p))
+			return FALSE;
+		digits = TRUE;
+		if (fraction) {
+			scale /= 10.f;
+			tmp += (*p - '0') * scale;
+		} else {
+			tmp = tmp * 10.f + (*p - '0');
+		}
+	}
+	if (!digits)
+		return FALSE;
+	*value = negative ? -tmp : tmp;
+	return TRUE;
+}
+
+/**
+ * up_history_parse_legacy_state:
+ *
+ * Matches the state field of a legacy line, where unknown names map to
+ * %UP_DEVICE_STATE_UNKNOWN as they always did.
+ **/
+static UpDeviceState
+up_history_parse_legacy_state (const gchar *p, const gchar *end)
+{
+	gsize len = end - p;
+	guint i;
+
+	for (i = UP_DEVICE_STATE_UNKNOWN + 1; i < UP_DEVICE_STATE_LAST; i++) {
+		const gchar *name = up_device_state_to_string (i);
+		if (strlen (name) == len && memcmp (name, p, len) == 0)
+			return i;
+	}
+	return UP_DEVICE_STATE_UNKNOWN;
+}
+
+/**
+ * up_history_parse_legacy_line:
+ *
+ * Parses one tab separated time, value and state line in place.
+ **/
+static gboolean
+up_history_parse_legacy_line (const gchar *line, const gchar *end, UpHistorySample *sample)
+{
+	const gchar *tab1;
+	const gchar *tab2;
+
+	/* tolerate files that went through a DOS editor */
+	if (end > line && end[-1] == '\r')
+		end--;
+
+	tab1 = memchr (line, '\t', end - line);
+	if (tab1 == NULL)
+		return FALSE;
+	tab2 = memchr (tab1 + 1, '\t', end - tab1 - 1);
+	if (tab2 == NULL || memchr (tab2 + 1, '\t', end - tab2 - 1) != NULL)
+		return FALSE;
+
+	if (!up_history_parse_legacy_uint (line, tab1, &sample->time))
+		return FALSE;
+	if (!up_history_parse_legacy_double (tab1 + 1, tab2, &sample->value))
+		return FALSE;
+	sample->state = up_history_parse_legacy_state (tab2 + 1, end);
+	return TRUE;
+}
+
+/**
+ * up_history_load_legacy_file:
+ *
+ * Loads the samples from a text file written by older versions.
+ * The file is mapped and parsed in a single pass straight into @samples,
+ * so even months of history do not need a second copy in memory.
+ * This is called from the loading thread.
+ **/
+static gboolean
+up_history_load_legacy_file (GArray *samples, const gchar *filename)
+{
+	g_autoptr(GMappedFile) mapped = NULL;
+	g_autoptr(GError) error = NULL;
+	UpHistorySample sample;
+	const gchar *data;
+	const gchar *end;
+	const gchar *line;
+	guint n_loaded = 0;
+	guint n_malformed = 0;
+	gsize size;
+
+	/* do we exist */
+	if (!g_file_test (filename, G_FILE_TEST_EXISTS)) {
+		g_debug ("failed to get data from %s as file does not exist", filename);
+		return FALSE;
+	}
+
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to get data: %s", error->message);
+		return FALSE;
+	}
+	data = g_mapped_file_get_contents (mapped);
+	size = g_mapped_file_get_length (mapped);
+	if (data == NULL || size == 0) {
+		g_debug ("no data in %s", filename);
+		return TRUE;
+	}
+
+	end = data + size;
+	for (line = data; line < end; ) {
+		const gchar *eol = memchr (line, '\n', end - line);
+
+		/* a line without an ending was cut short when written */
+		if (eol == NULL) {
+			n_malformed++;
+			break;
+		}
+		if (eol > line) {
+			if (up_history_parse_legacy_line (line, eol, &sample)) {
+				g_array_append_val (samples, sample);
+				n_loaded++;
+			} else {
+				n_malformed++;
+			}
+		}
+		line = eol + 1;
+	}
+
+	if (n_malformed > 0)
+		g_debug ("skipped %u malformed lines in %s", n_malformed, filename);
+	g_debug ("loaded %u items of data from %s", n_loaded, filename);
+	return TRUE;
+}
+
+/*
+ * The export format handed out by up_history_export_fd() is simpler than
+ * the one on disk, as it is a public interface. All integers are little
+ * endian:
+ *
+ *   header:  "UPHX", u32 version, u32 number of samples, u32 flags
+ *   sample:  u32 time, u32 state, f64 value
+ *
+ * The samples are oldest first, and combine the raw samples with the
+ * rollups for the time before them.
+ */
+#define UP_HISTORY_EXPORT_MAGIC		"UPHX"
+#define UP_HISTORY_EXPORT_VERSION	1
+#define UP_HISTORY_EXPORT_CHUNK		(64 * 1024)
+
+/* the samples were downsampled to fit the memory budget */
+#define UP_HISTORY_EXPORT_FLAG_REDUCED	(1 << 0)
+
+/**
+ * up_history_export_open:
+ *
+ * Return value: a file descriptor only we can see, or -1
+ **/
+static gint
+up_history_export_open (void)
+{
+	g_autofree gchar *filename = NULL;
+	gint fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create ("upower-history", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+
+	/* fall back to a temporary file that nobody else can open */
+	fd = g_file_open_tmp ("upower-history-XXXXXX", &filename, NULL);
+	if (fd >= 0)
+		g_unlink (filename);
+	return fd;
+}
+
+/**
+ * up_history_export_fd:
+ *
+ * Writes the whole history of @type to a new file descriptor, so that it
+ * can be handed to a client without going through the message bus. Where
+ * possible the contents are sealed, so that the client can map them
+ * without fear of them changing.
+ *
+ * Return value: a file descriptor positioned at the start of the data,
+ * to be closed by the caller, or -1 if @error is set
+ **/
+gint
+up_history_export_fd (UpHistory *history, UpHistoryType type, GError **error)
+{
+	g_autoptr(GByteArray) buf = NULL;
+	guint64 until[UP_HISTORY_TIER_LAST];
+	guint count[UP_HISTORY_TIER_LAST];
+	gboolean ret = FALSE;
+	guint32 flags = 0;
+	guint total = 0;
+	gint errsv;
+	gint tier;
+	gint fd;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), -1);
+
+	if (history->priv->id == NULL || type >= UP_HISTORY_TYPE_UNKNOWN) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+				     "no such history");
+		return -1;
+	}
+	history->priv->last_query = g_get_monotonic_time ();
+
+	up_history_get_tier_limits (history, type, (guint64) G_MAXUINT32 + 1, until);
+	for (tier = 0; tier < UP_HISTORY_TIER_LAST; tier++) {
+		const UpHistorySeries *series = up_history_tier_get_series (history, tier, type);
+
+		count[tier] = up_history_series_upper_bound (series, until[tier] - 1);
+		total += count[tier];
+		if (series->thinned && count[tier] > 0)
+			flags |= UP_HISTORY_EXPORT_FLAG_REDUCED;
+	}
+
+	fd = up_history_export_open ();
+	if (fd < 0) {
+		errsv = errno;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "failed to create export file: %s", g_strerror (errsv));
+		return -1;
+	}
+
+	buf = g_byte_array_sized_new (UP_HISTORY_EXPORT_CHUNK + UP_HISTORY_FILE_RECORD_SIZE);
+	g_byte_array_append (buf, (const guint8 *) UP_HISTORY_EXPORT_MAGIC, 4);
+	up_history_buf_append_u32 (buf, UP_HISTORY_EXPORT_VERSION);
+	up_history_buf_append_u32 (buf, total);
+	up_history_buf_append_u32 (buf, flags);
+
+	/* coarsest first, so the samples are in order */
+	for (tier = UP_HISTORY_TIER_LAST - 1; tier >= 0; tier--) {
+		const UpHistorySeries *series = up_history_tier_get_series (history, tier, type);
+
+		for (i = 0; i < count[tier]; i++) {
+			const UpHistorySample *sample = up_history_series_get (series, i);
+
+			up_history_buf_append_u32 (buf, sample->time);
+			up_history_buf_append_u32 (buf, sample->state);
+			up_history_buf_append_double (buf, sample->value);
+			if (buf->len < UP_HISTORY_EXPORT_CHUNK)
+				continue;
+			if (!up_history_file_write_all (fd, buf->data, buf->len))
+				goto out;
+			g_byte_array_set_size (buf, 0);
+		}
+	}
+	if (!up_history_file_write_all (fd, buf->data, buf->len))
+		goto out;
+
+#ifdef F_ADD_SEALS
+	/* this fails harmlessly for the temporary file */
+	fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	if (lseek (fd, 0, SEEK_SET) < 0)
+		goto out;
+	g_debug ("exported %u samples of %s", total, up_history_series_names[type]);
+	ret = TRUE;
+out:
+	if (!ret) {
+		errsv = errno;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "failed to write export file: %s", g_strerror (errsv));
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * up_history_save_tiers:
+ * @persist: whether to write to the history directory when staging
+ **/
+static gboolean
+up_history_save_tiers (UpHistory *history, gboolean persist)
+{
+	gboolean ret = TRUE;
+	guint i, j;
+
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		UpHistoryFile *file = &history->priv->files[i];
+		UpHistorySeries *series[UP_HISTORY_TYPE_UNKNOWN];
+		const gchar *suffix = up_history_tier_get_suffix (i);
+		g_autofree gchar *filename = NULL;
+		g_autofree gchar *staged_filename = NULL;
+		guint max_age = up_history_tier_get_max_age (history, i);
+		guint first[UP_HISTORY_TYPE_UNKNOWN];
+
+		if (suffix == NULL)
+			continue;
+		for (j = 0; j < UP_HISTORY_TYPE_UNKNOWN; j++)
+			series[j] = up_history_tier_get_series (history, i, j);
+		filename = up_history_build_filename (history->priv->dir, history->priv->id, NULL,
+						      suffix, "bin");
+
+		/* a rewrite must not lose what was downsampled in memory */
+		if (i == UP_HISTORY_TIER_RAW) {
+			for (j = 0; j < UP_HISTORY_TYPE_UNKNOWN; j++) {
+				if (series[j]->thinned)
+					break;
+			}
+			if (j < UP_HISTORY_TYPE_UNKNOWN &&
+			    (history->priv->staging_dir == NULL || persist) &&
+			    up_history_file_check (file, series, max_age, first))
+				up_history_reload_thinned (history);
+			if (history->priv->reloading) {
+				g_debug ("not saving %s until it has been reloaded", history->priv->id);
+				continue;
+			}
+		}
+
+		if (history->priv->staging_dir == NULL) {
+			if (!up_history_file_save (file, series, filename, max_age)) {
+				ret = FALSE;
+				continue;
+			}
+		} else {
+			staged_filename = up_history_build_filename (history->priv->staging_dir,
+								     history->priv->id, NULL,
+								     suffix, "bin");
+			if (!up_history_file_stage (&history->priv->staged[i], file,
+						    series, staged_filename))
+				ret = FALSE;
+			if (!persist)
+				continue;
+			if (!up_history_file_persist (&history->priv->staged[i], file, series,
+						      staged_filename, filename, max_age)) {
+				ret = FALSE;
+				continue;
+			}
+		}
+
+		/* the data has been migrated */
+		for (j = 0; j < file->legacy_files->len; j++)
+			g_unlink (g_ptr_array_index (file->legacy_files, j));
+		g_ptr_array_set_size (file->legacy_files, 0);
+	}
+
+	/* this is rewritten every time, so it waits for the staged blocks */
+	if (history->priv->profile.dirty && persist) {
+		g_autofree gchar *filename = NULL;
+
+		filename = up_history_build_filename (history->priv->dir, history->priv->id, NULL,
+						      "-profile", "bin");
+		if (!up_history_profile_to_file (&history->priv->profile, filename))
+			ret = FALSE;
+	}
+	return ret;
+}
+
+/**
+ * up_history_save_data_full:
+ **/
+static gboolean
+up_history_save_data_full (UpHistory *history, gboolean persist)
+{
+	gint64 now = g_get_monotonic_time ();
+	gint64 due;
+
+	/* we have an ID? */
+	if (history->priv->id == NULL) {
+		g_warning ("no ID, cannot save");
+		return FALSE;
+	}
+
+	/* we will be called again once loaded */
+	if (history->priv->loading) {
+		g_debug ("not saving %s until it has been loaded", history->priv->id);
+		return TRUE;
+	}
+
+	if (history->priv->staging_dir == NULL)
+		return up_history_save_tiers (history, TRUE);
+
+	due = history->priv->last_persist + (gint64) history->priv->persist_interval * G_USEC_PER_SEC;
+	if (now >= due)
+		persist = TRUE;
+	if (persist) {
+		history->priv->last_persist = now;
+		return up_history_save_tiers (history, TRUE);
+	}
+
+	/* make sure the staged blocks are persisted even if nothing changes */
+	if (history->priv->writer != NULL)
+		up_history_writer_schedule (history->priv->writer, history,
+					    (due - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC);
+	return up_history_save_tiers (history, FALSE);
+}
+
+/**
+ * up_history_save_data:
+ *
+ * Saves the samples added since the last save. When staging, they only go
+ * to the history directory once the persist interval has passed.
+ **/
+gboolean
+up_history_save_data (UpHistory *history)
+{
+	return up_history_save_data_full (history, FALSE);
+}
+
+/**
+ * up_history_persist_data:
+ *
+ * Saves the samples added since the last save, and writes everything that
+ * was staged to the history directory, for instance before shutting down.
+ **/
+gboolean
+up_history_persist_data (UpHistory *history)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	/* nothing to save */
+	if (history->priv->id == NULL)
+		return TRUE;
+	return up_history_save_data_full (history, TRUE);
+}
+
+/**
+ * up_history_set_staging_directory:
+ * @dir: a directory on a tmpfs, or %NULL to save to the history directory
+ *
+ * Stages the saved samples in @dir, and only writes them to the history
+ * directory every persist interval, on up_history_persist_data(), and when
+ * finalized. This has to be set before the ID.
+ **/
+void
+up_history_set_staging_directory (UpHistory *history, const gchar *dir)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	g_free (history->priv->staging_dir);
+	history->priv->staging_dir = g_strdup (dir);
+	if (dir != NULL)
+		g_mkdir_with_parents (dir, 0755);
+}
+
+/**
+ * up_history_set_persist_interval:
+ * @interval: the longest time in seconds samples stay staged
+ **/
+void
+up_history_set_persist_interval (UpHistory *history, guint interval)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	history->priv->persist_interval = interval;
+}
+
+/**
+ * up_history_is_low_power:
+ **/
+static gboolean
+up_history_is_low_power (UpHistory *history)
+{
+	guint length;
+	const UpHistorySample *item;
+
+	/* current status is always up to date */
+	if (history->priv->state != UP_DEVICE_STATE_DISCHARGING)
+		return FALSE;
+
+	/* have we got any data? */
+	length = history->priv->series[UP_HISTORY_TYPE_CHARGE].len;
+	if (length == 0)
+		return FALSE;
+
+	/* get the last saved charge object */
+	item = up_history_series_get (&history->priv->series[UP_HISTORY_TYPE_CHARGE], length-1);
+	if (item->state != UP_DEVICE_STATE_DISCHARGING)
+		return FALSE;
+
+	/* high enough */
+	if (item->value > UP_HISTORY_LOW_POWER_PERCENT)
+		return FALSE;
+
+	/* we are low power */
+	return TRUE;
+}
+
+/**
+ * up_history_schedule_save:
+ **/
+static gboolean
+up_history_schedule_save (UpHistory *history)
+{
+	guint timeout = UP_HISTORY_SAVE_INTERVAL;
+
+	/* without a writer we only save when finalized */
+	if (history->priv->writer == NULL)
+		return FALSE;
+
+	/* if low power, then don't batch up save requests */
+	if (up_history_is_low_power (history)) {
+		g_debug ("saving to disk earlier due to low power");
+		timeout = UP_HISTORY_SAVE_INTERVAL_LOW_POWER;
+	}
+
+	up_history_writer_schedule (history->priv->writer, history, timeout);
+	return TRUE;
+}
+
+/**
+ * up_history_set_writer:
+ *
+ * Sets the writer that commits this history to disk along with the others
+ **/
+void
+up_history_set_writer (UpHistory *history, UpHistoryWriter *writer)
+{
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	if (history->priv->writer != NULL)
+		up_history_writer_remove (history->priv->writer, history);
+	g_set_object (&history->priv->writer, writer);
+	if (writer != NULL)
+		up_history_writer_add (writer, history);
+}
+
+/**
+ * up_history_load_free:
+ **/
+static void
+up_history_load_free (UpHistoryLoad *load)
+{
+	guint i, j;
+
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		for (j = 0; j < UP_HISTORY_TYPE_UNKNOWN; j++)
+			g_array_unref (load->files[i].samples[j]);
+		g_ptr_array_unref (load->files[i].legacy_files);
+	}
+	g_free (load->dir);
+	g_free (load->staging_dir);
+	g_free (load->id);
+	g_free (load);
+}
+
+/**
+ * up_history_load_new:
+ **/
+static UpHistoryLoad *
+up_history_load_new (UpHistory *history)
+{
+	UpHistoryLoad *load;
+	guint i, j;
+
+	load = g_new0 (UpHistoryLoad, 1);
+	load->dir = g_strdup (history->priv->dir);
+	load->staging_dir = g_strdup (history->priv->staging_dir);
+	load->id = g_strdup (history->priv->id);
+	load->marker_time = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		for (j = 0; j < UP_HISTORY_TYPE_UNKNOWN; j++)
+			load->files[i].samples[j] = g_array_new (FALSE, FALSE, sizeof (UpHistorySample));
+		load->files[i].legacy_files = g_ptr_array_new_with_free_func (g_free);
+	}
+	return load;
+}
+
+/**
+ * up_history_load_tier:
+ **/
+static void
+up_history_load_tier (UpHistoryLoad *load, guint tier)
+{
+	UpHistoryLoadFile *file = &load->files[tier];
+	const gchar *suffix = up_history_tier_get_suffix (tier);
+	g_autofree gchar *filename = NULL;
+	guint i;
+
+	filename = up_history_build_filename (load->dir, load->id, NULL, suffix, "bin");
+	if (up_history_load_file (file, filename))
+		return;
+
+	/* import the files of each metric written by older versions */
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_autofree gchar *series_filename = NULL;
+
+		series_filename = up_history_build_filename (load->dir, load->id,
+							     up_history_series_names[i], suffix, "bin");
+		if (!up_history_load_series_file (file->samples[i], series_filename)) {
+			if (tier != UP_HISTORY_TIER_RAW)
+				continue;
+			g_free (series_filename);
+			series_filename = up_history_build_filename (load->dir, load->id,
+								     up_history_series_names[i], "", "dat");
+			if (!up_history_load_legacy_file (file->samples[i], series_filename))
+				continue;
+		}
+		g_ptr_array_add (file->legacy_files, g_steal_pointer (&series_filename));
+		file->needs_rewrite = TRUE;
+	}
+}
+
+/**
+ * up_history_load_staged:
+ *
+ * Adds the samples that were staged but not persisted yet.
+ **/
+static void
+up_history_load_staged (UpHistoryLoad *load, guint tier)
+{
+	UpHistoryLoadFile *file = &load->files[tier];
+	UpHistoryLoadFile staged = { 0 };
+	g_autofree gchar *filename = NULL;
+	guint old_len[UP_HISTORY_TYPE_UNKNOWN];
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		staged.samples[i] = file->samples[i];
+		old_len[i] = file->samples[i]->len;
 	}
 
-	/* accuracy is a percentage scale, where each cycle = 20% */
-	for (i=0; i<101; i++) {
-		stats = (UpStatsItem *) g_ptr_array_index (data, i);
-		up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) * 20.0f);
+	filename = up_history_build_filename (load->staging_dir, load->id, NULL,
+					      up_history_tier_get_suffix (tier), "bin");
+	if (!up_history_load_file (&staged, filename)) {
+		load->staged_truncate[tier] = staged.needs_rewrite;
+		return;
 	}
 
-	return data;
+	/* the daemon died after persisting the blocks, but before removing them */
+	if (staged.base != file->size || staged.needs_rewrite) {
+		g_debug ("ignoring %s as it was already persisted", filename);
+		for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+			g_array_set_size (file->samples[i], old_len[i]);
+		load->staged_truncate[tier] = TRUE;
+		return;
+	}
+	load->staged_size[tier] = staged.size;
+	if (tier == UP_HISTORY_TIER_RAW)
+		load->n_staged = file->samples[UP_HISTORY_TYPE_CHARGE]->len - old_len[UP_HISTORY_TYPE_CHARGE];
+	load->staged_truncate[tier] = staged.needs_truncate;
 }
 
 /**
- * up_history_get_filename:
+ * up_history_load_thread:
  **/
-static gchar *
-up_history_get_filename (UpHistory *history, const gchar *type)
+static void
+up_history_load_thread (GTask *task, gpointer source_object,
+			gpointer task_data, GCancellable *cancellable)
 {
-	gchar *path;
-	gchar *filename;
+	UpHistoryLoad *load = task_data;
+	g_autofree gchar *filename = NULL;
+	guint i;
 
-	filename = g_strdup_printf ("history-%s-%s.dat", type, history->priv->id);
-	path = g_build_filename (history->priv->dir, filename, NULL);
-	g_free (filename);
-	return path;
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		if (up_history_tier_get_suffix (i) == NULL)
+			continue;
+		up_history_load_tier (load, i);
+		if (load->staging_dir != NULL)
+			up_history_load_staged (load, i);
+	}
+
+	filename = up_history_build_filename (load->dir, load->id, NULL, "-profile", "bin");
+	load->has_profile = up_history_load_profile_file (load->profile, filename);
+	g_task_return_boolean (task, TRUE);
 }
 
 /**
- * up_history_set_directory:
+ * up_history_series_take_loaded:
+ * @marker_time: the time of a marker to add after the loaded samples, or 0
+ *
+ * Puts the loaded samples in front of the ones that arrived while loading
  **/
-void
-up_history_set_directory (UpHistory *history, const gchar *dir)
+static void
+up_history_series_take_loaded (UpHistorySeries *series, GArray *samples, guint32 marker_time)
 {
-	g_free (history->priv->dir);
-	history->priv->dir = g_strdup (dir);
-	g_mkdir_with_parents (dir, 0755);
+	UpHistorySeries merged = { 0 };
+	guint i;
+
+	up_history_series_resize (&merged, CLAMP (samples->len + series->len + 1,
+						  UP_HISTORY_SERIES_MIN_SIZE,
+						  UP_HISTORY_SERIES_MAX_SAMPLES));
+	for (i = 0; i < samples->len; i++) {
+		const UpHistorySample *sample = &g_array_index (samples, UpHistorySample, i);
+		up_history_series_add (&merged, sample->time, sample->value, sample->state);
+	}
+	merged.n_saved = merged.len;
+	merged.n_file = samples->len;
+	if (marker_time != 0)
+		up_history_series_add (&merged, marker_time, 0.0f, UP_DEVICE_STATE_UNKNOWN);
+	for (i = 0; i < series->len; i++) {
+		const UpHistorySample *sample = up_history_series_get (series, i);
+		up_history_series_add (&merged, sample->time, sample->value, sample->state);
+	}
+	merged.needs_rewrite = series->needs_rewrite;
+
+	up_history_series_clear (series);
+	*series = merged;
 }
 
 /**
- * up_history_array_to_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_tier_iter_peek:
+ * @until: the tier limits from up_history_get_tier_limits()
+ * @tier: (inout): the tier being walked, coarsest first
+ * @index: (inout): the index in that tier
  *
- * Saves a copy of the list to a file
+ * Return value: the next sample of @type in time order over all the tiers,
+ * or %NULL at the end
  **/
-static gboolean
-up_history_array_to_file (UpHistory *history, GPtrArray *list, const gchar *filename)
+static const UpHistorySample *
+up_history_tier_iter_peek (UpHistory *history, UpHistoryType type,
+			   const guint64 *until, gint *tier, guint *index)
 {
-	guint i;
-	UpHistoryItem *item;
-	gchar *part;
-	GString *string;
-	gboolean ret = TRUE;
-	GError *error = NULL;
-	gint64 time_now;
-	guint time_item;
-	guint cull_count = 0;
+	for (; *tier >= 0; (*tier)--, *index = 0) {
+		const UpHistorySeries *series = up_history_tier_get_series (history, *tier, type);
+		const UpHistorySample *sample;
 
-	/* get current time */
-	time_now = g_get_real_time ();
-
-	/* generate data */
-	string = g_string_new ("");
-	for (i=0; i<list->len; i++) {
-		item = g_ptr_array_index (list, i);
-
-		/* only save entries for the last 24 hours */
-		time_item = up_history_item_get_time (item);
-		if ((time_now / 1000000) - time_item > history->priv->max_data_age) {
-			cull_count++;
+		if (*index >= series->len)
 			continue;
-		}
-		part = up_history_item_to_string (item);
-		if (part == NULL) {
-			ret = FALSE;
+		sample = up_history_series_get (series, *index);
+		if (sample->time < until[*tier])
+			return sample;
+	}
+	return NULL;
+}
+
+/**
+ * up_history_load_sessions:
+ *
+ * Rebuilds the session index from the charge and energy samples of all
+ * the tiers, merged in time order.
+ **/
+static void
+up_history_load_sessions (UpHistory *history)
+{
+	guint64 charge_until[UP_HISTORY_TIER_LAST];
+	guint64 energy_until[UP_HISTORY_TIER_LAST];
+	gint charge_tier = UP_HISTORY_TIER_LAST - 1;
+	gint energy_tier = UP_HISTORY_TIER_LAST - 1;
+	guint charge_index = 0;
+	guint energy_index = 0;
+
+	g_array_set_size (history->priv->sessions, 0);
+	history->priv->session_open = FALSE;
+	up_history_get_tier_limits (history, UP_HISTORY_TYPE_CHARGE, G_MAXUINT64, charge_until);
+	up_history_get_tier_limits (history, UP_HISTORY_TYPE_ENERGY, G_MAXUINT64, energy_until);
+
+	while (TRUE) {
+		const UpHistorySample *charge;
+		const UpHistorySample *energy;
+
+		charge = up_history_tier_iter_peek (history, UP_HISTORY_TYPE_CHARGE,
+						    charge_until, &charge_tier, &charge_index);
+		energy = up_history_tier_iter_peek (history, UP_HISTORY_TYPE_ENERGY,
+						    energy_until, &energy_tier, &energy_index);
+		if (charge == NULL && energy == NULL)
 			break;
+
+		/* the charge first, as it starts the sessions */
+		if (energy == NULL || (charge != NULL && charge->time <= energy->time)) {
+			up_history_sessions_add (history, UP_HISTORY_TYPE_CHARGE, charge);
+			charge_index++;
+		} else {
+			up_history_sessions_add (history, UP_HISTORY_TYPE_ENERGY, energy);
+			energy_index++;
 		}
-		g_string_append_printf (string, "%s\n", part);
-		g_free (part);
 	}
-	part = g_string_free (string, FALSE);
+}
 
-	/* how many did we kill? */
-	g_debug ("culled %i of %i", cull_count, list->len);
+/**
+ * up_history_load_rollups:
+ *
+ * Rebuilds the buckets after the last saved one from the raw samples
+ **/
+static void
+up_history_load_rollups (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	guint i, j;
 
-	/* we failed to convert to string */
-	if (!ret) {
-		g_warning ("failed to convert");
-		goto out;
-	}
+	for (i = 0; i < UP_HISTORY_ROLLUP_LAST; i++) {
+		UpHistoryRollup *rollup = &history->priv->rollups[type][i];
+		guint interval = up_history_rollups[i].interval;
+		guint32 after = 0;
 
-	/* save to disk */
-	ret = g_file_set_contents (filename, part, -1, &error);
-	if (!ret) {
-		g_warning ("failed to set data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
-	g_debug ("saved %s", filename);
+		if (rollup->series.len > 0) {
+			after = up_history_series_get (&rollup->series, rollup->series.len - 1)->time;
+			after = after - after % interval + interval;
+		}
 
-out:
-	g_free (part);
-	return ret;
+		for (j = 0; j < series->len; j++) {
+			const UpHistorySample *sample = up_history_series_get (series, j);
+			if (sample->time >= after)
+				up_history_rollup_add (rollup, interval, sample);
+		}
+	}
 }
 
 /**
- * up_history_array_from_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
- *
- * Appends the list from a file
+ * up_history_load_cb:
  **/
-static gboolean
-up_history_array_from_file (GPtrArray *list, const gchar *filename)
+static void
+up_history_load_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
-	gboolean ret;
-	GError *error = NULL;
-	gchar *data = NULL;
-	gchar **parts = NULL;
-	guint i;
-	guint length;
-	UpHistoryItem *item;
+	UpHistory *history = UP_HISTORY (source_object);
+	UpHistoryLoad *load = g_task_get_task_data (G_TASK (res));
+	const UpHistorySeries *series;
+	gint64 time_now;
+	guint first;
+	guint i, j;
 
-	/* do we exist */
-	ret = g_file_test (filename, G_FILE_TEST_EXISTS);
-	if (!ret) {
-		g_debug ("failed to get data from %s as file does not exist", filename);
-		goto out;
-	}
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		UpHistoryFile *file = &history->priv->files[i];
+		UpHistoryLoadFile *loaded = &load->files[i];
 
-	/* get contents */
-	ret = g_file_get_contents (filename, &data, NULL, &error);
-	if (!ret) {
-		g_warning ("failed to get data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
+		if (up_history_tier_get_suffix (i) == NULL)
+			continue;
 
-	/* split by line ending */
-	parts = g_strsplit (data, "\n", 0);
-	length = g_strv_length (parts);
-	if (length == 0) {
-		g_debug ("no data in %s", filename);
-		goto out;
+		/* with a marker so we don't use incomplete percentages */
+		for (j = 0; j < UP_HISTORY_TYPE_UNKNOWN; j++)
+			up_history_series_take_loaded (up_history_tier_get_series (history, i, j),
+						       loaded->samples[j],
+						       i == UP_HISTORY_TIER_RAW ? load->marker_time : 0);
+		file->size = loaded->size;
+		file->needs_rewrite = loaded->needs_rewrite;
+		file->needs_truncate = loaded->needs_truncate;
+		history->priv->staged[i].size = load->staged_size[i];
+		history->priv->staged[i].needs_truncate = load->staged_truncate[i];
+		for (j = 0; j < loaded->legacy_files->len; j++)
+			g_ptr_array_add (file->legacy_files, g_strdup (g_ptr_array_index (loaded->legacy_files, j)));
 	}
 
-	/* add valid entries */
-	g_debug ("loading %i items of data from %s", length, filename);
-	for (i=0; i<length-1; i++) {
-		item = up_history_item_new ();
-		ret = up_history_item_set_from_string (item, parts[i]);
-		if (ret)
-			g_ptr_array_add (list, item);
-		else
-			g_object_unref (item);
+	/* without a saved profile it is rebuilt from all the loaded samples */
+	series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	first = 0;
+	if (load->has_profile) {
+		/* it is only saved on persist, so it has none of the staged samples */
+		memcpy (history->priv->profile.bins, load->profile, sizeof (load->profile));
+		first = series->n_saved - MIN (load->n_staged, series->n_saved);
+	} else if (series->n_saved > 0) {
+		history->priv->profile.dirty = TRUE;
 	}
+	for (i = first; i < series->len; i++)
+		up_history_profile_add (&history->priv->profile, up_history_series_get (series, i));
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < G_N_ELEMENTS (history->priv->series); i++) {
+		if (time_now > history->priv->max_data_age)
+			up_history_series_evict (&history->priv->series[i], time_now - history->priv->max_data_age);
+		up_history_load_rollups (history, i);
+	}
+	up_history_load_sessions (history);
+	history->priv->loading = FALSE;
+	g_debug ("loaded history for %s", history->priv->id);
 
-out:
-	g_strfreev (parts);
-	g_free (data);
-	return ret;
+	up_history_enforce_memory_budget ();
+	up_history_schedule_save (history);
 }
 
 /**
- * up_history_save_data:
+ * up_history_series_take_reloaded:
+ * @oldest: the time of the oldest sample to keep
+ *
+ * Puts the samples read back from the file in place of the saved ones
  **/
-gboolean
-up_history_save_data (UpHistory *history)
+static void
+up_history_series_take_reloaded (UpHistorySeries *series, GArray *samples, guint32 oldest)
 {
-	gboolean ret = FALSE;
-	gchar *filename_rate = NULL;
-	gchar *filename_charge = NULL;
-	gchar *filename_time_full = NULL;
-	gchar *filename_time_empty = NULL;
+	UpHistorySeries merged = { 0 };
+	guint i;
 
-	/* we have an ID? */
-	if (history->priv->id == NULL) {
-		g_warning ("no ID, cannot save");
-		goto out;
+	up_history_series_resize (&merged, CLAMP (samples->len + series->len - series->n_saved,
+						  UP_HISTORY_SERIES_MIN_SIZE,
+						  UP_HISTORY_SERIES_MAX_SAMPLES));
+	for (i = 0; i < samples->len; i++) {
+		const UpHistorySample *sample = &g_array_index (samples, UpHistorySample, i);
+		if (sample->time >= oldest)
+			up_history_series_add (&merged, sample->time, sample->value, sample->state);
+	}
+	merged.n_saved = merged.len;
+	merged.n_file = samples->len;
+	for (i = series->n_saved; i < series->len; i++) {
+		const UpHistorySample *sample = up_history_series_get (series, i);
+		up_history_series_add (&merged, sample->time, sample->value, sample->state);
 	}
+	merged.needs_rewrite = series->needs_rewrite;
 
-	/* get filenames */
-	filename_rate = up_history_get_filename (history, "rate");
-	filename_charge = up_history_get_filename (history, "charge");
-	filename_time_full = up_history_get_filename (history, "time-full");
-	filename_time_empty = up_history_get_filename (history, "time-empty");
+	up_history_series_clear (series);
+	*series = merged;
+}
 
-	/* save to disk */
-	ret = up_history_array_to_file (history, history->priv->data_rate, filename_rate);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_charge, filename_charge);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_full, filename_time_full);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_empty, filename_time_empty);
-	if (!ret)
-		goto out;
-out:
-	g_free (filename_rate);
-	g_free (filename_charge);
-	g_free (filename_time_full);
-	g_free (filename_time_empty);
-	return ret;
+/**
+ * up_history_reload_read:
+ **/
+static void
+up_history_reload_read (UpHistoryLoad *load)
+{
+	up_history_load_tier (load, UP_HISTORY_TIER_RAW);
+	if (load->staging_dir != NULL)
+		up_history_load_staged (load, UP_HISTORY_TIER_RAW);
 }
 
 /**
- * up_history_schedule_save_cb:
+ * up_history_reload_thread:
  **/
-static gboolean
-up_history_schedule_save_cb (UpHistory *history)
+static void
+up_history_reload_thread (GTask *task, gpointer source_object,
+			  gpointer task_data, GCancellable *cancellable)
 {
-	up_history_save_data (history);
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
-	return FALSE;
+	up_history_reload_read (task_data);
+	g_task_return_boolean (task, TRUE);
 }
 
 /**
- * up_history_is_low_power:
+ * up_history_reload_take:
+ *
+ * Puts the reloaded samples in place of the downsampled ones
  **/
-static gboolean
-up_history_is_low_power (UpHistory *history)
+static void
+up_history_reload_take (UpHistory *history, UpHistoryLoad *load)
 {
-	guint length;
-	UpHistoryItem *item;
+	guint32 oldest = 0;
+	gint64 time_now;
+	guint i;
 
-	/* current status is always up to date */
-	if (history->priv->state != UP_DEVICE_STATE_DISCHARGING)
-		return FALSE;
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	if (time_now > history->priv->max_data_age)
+		oldest = time_now - history->priv->max_data_age;
+	for (i = 0; i < G_N_ELEMENTS (history->priv->series); i++) {
+		UpHistorySeries *series = &history->priv->series[i];
+		GArray *samples = load->files[UP_HISTORY_TIER_RAW].samples[i];
 
-	/* have we got any data? */
-	length = history->priv->data_charge->len;
-	if (length == 0)
-		return FALSE;
+		if (!series->thinned)
+			continue;
 
-	/* get the last saved charge object */
-	item = (UpHistoryItem *) g_ptr_array_index (history->priv->data_charge, length-1);
-	if (up_history_item_get_state (item) != UP_DEVICE_STATE_DISCHARGING)
-		return FALSE;
+		/* the file has gone, so what we have is all there is */
+		if (samples->len == 0) {
+			series->thinned = FALSE;
+			continue;
+		}
+		up_history_series_take_reloaded (series, samples, oldest);
+	}
+	g_debug ("reloaded downsampled history of %s", history->priv->id);
+}
 
-	/* high enough */
-	if (up_history_item_get_value (item) > UP_HISTORY_LOW_POWER_PERCENT)
-		return FALSE;
+/**
+ * up_history_reload_cb:
+ **/
+static void
+up_history_reload_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (source_object);
 
-	/* we are low power */
-	return TRUE;
+	up_history_reload_take (history, g_task_get_task_data (G_TASK (res)));
+	history->priv->reloading = FALSE;
+
+	/* rewrite while we have the detail, then make it fit again */
+	up_history_save_data_full (history, TRUE);
+	up_history_enforce_memory_budget ();
 }
 
 /**
- * up_history_schedule_save:
+ * up_history_reload_thinned:
+ *
+ * Reads the saved samples of the series that were downsampled to fit the
+ * memory budget back from the file in a thread, so that it can be
+ * rewritten without losing their detail. The raw samples are not saved
+ * until that is done, so the file does not change underneath it. Only the
+ * last save, when the history goes away, reads them back in place.
  **/
-static gboolean
-up_history_schedule_save (UpHistory *history)
+static void
+up_history_reload_thinned (UpHistory *history)
 {
-	gboolean ret;
-	gint timeout = UP_HISTORY_SAVE_INTERVAL;
+	g_autoptr(GTask) task = NULL;
+	UpHistoryLoad *load;
 
-	/* if low power, then don't batch up save requests */
-	ret = up_history_is_low_power (history);
-	if (ret) {
-		g_debug ("saving to disk earlier due to low power");
-		timeout = UP_HISTORY_SAVE_INTERVAL_LOW_POWER;
-	}
+	if (history->priv->reloading || history->priv->loading)
+		return;
 
-	/* we already have one saved, clear it if it will fire earlier */
-	if (history->priv->save_source) {
-		guint64 ready = g_source_get_ready_time (history->priv->save_source);
+	load = up_history_load_new (history);
 
-		if (ready > g_source_get_time (history->priv->save_source) + timeout * G_USEC_PER_SEC) {
-			g_clear_pointer (&history->priv->save_source, g_source_destroy);
-		} else {
-			g_debug ("deferring as earlier timeout is already queued");
-			return TRUE;
-		}
+	/* this is the last save, so nothing else can wait for it */
+	if (history->priv->closing) {
+		up_history_reload_read (load);
+		up_history_reload_take (history, load);
+		up_history_load_free (load);
+		return;
 	}
 
-	/* nothing scheduled */
-	g_debug ("saving in %i seconds", timeout);
-	history->priv->save_source = g_timeout_source_new_seconds (timeout);
-	g_source_set_name (history->priv->save_source, "[upower] up_history_schedule_save_cb");
-	g_source_attach (history->priv->save_source, NULL);
-	g_source_set_callback (history->priv->save_source,
-			       (GSourceFunc) up_history_schedule_save_cb, history,
-			       NULL);
-	return TRUE;
+	history->priv->reloading = TRUE;
+	task = g_task_new (history, NULL, up_history_reload_cb, NULL);
+	g_task_set_source_tag (task, up_history_reload_thinned);
+	g_task_set_task_data (task, load, (GDestroyNotify) up_history_load_free);
+	g_task_run_in_thread (task, up_history_reload_thread);
 }
 
 /**
  * up_history_load_data:
+ *
+ * Reads the saved history in a thread. Samples added in the meantime are
+ * kept and put after the loaded ones.
  **/
-static gboolean
+static void
 up_history_load_data (UpHistory *history)
 {
-	gchar *filename;
-	UpHistoryItem *item;
-
-	/* load rate history from disk */
-	filename = up_history_get_filename (history, "rate");
-	up_history_array_from_file (history->priv->data_rate, filename);
-	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "charge");
-	up_history_array_from_file (history->priv->data_charge, filename);
-	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-full");
-	up_history_array_from_file (history->priv->data_time_full, filename);
-	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-empty");
-	up_history_array_from_file (history->priv->data_time_empty, filename);
-	g_free (filename);
-
-	/* save a marker so we don't use incomplete percentages */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	g_ptr_array_add (history->priv->data_rate, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_charge, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_full, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_empty, g_object_ref (item));
-	g_object_unref (item);
-	up_history_schedule_save (history);
+	g_autoptr(GTask) task = NULL;
+	UpHistoryLoad *load;
+
+	load = up_history_load_new (history);
+	history->priv->loading = TRUE;
+	task = g_task_new (history, NULL, up_history_load_cb, NULL);
+	g_task_set_source_tag (task, up_history_load_data);
+	g_task_set_task_data (task, load, (GDestroyNotify) up_history_load_free);
+	g_task_run_in_thread (task, up_history_load_thread);
+}
 
-	return TRUE;
+/**
+ * up_history_is_loading:
+ *
+ * Return value: %TRUE while the saved history is still being loaded
+ **/
+gboolean
+up_history_is_loading (UpHistory *history)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+	return history->priv->loading;
 }
 
 /**
@@ -712,8 +3595,6 @@ up_history_load_data (UpHistory *history)
 gboolean
 up_history_set_id (UpHistory *history, const gchar *id)
 {
-	gboolean ret;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id != NULL)
@@ -724,8 +3605,8 @@ up_history_set_id (UpHistory *history, const gchar *id)
 	g_debug ("using id: %s", id);
 	history->priv->id = g_strdup (id);
 	/* load all previous data */
-	ret = up_history_load_data (history);
-	return ret;
+	up_history_load_data (history);
+	return TRUE;
 }
 
 /**
@@ -743,65 +3624,63 @@ up_history_set_state (UpHistory *history, UpDeviceState state)
 }
 
 /**
- * up_history_set_charge_data:
+ * up_history_record:
+ *
+ * Adds @value to the series if it moved out of the deadband around the last
+ * recorded value, or if the series has been quiet for too long.
  **/
-gboolean
-up_history_set_charge_data (UpHistory *history, gdouble percentage)
+static gboolean
+up_history_record (UpHistory *history, UpHistoryType type, gdouble value)
 {
-	UpHistoryItem *item;
-
-	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+	UpHistoryRecorder *recorder = &history->priv->recorders[type];
+	gboolean changed;
+	gboolean stale;
+	gint64 now;
 
 	if (history->priv->id == NULL)
 		return FALSE;
 	if (history->priv->state == UP_DEVICE_STATE_UNKNOWN)
 		return FALSE;
-	if (history->priv->percentage_last == percentage)
+
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	changed = value != recorder->last &&
+		  fabs (value - recorder->last) >= recorder->deadband;
+	stale = history->priv->keep_alive > 0 &&
+		now - recorder->last_time >= history->priv->keep_alive;
+	if (!changed && !stale)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, percentage);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_charge, item);
+	up_history_add_sample (history, type, now, value, history->priv->state);
 	up_history_schedule_save (history);
 
 	/* save last value */
-	history->priv->percentage_last = percentage;
+	recorder->last = value;
+	recorder->last_time = now;
 
 	return TRUE;
 }
 
 /**
- * up_history_set_rate_data:
+ * up_history_set_charge_data:
  **/
 gboolean
-up_history_set_rate_data (UpHistory *history, gdouble rate)
+up_history_set_charge_data (UpHistory *history, gdouble percentage)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	if (history->priv->id == NULL)
-		return FALSE;
-	if (history->priv->state == UP_DEVICE_STATE_UNKNOWN)
-		return FALSE;
-	if (history->priv->rate_last == rate)
-		return FALSE;
-
-	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, rate);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_rate, item);
-	up_history_schedule_save (history);
+	return up_history_record (history, UP_HISTORY_TYPE_CHARGE, percentage);
+}
 
-	/* save last value */
-	history->priv->rate_last = rate;
+/**
+ * up_history_set_rate_data:
+ **/
+gboolean
+up_history_set_rate_data (UpHistory *history, gdouble rate)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	return TRUE;
+	return up_history_record (history, UP_HISTORY_TYPE_RATE, rate);
 }
 
 /**
@@ -810,31 +3689,11 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 gboolean
 up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	if (history->priv->id == NULL)
-		return FALSE;
-	if (history->priv->state == UP_DEVICE_STATE_UNKNOWN)
-		return FALSE;
 	if (time_s < 0)
 		return FALSE;
-	if (history->priv->time_full_last == time_s)
-		return FALSE;
-
-	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_full, item);
-	up_history_schedule_save (history);
-
-	/* save last value */
-	history->priv->time_full_last = time_s;
-
-	return TRUE;
+	return up_history_record (history, UP_HISTORY_TYPE_TIME_FULL, (gdouble) time_s);
 }
 
 /**
@@ -843,31 +3702,44 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 gboolean
 up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	if (history->priv->id == NULL)
-		return FALSE;
-	if (history->priv->state == UP_DEVICE_STATE_UNKNOWN)
-		return FALSE;
 	if (time_s < 0)
 		return FALSE;
-	if (history->priv->time_empty_last == time_s)
-		return FALSE;
+	return up_history_record (history, UP_HISTORY_TYPE_TIME_EMPTY, (gdouble) time_s);
+}
 
-	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_empty, item);
-	up_history_schedule_save (history);
+/**
+ * up_history_set_voltage_data:
+ **/
+gboolean
+up_history_set_voltage_data (UpHistory *history, gdouble voltage)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	/* save last value */
-	history->priv->time_empty_last = time_s;
+	return up_history_record (history, UP_HISTORY_TYPE_VOLTAGE, voltage);
+}
 
-	return TRUE;
+/**
+ * up_history_set_temperature_data:
+ **/
+gboolean
+up_history_set_temperature_data (UpHistory *history, gdouble temperature)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	return up_history_record (history, UP_HISTORY_TYPE_TEMPERATURE, temperature);
+}
+
+/**
+ * up_history_set_energy_data:
+ **/
+gboolean
+up_history_set_energy_data (UpHistory *history, gdouble energy)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	return up_history_record (history, UP_HISTORY_TYPE_ENERGY, energy);
 }
 
 /**
@@ -902,12 +3774,18 @@ up_history_class_init (UpHistoryClass *klass)
 static void
 up_history_init (UpHistory *history)
 {
+	guint i;
+
 	history->priv = up_history_get_instance_private (history);
-	history->priv->data_rate = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_charge = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_full = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_empty = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
 	history->priv->max_data_age = UP_HISTORY_DEFAULT_MAX_DATA_AGE;
+	history->priv->persist_interval = UP_HISTORY_DEFAULT_PERSIST_INTERVAL;
+	history->priv->last_persist = g_get_monotonic_time ();
+	history->priv->profile.old_bin = G_MAXUINT;
+	history->priv->sessions = g_array_new (FALSE, FALSE, sizeof (UpHistorySession));
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		history->priv->files[i].legacy_files = g_ptr_array_new_with_free_func (g_free);
+	}
+	up_history_instances = g_list_prepend (up_history_instances, history);
 
 	if (g_getenv ("UPOWER_HISTORY_DIR"))
 		up_history_set_directory (history, g_getenv ("UPOWER_HISTORY_DIR"));
@@ -923,22 +3801,33 @@ static void
 up_history_finalize (GObject *object)
 {
 	UpHistory *history;
+	guint i, j;
 
 	g_return_if_fail (UP_IS_HISTORY (object));
 
 	history = UP_HISTORY (object);
 
 	/* save */
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
+	if (history->priv->writer != NULL)
+		up_history_writer_remove (history->priv->writer, history);
+	history->priv->closing = TRUE;
 	if (history->priv->id != NULL)
-		up_history_save_data (history);
+		up_history_persist_data (history);
+	g_clear_object (&history->priv->writer);
 
-	g_ptr_array_unref (history->priv->data_rate);
-	g_ptr_array_unref (history->priv->data_charge);
-	g_ptr_array_unref (history->priv->data_time_full);
-	g_ptr_array_unref (history->priv->data_time_empty);
+	for (i = 0; i < G_N_ELEMENTS (history->priv->series); i++) {
+		up_history_series_clear (&history->priv->series[i]);
+		for (j = 0; j < UP_HISTORY_ROLLUP_LAST; j++)
+			up_history_series_clear (&history->priv->rollups[i][j].series);
+	}
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		g_ptr_array_unref (history->priv->files[i].legacy_files);
+	}
+	g_array_unref (history->priv->sessions);
+	up_history_instances = g_list_remove (up_history_instances, history);
 
 	g_free (history->priv->id);
+	g_free (history->priv->staging_dir);
 	g_free (history->priv->dir);
 
 	g_return_if_fail (history->priv != NULL);
@@ -38,6 +38,7 @@ G_BEGIN_DECLS
 #define UP_HISTORY_TYPE_ERROR		(up_history_error_get_type ())
 
 typedef struct UpHistoryPrivate UpHistoryPrivate;
+struct _UpHistoryWriter;
 
 typedef struct
 {
@@ -55,22 +56,95 @@ typedef enum {
 	UP_HISTORY_TYPE_RATE,
 	UP_HISTORY_TYPE_TIME_FULL,
 	UP_HISTORY_TYPE_TIME_EMPTY,
+	UP_HISTORY_TYPE_VOLTAGE,
+	UP_HISTORY_TYPE_TEMPERATURE,
+	UP_HISTORY_TYPE_ENERGY,
 	UP_HISTORY_TYPE_UNKNOWN
 } UpHistoryType;
 
+typedef struct {
+	guint32			 time;
+	guint32			 state;		/* UpDeviceState */
+	gdouble			 value;
+} UpHistorySample;
+
+typedef enum {
+	UP_HISTORY_DOWNSAMPLE_AVERAGE,
+	UP_HISTORY_DOWNSAMPLE_LTTB,
+	UP_HISTORY_DOWNSAMPLE_MIN_MAX
+} UpHistoryDownsample;
+
+#define UP_HISTORY_PROFILE_BINS		101	/* one per percent */
+
+typedef struct {
+	gdouble			 value;
+	gdouble			 accuracy;
+} UpHistoryProfileStat;
+
+typedef struct {
+	guint32			 time;		/* start of the bucket */
+	guint32			 count;
+	gdouble			 min;
+	gdouble			 max;
+	gdouble			 mean;
+	guint32			 state;		/* UpDeviceState */
+} UpHistoryAggregate;
+
+typedef struct {
+	guint32			 start;		/* the first sample */
+	guint32			 end;		/* the last sample */
+	guint32			 state;		/* UpDeviceState */
+	gdouble			 start_charge;	/* percent */
+	gdouble			 end_charge;	/* percent */
+	gdouble			 energy;	/* change in Wh, 0 if unknown */
+} UpHistorySession;
+
+typedef struct {
+	const UpHistorySample	*segments[2];	/* oldest first */
+	guint			 lengths[2];
+	UpHistorySample		 pending;	/* newer than the segments */
+	gboolean		 has_pending;
+	gboolean		 reversed;
+	guint			 len;
+	gboolean		 reduced;	/* downsampled to fit the memory budget */
+	GArray			*downsampled;
+} UpHistoryView;
+
 
 GType		 up_history_get_type			(void);
 gboolean	 up_history_is_device_id_equal		(UpHistory *history,	 const gchar *id);
 UpHistory	*up_history_new				(void);
+UpHistoryType	 up_history_type_from_string		(const gchar		*type);
 
-GPtrArray	*up_history_get_data			(UpHistory		*history,
+GArray		*up_history_get_data			(UpHistory		*history,
 							 UpHistoryType		 type,
 							 guint			 timespan,
 							 guint			 resolution);
-GPtrArray	*up_history_get_profile_data		(UpHistory		*history,
-							 gboolean		 charging);
+GArray		*up_history_get_aggregated_data		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint32		 start,
+							 guint32		 end,
+							 guint			 n_buckets);
+GArray		*up_history_get_sessions		(UpHistory		*history,
+							 guint32		 since);
+gint		 up_history_export_fd			(UpHistory		*history,
+							 UpHistoryType		 type,
+							 GError			**error);
+gboolean	 up_history_get_view			(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan,
+							 guint			 resolution,
+							 UpHistoryDownsample	 downsample,
+							 UpHistoryView		*view);
+const UpHistorySample *up_history_view_get		(const UpHistoryView	*view,
+							 guint			 i);
+void		 up_history_view_clear			(UpHistoryView		*view);
+gboolean	 up_history_get_profile_data		(UpHistory		*history,
+							 gboolean		 charging,
+							 UpHistoryProfileStat	*stats);
 gboolean	 up_history_set_id			(UpHistory		*history,
 							 const gchar		*id);
+gboolean	 up_history_is_loading			(UpHistory		*history);
 gboolean	 up_history_set_state			(UpHistory		*history,
 							 UpDeviceState		 state);
 gboolean	 up_history_set_charge_data		(UpHistory		*history,
@@ -81,12 +155,33 @@ gboolean	 up_history_set_time_full_data		(UpHistory		*history,
 							 gint64			 time);
 gboolean	 up_history_set_time_empty_data		(UpHistory		*history,
 							 gint64			 time);
+gboolean	 up_history_set_voltage_data		(UpHistory		*history,
+							 gdouble		 voltage);
+gboolean	 up_history_set_temperature_data	(UpHistory		*history,
+							 gdouble		 temperature);
+gboolean	 up_history_set_energy_data		(UpHistory		*history,
+							 gdouble		 energy);
+void		 up_history_set_deadband		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 gdouble		 deadband);
+void		 up_history_set_keep_alive		(UpHistory		*history,
+							 guint			 keep_alive);
 void		 up_history_set_max_data_age		(UpHistory		*history,
 							 guint			 max_data_age);
 gboolean	 up_history_save_data			(UpHistory		*history);
+gboolean	 up_history_persist_data		(UpHistory		*history);
 
+const gchar	*up_history_get_directory		(UpHistory		*history);
+void		 up_history_set_writer			(UpHistory		*history,
+							 struct _UpHistoryWriter *writer);
 void		 up_history_set_directory		(UpHistory		*history,
 							 const gchar		*dir);
+void		 up_history_set_staging_directory	(UpHistory		*history,
+							 const gchar		*dir);
+void		 up_history_set_persist_interval	(UpHistory		*history,
+							 guint			 interval);
+gsize		 up_history_get_total_memory		(void);
+void		 up_history_set_memory_budget		(gsize			 budget);
 
 G_END_DECLS
 
@@ -0,0 +1,237 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "up-poll-queue.h"
+
+/*
+ * The devices to poll, ordered by when they are due in a binary min-heap,
+ * with a table from each device to its place in the heap so that a device
+ * can be moved when it is refreshed or its poll timeout changes. Finding
+ * the next device is then O(1) and moving one O(log n), rather than
+ * looking at all of them.
+ */
+
+typedef struct {
+	gpointer		 item;
+	gint64			 deadline;	/* monotonic */
+	gint			 timeout;	/* seconds */
+} UpPollQueueEntry;
+
+struct _UpPollQueue
+{
+	GArray			*heap;		/* of UpPollQueueEntry */
+	GHashTable		*positions;	/* item → index in heap + 1 */
+};
+
+/**
+ * up_poll_queue_set:
+ **/
+static void
+up_poll_queue_set (UpPollQueue *queue, guint i, const UpPollQueueEntry *entry)
+{
+	g_array_index (queue->heap, UpPollQueueEntry, i) = *entry;
+	g_hash_table_insert (queue->positions, entry->item, GUINT_TO_POINTER (i + 1));
+}
+
+/**
+ * up_poll_queue_sift:
+ *
+ * Moves the entry at @i up or down to where it belongs.
+ **/
+static void
+up_poll_queue_sift (UpPollQueue *queue, guint i)
+{
+	UpPollQueueEntry entry = g_array_index (queue->heap, UpPollQueueEntry, i);
+	guint len = queue->heap->len;
+
+	/* up */
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+		const UpPollQueueEntry *p = &g_array_index (queue->heap, UpPollQueueEntry, parent);
+
+		if (p->deadline <= entry.deadline)
+			break;
+		up_poll_queue_set (queue, i, p);
+		i = parent;
+	}
+
+	/* down */
+	while (2 * i + 1 < len) {
+		guint child = 2 * i + 1;
+		const UpPollQueueEntry *c;
+
+		if (child + 1 < len &&
+		    g_array_index (queue->heap, UpPollQueueEntry, child + 1).deadline <
+		    g_array_index (queue->heap, UpPollQueueEntry, child).deadline)
+			child++;
+		c = &g_array_index (queue->heap, UpPollQueueEntry, child);
+		if (entry.deadline <= c->deadline)
+			break;
+		up_poll_queue_set (queue, i, c);
+		i = child;
+	}
+	up_poll_queue_set (queue, i, &entry);
+}
+
+/**
+ * up_poll_queue_update:
+ * @deadline: when @item is due, in monotonic time
+ * @timeout: the poll timeout of @item in seconds, kept for the caller
+ *
+ * Adds @item, or moves it if it is already queued.
+ **/
+void
+up_poll_queue_update (UpPollQueue *queue, gpointer item, gint64 deadline, gint timeout)
+{
+	UpPollQueueEntry entry;
+	guint pos;
+
+	entry.item = item;
+	entry.deadline = deadline;
+	entry.timeout = timeout;
+
+	pos = GPOINTER_TO_UINT (g_hash_table_lookup (queue->positions, item));
+	if (pos == 0) {
+		g_array_append_val (queue->heap, entry);
+		pos = queue->heap->len;
+	} else {
+		g_array_index (queue->heap, UpPollQueueEntry, pos - 1) = entry;
+	}
+	up_poll_queue_sift (queue, pos - 1);
+}
+
+/**
+ * up_poll_queue_remove:
+ **/
+void
+up_poll_queue_remove (UpPollQueue *queue, gpointer item)
+{
+	guint pos;
+	guint last;
+
+	pos = GPOINTER_TO_UINT (g_hash_table_lookup (queue->positions, item));
+	if (pos == 0)
+		return;
+	g_hash_table_remove (queue->positions, item);
+
+	/* fill the hole with the last entry */
+	last = queue->heap->len - 1;
+	if (pos - 1 != last) {
+		g_array_index (queue->heap, UpPollQueueEntry, pos - 1) =
+			g_array_index (queue->heap, UpPollQueueEntry, last);
+		g_array_set_size (queue->heap, last);
+		up_poll_queue_sift (queue, pos - 1);
+	} else {
+		g_array_set_size (queue->heap, last);
+	}
+}
+
+/**
+ * up_poll_queue_clear:
+ **/
+void
+up_poll_queue_clear (UpPollQueue *queue)
+{
+	g_array_set_size (queue->heap, 0);
+	g_hash_table_remove_all (queue->positions);
+}
+
+/**
+ * up_poll_queue_get_length:
+ **/
+guint
+up_poll_queue_get_length (UpPollQueue *queue)
+{
+	return queue->heap->len;
+}
+
+/**
+ * up_poll_queue_peek:
+ * @deadline: (out) (optional): when the item is due
+ * @timeout: (out) (optional): the poll timeout it was queued with
+ *
+ * Return value: the item that is due first, or %NULL if there is none
+ **/
+gpointer
+up_poll_queue_peek (UpPollQueue *queue, gint64 *deadline, gint *timeout)
+{
+	const UpPollQueueEntry *entry;
+
+	if (queue->heap->len == 0)
+		return NULL;
+	entry = &g_array_index (queue->heap, UpPollQueueEntry, 0);
+	if (deadline != NULL)
+		*deadline = entry->deadline;
+	if (timeout != NULL)
+		*timeout = entry->timeout;
+	return entry->item;
+}
+
+/**
+ * up_poll_queue_align:
+ * @deadline: when something is due, in monotonic time
+ * @tick: the interval to align to, or 0 to not align
+ * @slack: how much earlier than @deadline it may happen
+ *
+ * Moves @deadline onto a multiple of @tick, so that everything aligned
+ * to the same tick wakes up together, both here and in other processes
+ * doing the same. That is the last tick before @deadline if it is
+ * within @slack, and otherwise the first one after it.
+ *
+ * Return value: the aligned deadline
+ **/
+gint64
+up_poll_queue_align (gint64 deadline, gint64 tick, gint64 slack)
+{
+	gint64 before;
+
+	if (tick <= 0 || deadline < 0)
+		return deadline;
+	before = deadline - deadline % tick;
+	if (deadline - before <= slack)
+		return before;
+	return before + tick;
+}
+
+/**
+ * up_poll_queue_free:
+ **/
+void
+up_poll_queue_free (UpPollQueue *queue)
+{
+	g_array_unref (queue->heap);
+	g_hash_table_unref (queue->positions);
+	g_free (queue);
+}
+
+/**
+ * up_poll_queue_new:
+ **/
+UpPollQueue *
+up_poll_queue_new (void)
+{
+	UpPollQueue *queue = g_new0 (UpPollQueue, 1);
+
+	queue->heap = g_array_new (FALSE, FALSE, sizeof (UpPollQueueEntry));
+	queue->positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+	return queue;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2026 The UPower developers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __UP_POLL_QUEUE_H
+#define __UP_POLL_QUEUE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _UpPollQueue UpPollQueue;
+
+UpPollQueue	*up_poll_queue_new		(void);
+void		 up_poll_queue_free		(UpPollQueue	*queue);
+void		 up_poll_queue_update		(UpPollQueue	*queue,
+						 gpointer	 item,
+						 gint64		 deadline,
+						 gint		 timeout);
+void		 up_poll_queue_remove		(UpPollQueue	*queue,
+						 gpointer	 item);
+void		 up_poll_queue_clear		(UpPollQueue	*queue);
+guint		 up_poll_queue_get_length	(UpPollQueue	*queue);
+gpointer	 up_poll_queue_peek		(UpPollQueue	*queue,
+						 gint64		*deadline,
+						 gint		*timeout);
+gint64		 up_poll_queue_align		(gint64		 deadline,
+						 gint64		 tick,
+						 gint64		 slack);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(UpPollQueue, up_poll_queue_free)
+
+G_END_DECLS
+
+#endif /* __UP_POLL_QUEUE_H */
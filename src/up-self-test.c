@@ -23,17 +23,22 @@
 
 #include <glib-object.h>
 #include <glib/gstdio.h>
-#include <up-history-item.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include "up-backend.h"
+#include "up-constants.h"
 #include "up-daemon.h"
 #include "up-device.h"
+#include "up-device-battery.h"
 #include "up-device-list.h"
+#include "up-event-log.h"
 #include "up-history.h"
+#include "up-history-writer.h"
 #include "up-native.h"
 #include "up-polkit.h"
+#include "up-poll-queue.h"
 
 gchar *history_dir = NULL;
 
@@ -90,6 +95,169 @@ up_test_device_func (void)
 	g_object_unref (device);
 }
 
+/* a device that takes its data the way the blocking backends do */
+#define UP_TYPE_TEST_DEVICE (up_test_device_get_type ())
+G_DECLARE_FINAL_TYPE (UpTestDevice, up_test_device, UP, TEST_DEVICE, UpDevice)
+
+struct _UpTestDevice
+{
+	UpDevice		 parent_instance;
+	GThread			*collect_thread;
+	gint			 collected;
+	guint			 applied;
+	gboolean		 fail;
+};
+
+G_DEFINE_TYPE (UpTestDevice, up_test_device, UP_TYPE_DEVICE)
+
+static gpointer
+up_test_device_refresh_collect (UpDevice *device, UpRefreshReason reason)
+{
+	UpTestDevice *self = UP_TEST_DEVICE (device);
+
+	self->collect_thread = g_thread_self ();
+	g_atomic_int_inc (&self->collected);
+	return GUINT_TO_POINTER (reason + 1);
+}
+
+static gboolean
+up_test_device_refresh_apply (UpDevice *device, UpRefreshReason reason, gpointer data)
+{
+	UpTestDevice *self = UP_TEST_DEVICE (device);
+
+	g_assert_cmpuint (GPOINTER_TO_UINT (data), ==, reason + 1);
+	self->applied++;
+	if (self->fail) {
+		up_device_refresh_failed (device);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+up_test_device_init (UpTestDevice *self)
+{
+}
+
+static void
+up_test_device_class_init (UpTestDeviceClass *klass)
+{
+	UpDeviceClass *device_class = UP_DEVICE_CLASS (klass);
+
+	device_class->refresh_collect = up_test_device_refresh_collect;
+	device_class->refresh_apply = up_test_device_refresh_apply;
+}
+
+static void
+up_test_device_refresh_func (void)
+{
+	UpTestDevice *device;
+	GObject *native;
+
+	native = g_object_new (G_TYPE_OBJECT, NULL);
+	device = g_object_new (UP_TYPE_TEST_DEVICE, "native", native, NULL);
+
+	/* the initial refresh is done straight away */
+	g_assert_cmpint (up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_INIT), ==, UP_REFRESH_RESULT_CHANGED);
+	g_assert_cmpuint (device->applied, ==, 1);
+	g_assert (device->collect_thread == g_thread_self ());
+
+	/* later ones are collected on a worker and applied here, with one
+	 * in flight at a time */
+	g_assert_cmpint (up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_POLL), ==, UP_REFRESH_RESULT_QUEUED);
+	g_assert_cmpint (up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_POLL), ==, UP_REFRESH_RESULT_QUEUED);
+	while (device->applied < 2)
+		g_main_context_iteration (NULL, TRUE);
+	g_assert (device->collect_thread != g_thread_self ());
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert_cmpint (g_atomic_int_get (&device->collected), ==, 2);
+	g_assert_cmpuint (device->applied, ==, 2);
+
+	/* and then there is room for the next */
+	g_assert_cmpint (up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_EVENT), ==, UP_REFRESH_RESULT_QUEUED);
+	while (device->applied < 3)
+		g_main_context_iteration (NULL, TRUE);
+
+	/* nothing is applied once shutting down */
+	g_assert_cmpint (up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_POLL), ==, UP_REFRESH_RESULT_QUEUED);
+	up_device_refresh_shutdown ();
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert_cmpint (g_atomic_int_get (&device->collected), ==, 4);
+	g_assert_cmpuint (device->applied, ==, 3);
+
+	g_object_unref (device);
+	g_object_unref (native);
+}
+
+/**
+ * up_test_device_refresh_wait:
+ *
+ * Return value: the poll timeout after the refresh
+ **/
+static gint
+up_test_device_refresh_wait (UpTestDevice *device)
+{
+	guint applied = device->applied;
+	gint timeout;
+
+	up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_POLL);
+	while (device->applied == applied)
+		g_main_context_iteration (NULL, TRUE);
+	g_object_get (device, "poll-timeout", &timeout, NULL);
+	return timeout;
+}
+
+static void
+up_test_device_backoff_func (void)
+{
+	UpTestDevice *device;
+	GObject *native;
+	guint failures;
+	gint timeout = 0;
+	guint i;
+
+	native = g_object_new (G_TYPE_OBJECT, NULL);
+	device = g_object_new (UP_TYPE_TEST_DEVICE, "native", native, NULL);
+	g_object_set (device, "poll-timeout", 5, NULL);
+
+	/* a couple of failures are let go */
+	device->fail = TRUE;
+	g_assert_cmpint (up_test_device_refresh_wait (device), ==, 5);
+	g_assert_cmpint (up_test_device_refresh_wait (device), ==, 5);
+	g_assert_cmpint (up_device_get_circuit (UP_DEVICE (device), &failures), ==, UP_DEVICE_CIRCUIT_CLOSED);
+	g_assert_cmpuint (failures, ==, 2);
+
+	/* then it backs off, give or take some jitter */
+	timeout = up_test_device_refresh_wait (device);
+	g_assert_cmpint (up_device_get_circuit (UP_DEVICE (device), NULL), ==, UP_DEVICE_CIRCUIT_OPEN);
+	g_assert_cmpint (timeout, >=, 8);
+	g_assert_cmpint (timeout, <=, 12);
+	timeout = up_test_device_refresh_wait (device);
+	g_assert_cmpint (timeout, >=, 16);
+	g_assert_cmpint (timeout, <=, 24);
+
+	/* trying again while backing off */
+	up_device_refresh_internal (UP_DEVICE (device), UP_REFRESH_POLL);
+	g_assert_cmpint (up_device_get_circuit (UP_DEVICE (device), NULL), ==, UP_DEVICE_CIRCUIT_HALF_OPEN);
+	while (device->applied < 5)
+		g_main_context_iteration (NULL, TRUE);
+
+	/* but not for too long */
+	for (i = 0; i < 10; i++)
+		timeout = up_test_device_refresh_wait (device);
+	g_assert_cmpint (timeout, <=, 300);
+	g_assert_cmpint (timeout, >=, 240);
+
+	/* and is back to normal as soon as it works */
+	device->fail = FALSE;
+	g_assert_cmpint (up_test_device_refresh_wait (device), ==, 5);
+	g_assert_cmpint (up_device_get_circuit (UP_DEVICE (device), &failures), ==, UP_DEVICE_CIRCUIT_CLOSED);
+	g_assert_cmpuint (failures, ==, 0);
+
+	g_object_unref (device);
+	g_object_unref (native);
+}
+
 static void
 up_test_device_list_func (void)
 {
@@ -124,21 +292,355 @@ up_test_device_list_func (void)
 }
 
 static void
-up_test_history_remove_temp_files (void)
+up_test_poll_queue_func (void)
+{
+	UpPollQueue *queue;
+	gint items[64];
+	gint64 deadline = 0;
+	gint64 last;
+	gint timeout = 0;
+	gint i;
+
+	queue = up_poll_queue_new ();
+	g_assert (up_poll_queue_peek (queue, NULL, NULL) == NULL);
+
+	/* due in a scrambled order */
+	for (i = 0; i < 64; i++)
+		up_poll_queue_update (queue, &items[i], (i * 37) % 64, i);
+	g_assert_cmpint (up_poll_queue_get_length (queue), ==, 64);
+	g_assert (up_poll_queue_peek (queue, &deadline, &timeout) == &items[0]);
+	g_assert_cmpint (deadline, ==, 0);
+	g_assert_cmpint (timeout, ==, 0);
+
+	/* moved, not added twice */
+	up_poll_queue_update (queue, &items[0], 1000, 5);
+	up_poll_queue_update (queue, &items[5], -1, 6);
+	g_assert_cmpint (up_poll_queue_get_length (queue), ==, 64);
+	g_assert (up_poll_queue_peek (queue, &deadline, &timeout) == &items[5]);
+	g_assert_cmpint (deadline, ==, -1);
+	g_assert_cmpint (timeout, ==, 6);
+
+	/* removed from the head and from the middle */
+	up_poll_queue_remove (queue, &items[5]);
+	up_poll_queue_remove (queue, &items[33]);
+	up_poll_queue_remove (queue, &items[33]);
+	g_assert_cmpint (up_poll_queue_get_length (queue), ==, 62);
+
+	/* everything else comes out earliest first */
+	last = G_MININT64;
+	while (up_poll_queue_peek (queue, &deadline, NULL) != NULL) {
+		gpointer item = up_poll_queue_peek (queue, NULL, NULL);
+
+		g_assert_cmpint (deadline, >=, last);
+		g_assert (item != &items[5] && item != &items[33]);
+		last = deadline;
+		up_poll_queue_remove (queue, item);
+	}
+	g_assert_cmpint (last, ==, 1000);
+
+	up_poll_queue_update (queue, &items[1], 1, 1);
+	up_poll_queue_clear (queue);
+	g_assert_cmpint (up_poll_queue_get_length (queue), ==, 0);
+	up_poll_queue_free (queue);
+}
+
+/**
+ * up_test_poll_wakeups:
+ *
+ * Polls devices with @timeouts for an hour the way the daemon does.
+ *
+ * Return value: the number of times it had to wake up
+ **/
+static guint
+up_test_poll_wakeups (const gint *timeouts, guint n_timeouts, gint64 tick, gint64 slack)
+{
+	UpPollQueue *queue;
+	gint items[8];
+	gint64 deadline;
+	gint timeout;
+	guint wakeups = 0;
+	guint i;
+
+	g_assert_cmpint (n_timeouts, <=, G_N_ELEMENTS (items));
+
+	/* found at different times */
+	queue = up_poll_queue_new ();
+	for (i = 0; i < n_timeouts; i++) {
+		gint64 found = (i * 7 + 1) * G_USEC_PER_SEC + i * 300000;
+		up_poll_queue_update (queue, &items[i],
+				      up_poll_queue_align (found + timeouts[i] * G_USEC_PER_SEC, tick,
+							   MIN (slack, timeouts[i] * G_USEC_PER_SEC / 2)),
+				      timeouts[i]);
+	}
+
+	while (up_poll_queue_peek (queue, &deadline, NULL) != NULL &&
+	       deadline < (gint64) 3600 * G_USEC_PER_SEC) {
+		gint64 now = deadline;
+		gpointer item;
+
+		wakeups++;
+		if (tick > 0)
+			g_assert_cmpint (now % tick, ==, 0);
+		while ((item = up_poll_queue_peek (queue, &deadline, &timeout)) != NULL &&
+		       deadline <= now) {
+			gint64 poll_time = now + timeout * G_USEC_PER_SEC;
+			gint64 max_slack = MIN (slack, timeout * G_USEC_PER_SEC / 2);
+			gint64 aligned = up_poll_queue_align (poll_time, tick, max_slack);
+
+			/* early by no more than the slack, late by less than a tick */
+			g_assert_cmpint (aligned, >=, poll_time - max_slack);
+			g_assert_cmpint (aligned, <=, poll_time + MAX (tick - 1, 0));
+			up_poll_queue_update (queue, item, aligned, timeout);
+		}
+	}
+	up_poll_queue_free (queue);
+	return wakeups;
+}
+
+static void
+up_test_poll_align_func (void)
+{
+	const gint timeouts[] = { 30, 45, 60, 120 };
+	guint unaligned;
+	guint aligned;
+
+	/* to the tick before if within the slack, otherwise the one after */
+	g_assert_cmpint (up_poll_queue_align (100, 30, 10), ==, 90);
+	g_assert_cmpint (up_poll_queue_align (100, 30, 5), ==, 120);
+	g_assert_cmpint (up_poll_queue_align (90, 30, 0), ==, 90);
+	g_assert_cmpint (up_poll_queue_align (100, 0, 10), ==, 100);
+
+	/* far fewer wakeups per hour when lined up */
+	unaligned = up_test_poll_wakeups (timeouts, G_N_ELEMENTS (timeouts), 0, 0);
+	aligned = up_test_poll_wakeups (timeouts, G_N_ELEMENTS (timeouts),
+					30 * G_USEC_PER_SEC, 10 * G_USEC_PER_SEC);
+	g_debug ("%u wakeups per hour, %u aligned", unaligned, aligned);
+	g_assert_cmpint (unaligned, >, 250);
+	g_assert_cmpint (aligned, <=, 120);
+}
+
+/**
+ * up_test_battery_discharge:
+ *
+ * Polls a battery discharging at @rate from full to empty, and checks
+ * that every threshold is noticed soon enough after it is crossed.
+ *
+ * Return value: the number of polls
+ **/
+static guint
+up_test_battery_discharge (gdouble rate)
+{
+	const gdouble thresholds[] = { 10.0, 5.0, 2.0 };
+	const gdouble energy_full = 50.0;
+	gdouble percent_per_second = rate / energy_full * 100.0 / SECONDS_PER_HOUR;
+	gboolean noticed[G_N_ELEMENTS (thresholds)] = { FALSE, };
+	gdouble now = 0.0;
+	guint polls = 0;
+	guint i;
+
+	for (;;) {
+		gdouble percentage = 100.0 - percent_per_second * now;
+		gint timeout;
+
+		if (percentage <= 0.0)
+			break;
+		for (i = 0; i < G_N_ELEMENTS (thresholds); i++) {
+			gdouble crossed = (100.0 - thresholds[i]) / percent_per_second;
+			if (noticed[i] || percentage > thresholds[i])
+				continue;
+			g_assert_cmpfloat (now - crossed, <=, UP_DAEMON_ESTIMATE_TIMEOUT);
+			noticed[i] = TRUE;
+		}
+
+		timeout = up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_DISCHARGING,
+								  percentage, energy_full, rate,
+								  thresholds, G_N_ELEMENTS (thresholds));
+		g_assert_cmpint (timeout, >=, UP_DAEMON_ESTIMATE_TIMEOUT);
+		g_assert_cmpint (timeout, <=, UP_DAEMON_LONG_TIMEOUT);
+		now += timeout;
+		polls++;
+	}
+	for (i = 0; i < G_N_ELEMENTS (thresholds); i++)
+		g_assert (noticed[i]);
+	return polls;
+}
+
+static void
+up_test_battery_poll_func (void)
 {
+	const gdouble thresholds[] = { 10.0, 5.0, 2.0 };
+	gdouble hours;
+	guint polls;
+	gint timeout;
+
+	/* nothing to predict from */
+	g_assert_cmpint (up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_FULLY_CHARGED,
+								 100.0, 50.0, 0.0, NULL, 0),
+			 ==, UP_DAEMON_SHORT_TIMEOUT);
+	g_assert_cmpint (up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_DISCHARGING,
+								 50.0, 50.0, 0.0, NULL, 0),
+			 ==, UP_DAEMON_SHORT_TIMEOUT);
+
+	/* slowly draining and far from any threshold */
+	timeout = up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_DISCHARGING,
+							  95.0, 50.0, 3.0,
+							  thresholds, G_N_ELEMENTS (thresholds));
+	g_assert_cmpint (timeout, ==, UP_DAEMON_LONG_TIMEOUT);
+
+	/* but not about to cross one */
+	timeout = up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_DISCHARGING,
+							  5.2, 50.0, 3.0,
+							  thresholds, G_N_ELEMENTS (thresholds));
+	g_assert_cmpint (timeout, <, UP_DAEMON_LONG_TIMEOUT);
+	timeout = up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_DISCHARGING,
+							  5.01, 50.0, 3.0,
+							  thresholds, G_N_ELEMENTS (thresholds));
+	g_assert_cmpint (timeout, ==, UP_DAEMON_ESTIMATE_TIMEOUT);
+
+	/* nearly full */
+	timeout = up_device_battery_compute_poll_timeout (UP_DEVICE_STATE_CHARGING,
+							  99.9, 50.0, 20.0, NULL, 0);
+	g_assert_cmpint (timeout, ==, UP_DAEMON_ESTIMATE_TIMEOUT);
+
+	/* fewer polls than a fixed UP_DAEMON_SHORT_TIMEOUT over a whole discharge */
+	hours = 50.0 / 3.0;
+	polls = up_test_battery_discharge (3.0);
+	g_assert_cmpint (polls, <, hours * SECONDS_PER_HOUR / UP_DAEMON_SHORT_TIMEOUT / 2);
+	hours = 50.0 / 10.0;
+	polls = up_test_battery_discharge (10.0);
+	g_assert_cmpint (polls, <, hours * SECONDS_PER_HOUR / UP_DAEMON_SHORT_TIMEOUT);
+	up_test_battery_discharge (30.0);
+}
+
+static void
+up_test_event_log_func (void)
+{
+	UpEventLog *log;
+	GArray *events;
+	gchar *dir;
 	gchar *filename;
-	filename = g_build_filename (history_dir, "history-time-full-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-time-empty-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-rate-test.dat", NULL);
+	gint i;
+
+	dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (dir, "events.bin", NULL);
+
+	/* the oldest events are overwritten */
+	log = up_event_log_new (4);
+	g_assert (up_event_log_open (log, filename, NULL));
+	for (i = 0; i < 6; i++)
+		up_event_log_add (log, UP_EVENT_TYPE_STATE, "BAT0", i);
+	events = up_event_log_get_range (log, 0, 0);
+	g_assert_cmpint (events->len, ==, 4);
+	for (i = 0; i < 4; i++) {
+		g_assert_cmpint (g_array_index (events, UpEvent, i).value, ==, i + 2);
+		g_assert_cmpint (g_array_index (events, UpEvent, i).type, ==, UP_EVENT_TYPE_STATE);
+	}
+	g_array_unref (events);
+
+	/* filtered by time */
+	events = up_event_log_get_range (log, g_get_real_time () / G_USEC_PER_SEC + 10, 0);
+	g_assert_cmpint (events->len, ==, 0);
+	g_array_unref (events);
+	events = up_event_log_get_range (log, 0, 1);
+	g_assert_cmpint (events->len, ==, 0);
+	g_array_unref (events);
+	g_object_unref (log);
+
+	/* kept across restarts, and continued */
+	log = up_event_log_new (4);
+	g_assert (up_event_log_open (log, filename, NULL));
+	up_event_log_add (log, UP_EVENT_TYPE_CRITICAL_ACTION, "a-very-long-action-name", 0);
+	events = up_event_log_get_range (log, 0, 0);
+	g_assert_cmpint (events->len, ==, 4);
+	g_assert_cmpint (g_array_index (events, UpEvent, 0).value, ==, 3);
+	g_assert_cmpint (g_array_index (events, UpEvent, 3).type, ==, UP_EVENT_TYPE_CRITICAL_ACTION);
+	g_assert (strncmp (g_array_index (events, UpEvent, 3).subject, "a-very-long-acti",
+			   UP_EVENT_SUBJECT_SIZE) == 0);
+	g_array_unref (events);
+	g_object_unref (log);
+
+	/* but not into a ring of another size */
+	log = up_event_log_new (8);
+	g_assert (up_event_log_open (log, filename, NULL));
+	events = up_event_log_get_range (log, 0, 0);
+	g_assert_cmpint (events->len, ==, 0);
+	g_array_unref (events);
+	g_object_unref (log);
+
 	g_unlink (filename);
+	rmdir (dir);
 	g_free (filename);
+	g_free (dir);
+}
+
+static void
+up_test_history_remove_temp_files (void)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (history_dir, 0, NULL);
+	if (dir == NULL)
+		return;
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *filename;
+
+		if (!g_str_has_prefix (name, "history-"))
+			continue;
+		filename = g_build_filename (history_dir, name, NULL);
+		g_unlink (filename);
+		g_free (filename);
+	}
+	g_dir_close (dir);
+}
+
+static void
+up_test_history_wait_loaded (UpHistory *history)
+{
+	while (up_history_is_loading (history))
+		g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+up_test_history_load_func (void)
+{
+	UpHistory *history;
+	GArray *array;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_save_data (history);
+	g_object_unref (history);
+
+	/* samples added while loading go after the loaded ones */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	g_assert (up_history_is_loading (history));
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 49);
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
+	g_assert_cmpint (array->len, ==, 4);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 0).value, ==, 49);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 1).state, ==, UP_DEVICE_STATE_UNKNOWN);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 2).value, ==, 50);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 3).state, ==, UP_DEVICE_STATE_UNKNOWN);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
 }
 
 static void
@@ -146,9 +648,9 @@ up_test_history_func (void)
 {
 	UpHistory *history;
 	gboolean ret;
-	GPtrArray *array;
+	GArray *array;
 	gchar *filename;
-	UpHistoryItem *item, *item2, *item3;
+	UpHistorySample *item, *item2, *item3;
 
 	history = up_history_new ();
 	g_assert (history != NULL);
@@ -164,13 +666,15 @@ up_test_history_func (void)
 
 	/* setup fresh environment */
 	ret = up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
 	g_assert (ret);
 
-	/* get nonexistent data */
+	/* get nonexistent data, there is only the marker */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 0);
-	g_ptr_array_unref (array);
+	g_assert_cmpint (array->len, ==, 1);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 0).state, ==, UP_DEVICE_STATE_UNKNOWN);
+	g_array_unref (array);
 
 	/* setup some fake device and three data points */
 	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
@@ -194,45 +698,50 @@ up_test_history_func (void)
 	/* get data for last 10 seconds */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 3);
+	g_assert_cmpint (array->len, ==, 4);
 
 	/* get the first item, which should be the most recent */
-	item = g_ptr_array_index (array, 0);
+	item = &g_array_index (array, UpHistorySample, 0);
 	g_assert (item != NULL);
-	g_assert_cmpint (up_history_item_get_value (item), ==, 95);
-	g_assert_cmpint (up_history_item_get_time (item), >, 1000000);
+	g_assert_cmpint (item->value, ==, 95);
+	g_assert_cmpint (item->time, >, 1000000);
 
         /* the second one ought to be older */
-	item2 = g_ptr_array_index (array, 1);
+	item2 = &g_array_index (array, UpHistorySample, 1);
 	g_assert (item2 != NULL);
-	g_assert_cmpint (up_history_item_get_value (item2), ==, 90);
-	g_assert_cmpint (up_history_item_get_time (item2), <, up_history_item_get_time (item));
+	g_assert_cmpint (item2->value, ==, 90);
+	g_assert_cmpint (item2->time, <, item->time);
 
         /* third one is the oldest */
-	item3 = g_ptr_array_index (array, 2);
+	item3 = &g_array_index (array, UpHistorySample, 2);
 	g_assert (item3 != NULL);
-	g_assert_cmpint (up_history_item_get_value (item3), ==, 85);
-	g_assert_cmpint (up_history_item_get_time (item3), <, up_history_item_get_time (item2));
+	g_assert_cmpint (item3->value, ==, 85);
+	g_assert_cmpint (item3->time, <, item2->time);
+
+	/* and the marker from loading is last */
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 3).state, ==, UP_DEVICE_STATE_UNKNOWN);
 
-	g_ptr_array_unref (array);
+	g_array_unref (array);
 
         /* request fewer items than we have in our history; should have the
          * same order: first one is the most recent, and the data gets
          * interpolated */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 2);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpint (array->len, ==, 3);
 
-	item = g_ptr_array_index (array, 0);
+	item = &g_array_index (array, UpHistorySample, 0);
 	g_assert (item != NULL);
-	item2 = g_ptr_array_index (array, 1);
+	item2 = &g_array_index (array, UpHistorySample, 1);
 	g_assert (item2 != NULL);
 
-	g_assert_cmpint (up_history_item_get_time (item), >, 1000000);
-	g_assert_cmpint (up_history_item_get_value (item), ==, 95);
-	g_assert_cmpint (up_history_item_get_value (item2), ==, 87);
+	g_assert_cmpint (item->time, >, 1000000);
+	g_assert_cmpint (item->value, ==, 95);
+	g_assert_cmpint (item2->value, ==, 87);
+	item3 = &g_array_index (array, UpHistorySample, 2);
+	g_assert_cmpint (item3->state, ==, UP_DEVICE_STATE_UNKNOWN);
 
-	g_ptr_array_unref (array);
+	g_array_unref (array);
 
 	/* force a save to disk */
 	ret = up_history_save_data (history);
@@ -240,7 +749,7 @@ up_test_history_func (void)
 	g_object_unref (history);
 
 	/* ensure the file was created */
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
 	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
 	g_free (filename);
 
@@ -248,30 +757,32 @@ up_test_history_func (void)
 	history = up_history_new ();
 	up_history_set_directory (history, history_dir);
 	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
 
 	/* get data for last 10 seconds */
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 4); /* we have inserted an unknown as the first entry */
-	item = g_ptr_array_index (array, 1);
+	g_assert_cmpint (array->len, ==, 5); /* we have inserted an unknown as the first entry */
+	item = &g_array_index (array, UpHistorySample, 1);
 	g_assert (item != NULL);
-	g_assert_cmpint (up_history_item_get_value (item), ==, 95);
-	g_assert_cmpint (up_history_item_get_time (item), >, 1000000);
-	g_ptr_array_unref (array);
+	g_assert_cmpint (item->value, ==, 95);
+	g_assert_cmpint (item->time, >, 1000000);
+	g_array_unref (array);
 
 	/* ensure old entries are purged */
 	up_history_set_max_data_age (history, 2);
 	g_usleep (1100 * G_USEC_PER_SEC / 1000);
 	g_object_unref (history);
 
-	/* ensure only 2 points are returned */
+	/* ensure only 3 points are returned */
 	history = up_history_new ();
 	up_history_set_directory (history, history_dir);
 	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
 	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
 	g_assert (array != NULL);
-	g_assert_cmpint (array->len, ==, 2);
-	g_ptr_array_unref (array);
+	g_assert_cmpint (array->len, ==, 3);
+	g_array_unref (array);
 
 	/* unref */
 	g_object_unref (history);
@@ -281,6 +792,887 @@ up_test_history_func (void)
 	rmdir (history_dir);
 }
 
+static void
+up_test_history_metrics_func (void)
+{
+	UpHistory *history;
+	GArray *array;
+	gchar *filename;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_voltage_data (history, 12.5);
+	up_history_set_temperature_data (history, 30);
+	g_assert (up_history_save_data (history));
+	g_object_unref (history);
+
+	/* all the metrics share a single file */
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-voltage-test.bin", NULL);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_VOLTAGE, 10, 100);
+	g_assert_cmpint (array->len, ==, 3);
+	g_assert_cmpfloat (g_array_index (array, UpHistorySample, 1).value, ==, 12.5);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 1).state, ==, UP_DEVICE_STATE_DISCHARGING);
+	g_array_unref (array);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_TEMPERATURE, 10, 100);
+	g_assert_cmpint (array->len, ==, 3);
+	g_assert_cmpfloat (g_array_index (array, UpHistorySample, 1).value, ==, 30);
+	g_array_unref (array);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_ENERGY, 10, 100);
+	g_assert_cmpint (array->len, ==, 2);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_deadband_func (void)
+{
+	UpHistory *history;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+
+	/* every change is recorded by default */
+	g_assert (up_history_set_rate_data (history, 10.0));
+	g_assert (up_history_set_rate_data (history, 10.01));
+	g_assert (!up_history_set_rate_data (history, 10.01));
+
+	/* jitter is dropped, but not a slow drift */
+	up_history_set_deadband (history, UP_HISTORY_TYPE_RATE, 0.1);
+	g_assert (!up_history_set_rate_data (history, 10.06));
+	g_assert (!up_history_set_rate_data (history, 9.95));
+	g_assert (!up_history_set_rate_data (history, 10.1));
+	g_assert (up_history_set_rate_data (history, 10.12));
+
+	/* other series are not affected */
+	g_assert (up_history_set_charge_data (history, 50));
+	g_assert (up_history_set_charge_data (history, 50.01));
+
+	/* a steady value is recorded again once it gets old */
+	up_history_set_keep_alive (history, 2);
+	g_assert (!up_history_set_rate_data (history, 10.12));
+	g_usleep (2 * G_USEC_PER_SEC);
+	g_assert (up_history_set_rate_data (history, 10.12));
+	g_assert (!up_history_set_rate_data (history, 10.12));
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_aggregated_func (void)
+{
+	UpHistory *history;
+	UpHistoryAggregate *bucket;
+	GArray *array;
+	gchar *filename;
+	gchar *data;
+	gint64 start;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	start = g_get_real_time () / G_USEC_PER_SEC - 1000;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t10.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t20.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t30.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t60.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t50.000\tcharging\n",
+				start, start + 10, start + 15, start + 30, start + 35);
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	g_assert (g_file_set_contents (filename, data, -1, NULL));
+	g_free (filename);
+	g_free (data);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* nothing to summarize */
+	g_assert (up_history_get_aggregated_data (history, UP_HISTORY_TYPE_RATE, start, start + 40, 4) == NULL);
+	g_assert (up_history_get_aggregated_data (history, UP_HISTORY_TYPE_CHARGE, start, start, 4) == NULL);
+
+	array = up_history_get_aggregated_data (history, UP_HISTORY_TYPE_CHARGE, start, start + 40, 4);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 4);
+	bucket = &g_array_index (array, UpHistoryAggregate, 0);
+	g_assert_cmpint (bucket->time, ==, start);
+	g_assert_cmpint (bucket->count, ==, 1);
+	g_assert_cmpfloat (bucket->mean, ==, 10);
+	g_assert_cmpint (bucket->state, ==, UP_DEVICE_STATE_DISCHARGING);
+	bucket = &g_array_index (array, UpHistoryAggregate, 1);
+	g_assert_cmpint (bucket->time, ==, start + 10);
+	g_assert_cmpint (bucket->count, ==, 2);
+	g_assert_cmpfloat (bucket->min, ==, 20);
+	g_assert_cmpfloat (bucket->max, ==, 30);
+	g_assert_cmpfloat (bucket->mean, ==, 25);
+	g_assert_cmpint (bucket->state, ==, UP_DEVICE_STATE_CHARGING);
+	bucket = &g_array_index (array, UpHistoryAggregate, 2);
+	g_assert_cmpint (bucket->count, ==, 0);
+	bucket = &g_array_index (array, UpHistoryAggregate, 3);
+	g_assert_cmpint (bucket->count, ==, 2);
+	g_assert_cmpfloat (bucket->min, ==, 50);
+	g_assert_cmpfloat (bucket->max, ==, 60);
+	g_assert_cmpfloat (bucket->mean, ==, 55);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_export_func (void)
+{
+	UpHistory *history;
+	GArray *array;
+	guint8 header[16];
+	guint8 record[16];
+	guint32 value32;
+	gdouble value;
+	gint fd;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_charge_data (history, 49);
+
+	/* the same samples as the whole history over the bus */
+	fd = up_history_export_fd (history, UP_HISTORY_TYPE_CHARGE, NULL);
+	g_assert_cmpint (fd, >=, 0);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 0);
+	g_assert (array != NULL);
+	g_assert_cmpint (read (fd, header, sizeof (header)), ==, sizeof (header));
+	g_assert (memcmp (header, "UPHX", 4) == 0);
+	memcpy (&value32, header + 4, 4);
+	g_assert_cmpint (GUINT32_FROM_LE (value32), ==, 1);
+	memcpy (&value32, header + 8, 4);
+	g_assert_cmpint (GUINT32_FROM_LE (value32), ==, array->len);
+	g_assert_cmpint (lseek (fd, 16 * (array->len - 1), SEEK_CUR), >, 0);
+	g_assert_cmpint (read (fd, record, sizeof (record)), ==, sizeof (record));
+	memcpy (&value32, record + 4, 4);
+	g_assert_cmpint (GUINT32_FROM_LE (value32), ==, UP_DEVICE_STATE_DISCHARGING);
+	memcpy (&value, record + 8, 8);
+	g_assert_cmpfloat (value, ==, 49);
+	g_assert_cmpint (read (fd, record, sizeof (record)), ==, 0);
+	g_array_unref (array);
+	close (fd);
+
+	g_assert_cmpint (up_history_export_fd (history, UP_HISTORY_TYPE_UNKNOWN, NULL), ==, -1);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static guint
+up_test_history_count_value (UpHistory *history, gdouble value)
+{
+	g_autoptr(GArray) array = NULL;
+	guint count = 0;
+	guint i;
+
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 0);
+	for (i = 0; array != NULL && i < array->len; i++) {
+		if (g_array_index (array, UpHistorySample, i).value == value)
+			count++;
+	}
+	return count;
+}
+
+static gboolean
+up_test_history_has_value (UpHistory *history, gdouble value)
+{
+	return up_test_history_count_value (history, value) > 0;
+}
+
+static void
+up_test_history_journal_func (void)
+{
+	UpHistory *history;
+	GStatBuf st;
+	gchar *filename;
+	gchar *data;
+	gsize length;
+	gsize size;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+
+	/* each save appends a block */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	g_assert (up_history_save_data (history));
+	g_assert_cmpint (g_stat (filename, &st), ==, 0);
+	size = st.st_size;
+	up_history_set_charge_data (history, 49);
+	g_assert (up_history_save_data (history));
+	g_object_unref (history);
+
+	/* damage the last block as a power cut in the middle of a save would */
+	g_assert (g_file_get_contents (filename, &data, &length, NULL));
+	g_assert_cmpint (length, >, size);
+	data[length - 1] ^= 0xff;
+	g_assert (g_file_set_contents (filename, data, length, NULL));
+	g_free (data);
+
+	/* only that block is lost */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	g_assert (up_test_history_has_value (history, 50));
+	g_assert (!up_test_history_has_value (history, 49));
+
+	/* and it is cut off before the next block is appended */
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 48);
+	g_assert (up_history_save_data (history));
+	g_object_unref (history);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	g_assert (up_test_history_has_value (history, 50));
+	g_assert (up_test_history_has_value (history, 48));
+	g_assert (!up_test_history_has_value (history, 49));
+	g_object_unref (history);
+
+	g_free (filename);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static gboolean
+up_test_history_view_has_value (const UpHistoryView *view, gdouble value)
+{
+	guint i;
+
+	for (i = 0; i < view->len; i++) {
+		if (up_history_view_get (view, i)->value == value)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+up_test_history_downsample_func (void)
+{
+	UpHistory *history;
+	UpHistoryView view;
+	GString *data;
+	gchar *filename;
+	gint64 start;
+	guint i;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* flat, with a spike and a dip */
+	start = g_get_real_time () / G_USEC_PER_SEC - 1000;
+	data = g_string_new (NULL);
+	for (i = 0; i < 100; i++)
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%.3f\tdischarging\n",
+					start + i, i == 37 ? 90.0 : i == 70 ? 10.0 : 50.0);
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	g_assert (g_file_set_contents (filename, data->str, -1, NULL));
+	g_free (filename);
+	g_string_free (data, TRUE);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* averaging flattens them */
+	g_assert (up_history_get_view (history, UP_HISTORY_TYPE_CHARGE, 0, 10,
+				       UP_HISTORY_DOWNSAMPLE_AVERAGE, &view));
+	g_assert (!up_test_history_view_has_value (&view, 90));
+	g_assert (!up_test_history_view_has_value (&view, 10));
+	up_history_view_clear (&view);
+
+	/* the others keep them, and the ends */
+	g_assert (up_history_get_view (history, UP_HISTORY_TYPE_CHARGE, 0, 10,
+				       UP_HISTORY_DOWNSAMPLE_LTTB, &view));
+	g_assert_cmpint (view.len, ==, 10);
+	g_assert_cmpint (up_history_view_get (&view, 0)->time, ==, start);
+	g_assert_cmpint (up_history_view_get (&view, 9)->state, ==, UP_DEVICE_STATE_UNKNOWN);
+	g_assert (up_test_history_view_has_value (&view, 90));
+	g_assert (up_test_history_view_has_value (&view, 10));
+	for (i = 1; i < view.len; i++)
+		g_assert_cmpint (up_history_view_get (&view, i)->time, >, up_history_view_get (&view, i - 1)->time);
+	up_history_view_clear (&view);
+
+	g_assert (up_history_get_view (history, UP_HISTORY_TYPE_CHARGE, 0, 10,
+				       UP_HISTORY_DOWNSAMPLE_MIN_MAX, &view));
+	g_assert_cmpint (view.len, <=, 10);
+	g_assert (up_test_history_view_has_value (&view, 90));
+	g_assert (up_test_history_view_has_value (&view, 10));
+	for (i = 1; i < view.len; i++)
+		g_assert_cmpint (up_history_view_get (&view, i)->time, >, up_history_view_get (&view, i - 1)->time);
+	up_history_view_clear (&view);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_sessions_func (void)
+{
+	UpHistory *history;
+	UpHistorySession *session;
+	GArray *array;
+	gchar *filename;
+	gchar *data;
+	gint64 start;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	start = g_get_real_time () / G_USEC_PER_SEC - 1000;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t45.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t46.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t60.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t100.000\tfully-charged\n",
+				start, start + 10, start + 20, start + 30, start + 40);
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	g_assert (g_file_set_contents (filename, data, -1, NULL));
+	g_free (filename);
+	g_free (data);
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t25.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t22.500\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t23.000\tcharging\n"
+				"%" G_GINT64_FORMAT "\t30.000\tcharging\n",
+				start, start + 10, start + 20, start + 30);
+	filename = g_build_filename (history_dir, "history-energy-test.dat", NULL);
+	g_assert (g_file_set_contents (filename, data, -1, NULL));
+	g_free (filename);
+	g_free (data);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+
+	/* the sessions are rebuilt on load */
+	array = up_history_get_sessions (history, 0);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3);
+	session = &g_array_index (array, UpHistorySession, 0);
+	g_assert_cmpint (session->start, ==, start);
+	g_assert_cmpint (session->end, ==, start + 10);
+	g_assert_cmpint (session->state, ==, UP_DEVICE_STATE_DISCHARGING);
+	g_assert_cmpfloat (session->start_charge, ==, 50);
+	g_assert_cmpfloat (session->end_charge, ==, 45);
+	g_assert_cmpfloat_with_epsilon (session->energy, -2.5, 0.01);
+	session = &g_array_index (array, UpHistorySession, 1);
+	g_assert_cmpint (session->start, ==, start + 20);
+	g_assert_cmpint (session->end, ==, start + 30);
+	g_assert_cmpint (session->state, ==, UP_DEVICE_STATE_CHARGING);
+	g_assert_cmpfloat_with_epsilon (session->energy, 7, 0.01);
+	session = &g_array_index (array, UpHistorySession, 2);
+	g_assert_cmpint (session->state, ==, UP_DEVICE_STATE_FULLY_CHARGED);
+	g_assert_cmpfloat (session->energy, ==, 0);
+	g_array_unref (array);
+
+	/* a restart ends the session, and new samples start the next one */
+	up_history_set_state (history, UP_DEVICE_STATE_FULLY_CHARGED);
+	g_assert (up_history_set_charge_data (history, 100));
+	array = up_history_get_sessions (history, start + 15);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3);
+	session = &g_array_index (array, UpHistorySession, 0);
+	g_assert_cmpint (session->state, ==, UP_DEVICE_STATE_CHARGING);
+	session = &g_array_index (array, UpHistorySession, 2);
+	g_assert_cmpint (session->state, ==, UP_DEVICE_STATE_FULLY_CHARGED);
+	g_assert_cmpint (session->start, >, start + 40);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static UpHistory *
+up_test_history_new_staged (const gchar *staging_dir)
+{
+	UpHistory *history;
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_staging_directory (history, staging_dir);
+	up_history_set_persist_interval (history, 2);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	return history;
+}
+
+static void
+up_test_history_staging_func (void)
+{
+	UpHistory *history;
+	UpHistoryProfileStat stats[UP_HISTORY_PROFILE_BINS];
+	GStatBuf st;
+	gchar *staging_dir;
+	gchar *filename;
+	gchar *staged_filename;
+	gchar *profile_filename;
+	gchar *data;
+	gchar *staged_data;
+	gchar *profile_data;
+	gsize length;
+	gsize staged_length;
+	gsize profile_length;
+	gsize size;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	staging_dir = g_build_filename (history_dir, "staging", NULL);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	staged_filename = g_build_filename (staging_dir, "history-test.bin", NULL);
+	profile_filename = g_build_filename (history_dir, "history-test-profile.bin", NULL);
+
+	/* saves only go to the staging directory */
+	history = up_test_history_new_staged (staging_dir);
+	up_history_set_charge_data (history, 50);
+	g_assert (up_history_save_data (history));
+	up_history_set_charge_data (history, 49);
+	g_assert (up_history_save_data (history));
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_assert (g_file_test (staged_filename, G_FILE_TEST_EXISTS));
+
+	/* until the persist interval has passed */
+	g_usleep (2 * G_USEC_PER_SEC);
+	up_history_set_charge_data (history, 48);
+	g_assert (up_history_save_data (history));
+	g_assert (!g_file_test (staged_filename, G_FILE_TEST_EXISTS));
+	g_assert_cmpint (g_stat (filename, &st), ==, 0);
+	size = st.st_size;
+
+	/* and then it starts again */
+	up_history_set_charge_data (history, 47);
+	g_assert (up_history_save_data (history));
+	g_assert (g_file_test (staged_filename, G_FILE_TEST_EXISTS));
+	g_assert_cmpint (g_stat (filename, &st), ==, 0);
+	g_assert_cmpint (st.st_size, ==, size);
+
+	/* unless asked to persist */
+	g_assert (up_history_persist_data (history));
+	g_assert (!g_file_test (staged_filename, G_FILE_TEST_EXISTS));
+	g_assert_cmpint (g_stat (filename, &st), ==, 0);
+	g_assert_cmpint (st.st_size, >, size);
+
+	/* the daemon dies with samples staged */
+	up_history_set_charge_data (history, 46);
+	up_history_set_charge_data (history, 45);
+	g_assert (up_history_save_data (history));
+	g_assert (g_file_get_contents (filename, &data, &length, NULL));
+	g_assert (g_file_get_contents (staged_filename, &staged_data, &staged_length, NULL));
+	g_assert (g_file_get_contents (profile_filename, &profile_data, &profile_length, NULL));
+	g_object_unref (history);
+	g_assert (g_file_set_contents (filename, data, length, NULL));
+	g_assert (g_file_set_contents (staged_filename, staged_data, staged_length, NULL));
+	g_assert (g_file_set_contents (profile_filename, profile_data, profile_length, NULL));
+
+	/* so they are loaded from the staging directory */
+	history = up_test_history_new_staged (staging_dir);
+	g_assert_cmpint (up_test_history_count_value (history, 50), ==, 1);
+	g_assert_cmpint (up_test_history_count_value (history, 46), ==, 1);
+
+	/* and counted in the profile, which was saved before them */
+	g_assert (up_history_get_profile_data (history, FALSE, stats));
+	g_assert_cmpfloat (stats[45].accuracy, ==, 20);
+	g_object_unref (history);
+
+	/* but not twice if they had been persisted already */
+	g_assert (g_file_set_contents (staged_filename, staged_data, staged_length, NULL));
+	history = up_test_history_new_staged (staging_dir);
+	g_assert_cmpint (up_test_history_count_value (history, 46), ==, 1);
+	g_object_unref (history);
+
+	g_free (data);
+	g_free (staged_data);
+	g_free (profile_data);
+	g_unlink (staged_filename);
+	rmdir (staging_dir);
+	g_free (profile_filename);
+	g_free (staged_filename);
+	g_free (filename);
+	g_free (staging_dir);
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_writer_func (void)
+{
+	UpHistoryWriter *writer;
+	UpHistory *history;
+	UpHistory *history2;
+	gchar *filename;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	writer = up_history_writer_new ();
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_writer (history, writer);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	history2 = up_history_new ();
+	up_history_set_directory (history2, history_dir);
+	up_history_set_writer (history2, writer);
+	up_history_set_id (history2, "test2");
+	up_test_history_wait_loaded (history2);
+
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_state (history2, UP_DEVICE_STATE_CHARGING);
+	up_history_set_charge_data (history2, 20);
+
+	/* both are saved by a single commit */
+	g_assert (up_history_writer_flush (writer));
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-test2.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+
+	g_object_unref (history);
+	g_object_unref (history2);
+	g_object_unref (writer);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_profile_func (void)
+{
+	UpHistory *history;
+	UpHistoryProfileStat stats[UP_HISTORY_PROFILE_BINS];
+	gchar *filename;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50);
+	up_history_set_charge_data (history, 49);
+	up_history_set_charge_data (history, 48);
+	up_history_set_charge_data (history, 47);
+
+	/* the first step after a state change only starts the profile */
+	g_assert (up_history_get_profile_data (history, FALSE, stats));
+	g_assert_cmpfloat (stats[49].accuracy, ==, 0);
+	g_assert_cmpfloat (stats[48].accuracy, ==, 20);
+	g_assert_cmpfloat (stats[47].accuracy, ==, 20);
+	g_assert (up_history_get_profile_data (history, TRUE, stats));
+	g_assert_cmpfloat (stats[48].accuracy, ==, 0);
+	g_assert (up_history_save_data (history));
+	g_object_unref (history);
+
+	/* it outlives the samples */
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_unlink (filename);
+	g_free (filename);
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	g_assert (up_history_get_profile_data (history, FALSE, stats));
+	g_assert_cmpfloat (stats[48].accuracy, ==, 20);
+	g_assert_cmpfloat (stats[47].accuracy, ==, 20);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_migrate_func (void)
+{
+	UpHistory *history;
+	GArray *array;
+	UpHistorySample *item;
+	gchar *filename;
+	gchar *data;
+	gint64 time_now;
+	gboolean ret;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* write a history file in the old text format, with some damage */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_strdup_printf ("%" G_GINT64_FORMAT "\t50.000\tdischarging\n"
+				"garbage\n"
+				"\n"
+				"%" G_GINT64_FORMAT "\tfifty\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t49.000\tdischarging\n"
+				"%" G_GINT64_FORMAT "\t48.0",
+				time_now - 2, time_now - 2, time_now - 1, time_now);
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	ret = g_file_set_contents (filename, data, -1, NULL);
+	g_assert (ret);
+	g_free (data);
+
+	/* it is imported on load */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3);
+	item = &g_array_index (array, UpHistorySample, 1);
+	g_assert_cmpint (item->value, ==, 49);
+	g_assert_cmpint (item->state, ==, UP_DEVICE_STATE_DISCHARGING);
+	g_array_unref (array);
+
+	/* and replaced by the binary file on save */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_object_unref (history);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+
+	/* the binary file has the same data */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 10, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 4);
+	item = &g_array_index (array, UpHistorySample, 2);
+	g_assert_cmpint (item->value, ==, 49);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_memory_func (void)
+{
+	UpHistory *history;
+	UpHistory *history2;
+	UpHistoryView view;
+	GArray *array;
+	gboolean ret;
+	gsize budget;
+	gsize memory;
+	guint len;
+	guint i;
+
+	memory = up_history_get_total_memory ();
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	history2 = up_history_new ();
+	up_history_set_directory (history2, history_dir);
+	up_history_set_id (history2, "test2");
+	up_test_history_wait_loaded (history2);
+	up_history_set_state (history2, UP_DEVICE_STATE_CHARGING);
+
+	/* samples older than the maximum age are dropped as new ones arrive */
+	up_history_set_max_data_age (history, 1);
+	up_history_set_charge_data (history, 50);
+	g_usleep (2 * G_USEC_PER_SEC);
+	up_history_set_charge_data (history, 51);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 10000);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 1);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 0).value, ==, 51);
+	g_array_unref (array);
+	up_history_set_max_data_age (history, 24*60*60);
+
+	/* fill both, and query the first one last */
+	for (i = 0; i < 1000; i++) {
+		up_history_set_charge_data (history, i % 2 ? 10 : 20);
+		up_history_set_charge_data (history2, i % 2 ? 10 : 20);
+	}
+	array = up_history_get_data (history2, UP_HISTORY_TYPE_CHARGE, 0, 10000);
+	len = array->len;
+	g_array_unref (array);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 10000);
+	g_assert_cmpint (array->len, ==, 1001);
+	g_array_unref (array);
+
+	/* going over the budget downsamples the least recently queried one,
+	 * but only the samples that are saved */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	ret = up_history_save_data (history2);
+	g_assert (ret);
+	budget = up_history_get_total_memory () - 1;
+	up_history_set_memory_budget (budget);
+	g_assert_cmpint (up_history_get_total_memory (), <=, budget);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 10000);
+	g_assert_cmpint (array->len, ==, 1001);
+	g_array_unref (array);
+
+	/* and querying it answers at the reduced resolution, within the budget */
+	ret = up_history_get_view (history2, UP_HISTORY_TYPE_CHARGE, 0, 0,
+				   UP_HISTORY_DOWNSAMPLE_AVERAGE, &view);
+	g_assert (ret);
+	g_assert (view.reduced);
+	g_assert_cmpint (view.len, <, len);
+	up_history_view_clear (&view);
+	array = up_history_get_data (history2, UP_HISTORY_TYPE_CHARGE, 0, 10000);
+	g_assert_cmpint (array->len, <, len);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, array->len - 1).value, ==, 10);
+	g_array_unref (array);
+	g_assert_cmpint (up_history_get_total_memory (), <=, budget);
+	up_history_set_memory_budget (G_MAXSIZE);
+
+	g_object_unref (history);
+	g_object_unref (history2);
+	g_assert_cmpint (up_history_get_total_memory (), ==, memory);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
+static void
+up_test_history_rollup_func (void)
+{
+	UpHistory *history;
+	GArray *array;
+	GString *data;
+	GStatBuf st;
+	gchar *filename;
+	gint64 time_now;
+	gsize legacy_size;
+	gboolean ret;
+	guint i;
+
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+
+	/* two days of samples, one every minute */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i < 2 * 24 * 60; i++) {
+		g_string_append_printf (data, "%" G_GINT64_FORMAT "\t%.3f\tdischarging\n",
+					time_now - 2 * 24 * 60 * 60 + i * 60, 100.f - i / 30.f);
+	}
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	ret = g_file_set_contents (filename, data->str, -1, NULL);
+	g_assert (ret);
+	legacy_size = data->len;
+	g_string_free (data, TRUE);
+	g_free (filename);
+
+	/* the hourly buckets are built on load and saved */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_object_unref (history);
+	filename = g_build_filename (history_dir, "history-test-hourly.bin", NULL);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+
+	/* the samples take a fraction of the space of the text format */
+	filename = g_build_filename (history_dir, "history-test.bin", NULL);
+	g_assert_cmpint (g_stat (filename, &st), ==, 0);
+	g_assert_cmpint (st.st_size * 5, <=, legacy_size);
+
+	/* and answer long timespans, even once the raw samples are gone */
+	g_unlink (filename);
+	g_free (filename);
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_wait_loaded (history);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 2 * 24 * 60 * 60, 48);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >=, 40);
+	g_assert_cmpint (array->len, <=, 49);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 1).time, <,
+			 g_array_index (array, UpHistorySample, 0).time);
+	g_assert_cmpint (g_array_index (array, UpHistorySample, 1).state, ==, UP_DEVICE_STATE_DISCHARGING);
+	g_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+}
+
 static void
 up_test_polkit_func (void)
 {
@@ -312,10 +1704,30 @@ main (int argc, char **argv)
 	/* tests go here */
 	g_test_add_func ("/power/backend", up_test_backend_func);
 	g_test_add_func ("/power/device", up_test_device_func);
+	g_test_add_func ("/power/device_refresh", up_test_device_refresh_func);
+	g_test_add_func ("/power/device_backoff", up_test_device_backoff_func);
 	g_test_add_func ("/power/device_list", up_test_device_list_func);
 	g_test_add_func ("/power/history", up_test_history_func);
+	g_test_add_func ("/power/history_load", up_test_history_load_func);
+	g_test_add_func ("/power/history_metrics", up_test_history_metrics_func);
+	g_test_add_func ("/power/history_deadband", up_test_history_deadband_func);
+	g_test_add_func ("/power/history_aggregated", up_test_history_aggregated_func);
+	g_test_add_func ("/power/history_export", up_test_history_export_func);
+	g_test_add_func ("/power/history_journal", up_test_history_journal_func);
+	g_test_add_func ("/power/history_downsample", up_test_history_downsample_func);
+	g_test_add_func ("/power/history_sessions", up_test_history_sessions_func);
+	g_test_add_func ("/power/history_staging", up_test_history_staging_func);
+	g_test_add_func ("/power/history_writer", up_test_history_writer_func);
+	g_test_add_func ("/power/history_profile", up_test_history_profile_func);
+	g_test_add_func ("/power/history_migrate", up_test_history_migrate_func);
+	g_test_add_func ("/power/history_memory", up_test_history_memory_func);
+	g_test_add_func ("/power/history_rollup", up_test_history_rollup_func);
 	g_test_add_func ("/power/native", up_test_native_func);
 	g_test_add_func ("/power/polkit", up_test_polkit_func);
+	g_test_add_func ("/power/event_log", up_test_event_log_func);
+	g_test_add_func ("/power/poll_queue", up_test_poll_queue_func);
+	g_test_add_func ("/power/poll_align", up_test_poll_align_func);
+	g_test_add_func ("/power/battery_poll", up_test_battery_poll_func);
 	g_test_add_func ("/power/daemon", up_test_daemon_func);
 
 	return g_test_run ();